@@ -0,0 +1,240 @@
+#include "shell.h"
+
+#include <ctype.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+/*
+** CPU and NUMA placement of pipeline stages, set with the affinity
+** shell option:
+**
+**   affinity=0-3/4-7/8     stage i runs on list i (cycling through them)
+**   affinity=node:1        every stage runs on node 1's CPUs, and
+**                          allocates its memory there when it can
+**   affinity=auto          stage i is pinned to the i-th CPU in topology
+**                          order, so neighbouring stages share a package
+**   affinity=none          no placement (the default)
+**
+** The lists are worked out when the option is set; the child branch of
+** run_command only has to pick its stage's set.
+*/
+
+enum { AFF_NONE, AFF_LISTS, AFF_NODE, AFF_AUTO };
+
+static struct {
+    int mode;
+    cpu_set_t *sets;        // one per stage slot, stage i uses i % num_sets
+    size_t num_sets;
+    int node;               // AFF_NODE only
+} placement = { .mode = AFF_NONE };
+
+
+// parses a kernel-style CPU list such as "0-3,8,10-11"
+static int parse_cpu_list(const char *text, cpu_set_t *set){
+    CPU_ZERO(set);
+    const char *p = text;
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0) return -1;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first) return -1;
+            p = end;
+        }
+        if (last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p != '\0' && !isspace((unsigned char)*p)) {
+            return -1;
+        } else {
+            break;
+        }
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+// reads a small integer out of a sysfs file, -1 if there is none
+static long read_sysfs_long(const char *path){
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    long value;
+    if (fscanf(f, "%ld", &value) != 1) value = -1;
+    fclose(f);
+    return value;
+}
+
+typedef struct CpuPos {
+    int cpu;
+    long package;
+    long core;
+    int thread;             // 0 for the first hardware thread of a core
+} CpuPos;
+
+static int compare_pos(const void *a, const void *b){
+    const CpuPos *x = a, *y = b;
+    if (x->package != y->package) return x->package < y->package ? -1 : 1;
+    if (x->thread != y->thread) return x->thread - y->thread;
+    if (x->core != y->core) return x->core < y->core ? -1 : 1;
+    return x->cpu - y->cpu;
+}
+
+/*
+** One single-CPU set per CPU the shell may run on, ordered so that
+** consecutive stages land on different physical cores of the same
+** package, moving on to SMT siblings and then the next package only
+** once a package's cores are used up.
+*/
+static int build_auto_sets(void){
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity");
+        return -1;
+    }
+    int count = CPU_COUNT(&allowed);
+    CpuPos *pos = calloc(count, sizeof(CpuPos));
+    cpu_set_t *sets = calloc(count, sizeof(cpu_set_t));
+    if (pos == NULL || sets == NULL) {
+        perror("affinity");
+        free(pos);
+        free(sets);
+        return -1;
+    }
+
+    int n = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < count; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        char path[MAX_PATH_STR];
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        pos[n].package = read_sysfs_long(path);
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        pos[n].core = read_sysfs_long(path);
+        if (pos[n].core < 0) pos[n].core = cpu;
+        pos[n].cpu = cpu;
+        for (int j = 0; j < n; j++) {
+            if (pos[j].package == pos[n].package && pos[j].core == pos[n].core) {
+                pos[n].thread++;
+            }
+        }
+        n++;
+    }
+    qsort(pos, n, sizeof(CpuPos), compare_pos);
+
+    for (int i = 0; i < n; i++) {
+        CPU_ZERO(&sets[i]);
+        CPU_SET(pos[i].cpu, &sets[i]);
+    }
+    free(pos);
+    free(placement.sets);
+    placement.sets = sets;
+    placement.num_sets = n;
+    return 0;
+}
+
+static int build_node_set(int node){
+    char path[MAX_PATH_STR], list[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return -1;
+    int ok = fgets(list, sizeof(list), f) != NULL;
+    fclose(f);
+
+    cpu_set_t *set = malloc(sizeof(cpu_set_t));
+    if (!ok || set == NULL || parse_cpu_list(list, set) < 0) {
+        free(set);
+        return -1;
+    }
+    free(placement.sets);
+    placement.sets = set;
+    placement.num_sets = 1;
+    placement.node = node;
+    return 0;
+}
+
+static int build_list_sets(const char *value){
+    size_t count = 1;
+    for (const char *p = value; *p; p++) {
+        if (*p == '/') count++;
+    }
+    cpu_set_t *sets = calloc(count, sizeof(cpu_set_t));
+    char *copy = strdup(value);
+    if (sets == NULL || copy == NULL) {
+        perror("affinity");
+        free(sets);
+        free(copy);
+        return -1;
+    }
+
+    size_t i = 0;
+    char *save = NULL;
+    for (char *list = strtok_r(copy, "/", &save); list != NULL;
+         list = strtok_r(NULL, "/", &save)) {
+        if (parse_cpu_list(list, &sets[i++]) < 0) {
+            free(sets);
+            free(copy);
+            return -1;
+        }
+    }
+    free(copy);
+    if (i != count) {       // an empty list, as in "0-3//4"
+        free(sets);
+        return -1;
+    }
+    free(placement.sets);
+    placement.sets = sets;
+    placement.num_sets = count;
+    return 0;
+}
+
+
+int affinity_set(const char *value){
+    int bad;
+    if (*value == '\0' || strcmp(value, "none") == 0) {
+        free(placement.sets);
+        placement.sets = NULL;
+        placement.num_sets = 0;
+        placement.mode = AFF_NONE;
+        return 0;
+    }
+    if (strcmp(value, "auto") == 0) {
+        bad = build_auto_sets();
+        if (!bad) placement.mode = AFF_AUTO;
+    } else if (strncmp(value, "node:", 5) == 0) {
+        char *end;
+        long node = strtol(value + 5, &end, 10);
+        bad = (end == value + 5 || *end != '\0' || node < 0 || node > 1023) ||
+            build_node_set((int) node);
+        if (!bad) placement.mode = AFF_NODE;
+    } else {
+        bad = build_list_sets(value);
+        if (!bad) placement.mode = AFF_LISTS;
+    }
+    return bad ? -1 : 0;
+}
+
+void affinity_apply_child(int stage){
+    if (placement.mode == AFF_NONE || placement.num_sets == 0) return;
+
+    // placement is advisory: a CPU that went offline must not stop the command
+    cpu_set_t *set = &placement.sets[stage % placement.num_sets];
+    if (sched_setaffinity(0, sizeof(cpu_set_t), set) < 0) {
+        perror("sched_setaffinity");
+    }
+    if (placement.mode == AFF_NODE) {
+        unsigned long mask[1024 / (8 * sizeof(unsigned long))] = { 0 };
+        size_t bits = 8 * sizeof(unsigned long);
+        mask[placement.node / bits] |= 1UL << (placement.node % bits);
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+                    (unsigned long) (sizeof(mask) * 8)) < 0) {
+            perror("set_mempolicy");
+        }
+    }
+}
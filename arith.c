@@ -0,0 +1,295 @@
+#include "shell.h"
+
+#include <ctype.h>
+
+/*
+** In-process arithmetic for $(( expr )) and (( expr )).
+**
+** A precedence-climbing evaluator over 64-bit integers with the C
+** operator set the shells use: assignment (= += -= *= /= %= <<= >>=
+** &= ^= |=), ?:, || &&, | ^ &, == !=, < <= > >=, << >>, + -, * / %,
+** unary + - ! ~, and ++/-- on variables. Variables are read by name
+** (with or without '$'); unset or empty ones count as 0. Assignments
+** update the variable list directly.
+*/
+
+typedef struct Arith {
+    const char *p;
+    Variable **vars;
+    int error;
+} Arith;
+
+// binary operators by precedence, higher binds tighter
+typedef struct BinOp {
+    const char *text;
+    int prec;
+} BinOp;
+
+static const BinOp bin_ops[] = {
+    { "||", 1 }, { "&&", 2 }, { "|", 3 }, { "^", 4 }, { "&", 5 },
+    { "==", 6 }, { "!=", 6 },
+    { "<<", 8 }, { ">>", 8 },     // ahead of "<" so they match whole
+    { "<=", 7 }, { ">=", 7 }, { "<", 7 }, { ">", 7 },
+    { "+", 9 }, { "-", 9 },
+    { "*", 10 }, { "/", 10 }, { "%", 10 },
+};
+
+static const char *assign_ops[] = {
+    "<<=", ">>=", "+=", "-=", "*=", "/=", "%=", "&=", "^=", "|=", "=",
+};
+
+static long long parse_ternary(Arith *a, int eval);
+
+
+static void skip_space(Arith *a){
+    while (isspace((unsigned char)*a->p)) a->p++;
+}
+
+static int arith_error(Arith *a, const char *what){
+    if (!a->error) {
+        ERR_PRINT(ERR_ARITH, what, a->p);
+    }
+    a->error = 1;
+    return 0;
+}
+
+static size_t ident_length(const char *p){
+    size_t len = 0;
+    if (!isValidVarChar(p[0])) return 0;
+    while (isValidVarChar(p[len]) || isdigit((unsigned char)p[len])) len++;
+    return len;
+}
+
+static Variable *lookup(Arith *a, const char *name, size_t len){
+    for (Variable *var = *a->vars; var; var = var->next) {
+        if (strncmp(var->name, name, len) == 0 && var->name[len] == '\0') {
+            return var;
+        }
+    }
+    return NULL;
+}
+
+static long long read_var(Arith *a, const char *name, size_t len){
+    Variable *var = lookup(a, name, len);
+    if (var == NULL || var->value[0] == '\0') return 0;
+    char *end;
+    long long value = strtoll(var->value, &end, 0);
+    while (isspace((unsigned char)*end)) end++;
+    if (*end != '\0') {
+        arith_error(a, "variable is not a number");
+    }
+    return value;
+}
+
+static void write_var(Arith *a, const char *name, size_t len, long long value){
+    char var_name[MAX_USER_BUF];
+    char text[32];
+    if (len >= sizeof(var_name)) {
+        arith_error(a, "variable name too long");
+        return;
+    }
+    memcpy(var_name, name, len);
+    var_name[len] = '\0';
+    snprintf(text, sizeof(text), "%lld", value);
+    if (addOrUpdateVariable(a->vars, var_name, text) < 0) {
+        a->error = 1;
+    }
+}
+
+// applies a binary operator, checking division by zero
+static long long apply(Arith *a, const char *op, long long l, long long r){
+    switch (op[0]) {
+        case '+': return (long long) ((unsigned long long) l + r);
+        case '-': return (long long) ((unsigned long long) l - r);
+        case '*': return (long long) ((unsigned long long) l * r);
+        case '/':
+        case '%':
+            if (r == 0) return arith_error(a, "division by zero");
+            // -l would overflow for LLONG_MIN, so it wraps like unary minus
+            if (r == -1) {
+                return op[0] == '/' ? (long long) (0ULL - (unsigned long long) l) : 0;
+            }
+            return op[0] == '/' ? l / r : l % r;
+        case '<':
+            if (op[1] == '<') return (long long) ((unsigned long long) l << (r & 63));
+            return op[1] == '=' ? l <= r : l < r;
+        case '>':
+            if (op[1] == '>') return l >> (r & 63);
+            return op[1] == '=' ? l >= r : l > r;
+        case '=': return l == r;
+        case '!': return l != r;
+        case '&': return op[1] == '&' ? (l && r) : (l & r);
+        case '|': return op[1] == '|' ? (l || r) : (l | r);
+        case '^': return l ^ r;
+    }
+    return arith_error(a, "unknown operator");
+}
+
+static long long parse_unary(Arith *a, int eval){
+    skip_space(a);
+    const char *p = a->p;
+
+    // ++x / --x
+    if ((p[0] == '+' || p[0] == '-') && p[1] == p[0]) {
+        a->p += 2;
+        skip_space(a);
+        size_t len = ident_length(a->p);
+        if (len == 0) return arith_error(a, "++/-- needs a variable");
+        const char *name = a->p;
+        a->p += len;
+        if (!eval) return 0;
+        long long value = read_var(a, name, len) + (p[0] == '+' ? 1 : -1);
+        write_var(a, name, len, value);
+        return value;
+    }
+    if (*p == '+' || *p == '-' || *p == '!' || *p == '~') {
+        a->p++;
+        long long value = parse_unary(a, eval);
+        switch (*p) {
+            case '-': return (long long) (0ULL - (unsigned long long) value);
+            case '!': return !value;
+            case '~': return ~value;
+        }
+        return value;
+    }
+
+    if (*p == '(') {
+        a->p++;
+        long long value = parse_ternary(a, eval);
+        skip_space(a);
+        if (*a->p != ')') return arith_error(a, "missing ')'");
+        a->p++;
+        return value;
+    }
+
+    if (isdigit((unsigned char)*p)) {
+        char *end;
+        long long value = (long long) strtoull(p, &end, 0);
+        if (isValidVarChar(*end) || isdigit((unsigned char)*end)) {
+            return arith_error(a, "bad number");
+        }
+        a->p = end;
+        return value;
+    }
+
+    // $name and ${name} read the variable like a bare name, $1 a
+    // positional parameter
+    int marked = 0, braced = 0;
+    if (*p == VARIABLE_PARSE_MARKER) {
+        p++;
+        marked = 1;
+        if (*p == '{') {
+            p++;
+            braced = 1;
+        }
+        a->p = p;
+    }
+    size_t len = marked && isdigit((unsigned char)*p) ? 1 : ident_length(p);
+    if (len == 0) {
+        return arith_error(a, *p ? "unexpected character" : "missing operand");
+    }
+    a->p += len;
+    if (len == 1 && isdigit((unsigned char)*p) && !braced) {
+        return eval ? read_var(a, p, len) : 0;
+    }
+    if (braced) {
+        if (*a->p != '}') return arith_error(a, "missing '}'");
+        a->p++;
+        return eval ? read_var(a, p, len) : 0;
+    }
+    skip_space(a);
+
+    // assignment operators bind weakest and to the right
+    for (size_t i = 0; i < sizeof(assign_ops) / sizeof(assign_ops[0]); i++) {
+        size_t op_len = strlen(assign_ops[i]);
+        if (strncmp(a->p, assign_ops[i], op_len) != 0) continue;
+        if (op_len == 1 && a->p[1] == '=') break;   // that is ==
+        a->p += op_len;
+        long long rhs = parse_ternary(a, eval);
+        if (!eval || a->error) return 0;
+        long long value = rhs;
+        if (op_len > 1) {
+            char op[3] = { assign_ops[i][0], 0, 0 };
+            if (op_len == 3) op[1] = op[0];     // <<= and >>=
+            value = apply(a, op, read_var(a, p, len), rhs);
+        }
+        write_var(a, p, len, value);
+        return value;
+    }
+
+    // x++ / x--
+    if ((a->p[0] == '+' || a->p[0] == '-') && a->p[1] == a->p[0]) {
+        char op = a->p[0];
+        a->p += 2;
+        if (!eval) return 0;
+        long long value = read_var(a, p, len);
+        write_var(a, p, len, value + (op == '+' ? 1 : -1));
+        return value;
+    }
+
+    return eval ? read_var(a, p, len) : 0;
+}
+
+// matches the binary operator at the cursor, or returns NULL
+static const BinOp *peek_binop(Arith *a){
+    skip_space(a);
+    for (size_t i = 0; i < sizeof(bin_ops) / sizeof(bin_ops[0]); i++) {
+        size_t len = strlen(bin_ops[i].text);
+        if (strncmp(a->p, bin_ops[i].text, len) != 0) continue;
+        // `+=`, `<<=`... only follow a variable, handled in parse_unary
+        if (a->p[len] == '=' && bin_ops[i].prec != 6 && bin_ops[i].prec != 7) {
+            return NULL;
+        }
+        return &bin_ops[i];
+    }
+    return NULL;
+}
+
+static long long parse_binary(Arith *a, int min_prec, int eval){
+    long long lhs = parse_unary(a, eval);
+    const BinOp *op;
+
+    while (!a->error && (op = peek_binop(a)) != NULL && op->prec >= min_prec) {
+        a->p += strlen(op->text);
+        // && and || do not evaluate a right side that cannot matter
+        int rhs_eval = eval;
+        if (strcmp(op->text, "&&") == 0 && !lhs) rhs_eval = 0;
+        if (strcmp(op->text, "||") == 0 && lhs) rhs_eval = 0;
+        long long rhs = parse_binary(a, op->prec + 1, rhs_eval);
+        if (eval && rhs_eval) {
+            lhs = apply(a, op->text, lhs, rhs);
+        } else if (eval) {
+            lhs = (op->text[0] == '|');
+        }
+    }
+    return lhs;
+}
+
+static long long parse_ternary(Arith *a, int eval){
+    long long cond = parse_binary(a, 1, eval);
+    skip_space(a);
+    if (*a->p != '?') return cond;
+    a->p++;
+    long long yes = parse_ternary(a, eval && cond);
+    skip_space(a);
+    if (*a->p != ':') return arith_error(a, "missing ':'");
+    a->p++;
+    long long no = parse_ternary(a, eval && !cond);
+    return cond ? yes : no;
+}
+
+int arith_eval(const char *expr, Variable **variables, long long *result){
+    Arith a = { .p = expr, .vars = variables, .error = 0 };
+    skip_space(&a);
+    long long value = 0;
+    if (*a.p != '\0') {
+        value = parse_ternary(&a, 1);
+    }
+    skip_space(&a);
+    if (!a.error && *a.p != '\0') {
+        arith_error(&a, "unexpected character");
+    }
+    if (a.error) return -1;
+    *result = value;
+    return 0;
+}
@@ -0,0 +1,47 @@
+#!/bin/sh
+# Counter loop in the shell: in-process (( )) arithmetic against one
+# external `expr` per iteration, the only option before $(( )).
+#
+#   bench/arith_bench.sh [ITERATIONS] [EXPR_ITERATIONS]
+#
+# The expr loop forks on every pass, so it runs fewer iterations by
+# default; both lines report the cost per iteration.
+
+SHELL_BIN=${SHELL_BIN:-./shell}
+N=${1:-1000000}
+EXPR_N=${2:-10000}
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+echo "PATH=$(dirname "$(command -v expr)"):/usr/bin:/bin" > "$tmp/init"
+
+cat > "$tmp/arith" <<SCRIPT
+i=0
+while (( i < $N )); do
+    (( i += 1 ))
+done
+echo \$i
+SCRIPT
+
+# no command substitution in the shell, so the result of expr is
+# discarded and the counter still advances in-process
+cat > "$tmp/expr" <<SCRIPT
+i=0
+while (( i < $EXPR_N )); do
+    expr \$i + 1 > /dev/null
+    (( i += 1 ))
+done
+echo \$i
+SCRIPT
+
+run() {
+    start=$(date +%s%N)
+    out=$("$SHELL_BIN" -i "$tmp/init" "$tmp/$1") || exit 1
+    end=$(date +%s%N)
+    printf '%-6s %9d iterations %8d ms %10d ns/iteration\n' \
+        "$1" "$out" $(( (end - start) / 1000000 )) $(( (end - start) / $2 ))
+}
+
+run arith "$N"
+run expr "$EXPR_N"
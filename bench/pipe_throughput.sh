@@ -0,0 +1,58 @@
+#!/bin/sh
+# Throughput of 2-, 4- and 8-stage pipelines run by the shell: a
+# generator (head -c from /dev/zero), cat relays, and a cat sink to
+# /dev/null. Each pipeline runs at the default pipe size and at every
+# pipesize= given.
+#
+#   bench/pipe_throughput.sh [BYTES] [PIPESIZE...]
+#
+# e.g. bench/pipe_throughput.sh 4G 256K 1M
+
+SHELL_BIN=${SHELL_BIN:-./shell}
+BYTES=${1:-2G}
+[ $# -gt 0 ] && shift
+SIZES=${*:-1M}
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+
+echo "PATH=/usr/bin:/bin" > "$tmp/init"
+
+case $BYTES in
+    *K) total=$(( ${BYTES%K} * 1024 )) ;;
+    *M) total=$(( ${BYTES%M} * 1024 * 1024 )) ;;
+    *G) total=$(( ${BYTES%G} * 1024 * 1024 * 1024 )) ;;
+    *)  total=$BYTES ;;
+esac
+
+run() {
+    stages=$1
+    pipesize=$2
+    line="head -c $BYTES /dev/zero"
+    i=2
+    while [ $i -lt "$stages" ]; do
+        line="$line | cat"
+        i=$((i + 1))
+    done
+    line="$line | cat > /dev/null"
+
+    : > "$tmp/script"
+    [ "$pipesize" != default ] && echo "pipesize=$pipesize" >> "$tmp/script"
+    echo "$line" >> "$tmp/script"
+
+    start=$(date +%s%N)
+    "$SHELL_BIN" -i "$tmp/init" "$tmp/script" || exit 1
+    end=$(date +%s%N)
+    ms=$(( (end - start) / 1000000 ))
+    [ "$ms" -gt 0 ] || ms=1
+    mbps=$(( total / 1048576 * 1000 / ms ))
+    printf '%d stages  pipesize=%-8s %8d ms %4d.%02d GB/s\n' \
+        "$stages" "$pipesize" "$ms" $((mbps / 1024)) $((mbps % 1024 * 100 / 1024))
+}
+
+for stages in 2 4 8; do
+    run "$stages" default
+    for size in $SIZES; do
+        run "$stages" "$size"
+    done
+done
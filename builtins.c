@@ -0,0 +1,345 @@
+#include "shell.h"
+
+#include <ctype.h>
+
+/*
+** Builtins that run inside the shell process: echo, read, true, false,
+** and stats, which prints the shell's metrics (see metrics.c).
+**
+** A line made of a single builtin never forks (see job_start); inside a
+** longer pipeline the builtin runs in the forked stage instead of an
+** exec. Together with (( )) this lets a `while read` loop run without
+** creating a single process.
+**
+** read takes its lines from the shell's input: stdin, or the file a
+** loop is redirected from (`done < file`). Seekable input is read
+** through one shared SHELL_READ_BUF buffer; since other processes read
+** the same file, the unread part of the buffer is handed back with an
+** lseek before a child can see the fd. Pipes and terminals cannot be
+** given back, so they are read a byte at a time and never over-read.
+*/
+
+typedef struct Builtin {
+    const char *name;
+    BuiltinFunc func;
+} Builtin;
+
+static struct {
+    int fd;                 // fd the buffer holds data of, -1 for none
+    int seekable;
+    char *buf;
+    size_t start, end;      // unread data is buf[start, end)
+    char *line;
+    size_t line_cap;
+} input = { .fd = -1 };
+
+// files loops are redirected from, innermost last
+static int input_stack[MAX_INPUT_DEPTH];
+static int input_depth = 0;
+
+
+int shell_input_fd(void){
+    return input_depth > 0 ? input_stack[input_depth - 1] : STDIN_FILENO;
+}
+
+int shell_input_push(const char *path){
+    if (input_depth == MAX_INPUT_DEPTH) {
+        ERR_PRINT(ERR_INPUT_DEPTH);
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    input_stack[input_depth++] = fd;
+    return 0;
+}
+
+void shell_input_pop(void){
+    if (input_depth == 0) return;
+    int fd = input_stack[--input_depth];
+    shell_input_sync(fd);
+    close(fd);
+}
+
+void shell_input_sync(int fd){
+    if (fd < 0 || input.fd != fd) return;
+    if (input.end > input.start) {
+        lseek(fd, -(off_t) (input.end - input.start), SEEK_CUR);
+    }
+    input.start = input.end = 0;
+    input.fd = -1;
+}
+
+void shell_input_forget(void){
+    input.start = input.end = 0;
+    input.fd = -1;
+}
+
+// points the shared buffer at fd, returning another fd's unread data
+static int input_bind(int fd){
+    if (input.fd == fd) return 0;
+    shell_input_sync(input.fd);
+
+    struct stat st;
+    input.seekable = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (input.seekable && input.buf == NULL) {
+        input.buf = malloc(SHELL_READ_BUF);
+        if (input.buf == NULL) {
+            perror("read");
+            return -1;
+        }
+    }
+    input.fd = fd;
+    input.start = input.end = 0;
+    return 0;
+}
+
+// appends len bytes to input.line, which holds *line_len bytes
+static int line_append(size_t *line_len, const char *data, size_t len){
+    if (*line_len + len + 1 > input.line_cap) {
+        size_t cap = input.line_cap ? input.line_cap : 128;
+        while (cap < *line_len + len + 1) cap *= 2;
+        char *grown = realloc(input.line, cap);
+        if (grown == NULL) {
+            perror("read");
+            return -1;
+        }
+        input.line = grown;
+        input.line_cap = cap;
+    }
+    memcpy(input.line + *line_len, data, len);
+    *line_len += len;
+    input.line[*line_len] = '\0';
+    return 0;
+}
+
+int shell_read_line(int fd, char **line, size_t *len){
+    if (input_bind(fd) < 0) return -1;
+    *len = 0;
+    if (line_append(len, "", 0) < 0) return -1;
+
+    while (1) {
+        if (!input.seekable) {
+            char c;
+            ssize_t n = read(fd, &c, 1);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                perror("read");
+                return -1;
+            }
+            if (n == 0) break;
+            if (c == '\n') {
+                *line = input.line;
+                return 1;
+            }
+            if (line_append(len, &c, 1) < 0) return -1;
+            continue;
+        }
+
+        if (input.start == input.end) {
+            ssize_t n = read(fd, input.buf, SHELL_READ_BUF);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                perror("read");
+                return -1;
+            }
+            if (n == 0) break;
+            input.start = 0;
+            input.end = n;
+        }
+        char *data = input.buf + input.start;
+        char *nl = memchr(data, '\n', input.end - input.start);
+        size_t chunk = nl ? (size_t) (nl - data) : input.end - input.start;
+        if (line_append(len, data, chunk) < 0) return -1;
+        input.start += chunk;
+        if (nl) {
+            input.start++;
+            *line = input.line;
+            return 1;
+        }
+    }
+    *line = input.line;
+    return 0;
+}
+
+
+static int builtin_true(Command *cmd, int in_fd, int out_fd){
+    (void) cmd; (void) in_fd; (void) out_fd;
+    return 0;
+}
+
+static int builtin_false(Command *cmd, int in_fd, int out_fd){
+    (void) cmd; (void) in_fd; (void) out_fd;
+    return 1;
+}
+
+// echo [-n] ARGS...: one write for the whole line
+static int builtin_echo(Command *cmd, int in_fd, int out_fd){
+    (void) in_fd;
+    char **arg = cmd->args + 1;
+    int newline = 1;
+    if (*arg && strcmp(*arg, "-n") == 0) {
+        newline = 0;
+        arg++;
+    }
+
+    size_t len = 0;
+    for (char **a = arg; *a; a++) len += strlen(*a) + 1;
+    char *text = malloc(len + 1);
+    if (text == NULL) {
+        perror("echo");
+        return 1;
+    }
+    len = 0;
+    for (char **a = arg; *a; a++) {
+        if (a != arg) text[len++] = ' ';
+        size_t n = strlen(*a);
+        memcpy(text + len, *a, n);
+        len += n;
+    }
+    if (newline) text[len++] = '\n';
+
+    int bad = write_all(out_fd, text, len);
+    free(text);
+    if (bad && errno != EPIPE) {
+        perror("echo");
+    }
+    return bad ? 1 : 0;
+}
+
+/*
+** read [-r] [NAME...]: reads a line and splits it on blanks, one
+** field per name with the rest of the line going to the last (REPLY
+** when none are given). Without -r a backslash quotes the next
+** character and one at the end of the line joins the next line.
+** The status is 1 once the input is exhausted.
+*/
+static int builtin_read(Command *cmd, int in_fd, int out_fd){
+    (void) out_fd;
+    char **names = cmd->args + 1;
+    int raw = 0;
+    if (*names && strcmp(*names, "-r") == 0) {
+        raw = 1;
+        names++;
+    }
+    char *reply[] = { "REPLY", NULL };
+    if (*names == NULL) names = reply;
+    for (char **name = names; *name; name++) {
+        for (char *c = *name; *c; c++) {
+            if (!isValidVarChar(*c)) {
+                ERR_PRINT(ERR_VAR_NAME, *name);
+                return 2;
+            }
+        }
+    }
+
+    char *line;
+    size_t len;
+    int got = shell_read_line(in_fd, &line, &len);
+    if (got < 0) return 2;
+
+    // a trailing unquoted backslash continues onto the next line
+    char *text = strdup(line);
+    size_t text_len = len;
+    while (text != NULL && !raw && got == 1) {
+        size_t slashes = 0;
+        while (slashes < text_len && text[text_len - 1 - slashes] == '\\') slashes++;
+        if (slashes % 2 == 0) break;
+        text[--text_len] = '\0';
+        got = shell_read_line(in_fd, &line, &len);
+        if (got < 0) {
+            free(text);
+            return 2;
+        }
+        char *joined = realloc(text, text_len + len + 1);
+        if (joined == NULL) {
+            free(text);
+            text = NULL;
+            break;
+        }
+        text = joined;
+        memcpy(text + text_len, line, len + 1);
+        text_len += len;
+    }
+    if (text == NULL) {
+        perror("read");
+        return 2;
+    }
+
+    // split in place; unescaping only ever shortens a field
+    char *r = text;
+    int bad = 0;
+    for (char **name = names; *name && !bad; name++) {
+        int last = (name[1] == NULL);
+        while (*r == ' ' || *r == '\t') r++;
+        char *field = r, *w = r, *keep = r;
+        while (*r) {
+            if (!raw && *r == '\\' && r[1]) {
+                *w++ = r[1];
+                r += 2;
+                keep = w;
+            } else if (*r == ' ' || *r == '\t') {
+                if (!last) break;
+                *w++ = *r++;
+            } else {
+                *w++ = *r++;
+                keep = w;
+            }
+        }
+        char *next = *r ? r + 1 : r;
+        *keep = '\0';
+        bad = addOrUpdateVariable(cmd->variables, *name, field) < 0;
+        r = next;
+    }
+    free(text);
+    if (bad) return 2;
+    return got == 1 ? 0 : 1;
+}
+
+// stats: the shell's counters in the Prometheus text format
+static int builtin_stats(Command *cmd, int in_fd, int out_fd){
+    (void) in_fd;
+    if (cmd->args[1] != NULL) {
+        ERR_PRINT(ERR_STATS_USAGE);
+        return 2;
+    }
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out = open_memstream(&text, &len);
+    if (out == NULL) {
+        perror("stats");
+        return 1;
+    }
+    metrics_print(out);
+    if (fclose(out) != 0) {
+        perror("stats");
+        free(text);
+        return 1;
+    }
+    int bad = write_all(out_fd, text, len);
+    free(text);
+    if (bad && errno != EPIPE) {
+        perror("stats");
+    }
+    return bad ? 1 : 0;
+}
+
+
+static const Builtin builtins[] = {
+    { "echo", builtin_echo },
+    { "read", builtin_read },
+    { "true", builtin_true },
+    { "false", builtin_false },
+    { STATS_BUILTIN, builtin_stats },
+};
+
+BuiltinFunc find_builtin(const char *name){
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return builtins[i].func;
+        }
+    }
+    return NULL;
+}
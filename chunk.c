@@ -0,0 +1,135 @@
+
+#include "shell.h"
+
+#include <limits.h>
+
+/*
+** ARG_MAX-aware batching: `chunked [-j N] [--fixed N] -- cmd args...`
+**
+** The forked stage splits the arguments after the fixed ones into the
+** largest batches execve accepts: the strings and pointers of the
+** environment, the fixed arguments and the batch must fit in
+** sysconf(_SC_ARG_MAX), less CHUNK_HEADROOM. It then runs cmd once per
+** batch (the fixed arguments repeated in front), up to N at a time, and
+** exits with the highest exit code any batch had.
+**
+** The fixed arguments are cmd's leading options (through a "--") unless
+** --fixed gives their number, e.g. `chunked --fixed 1 -- grep pat *`.
+*/
+
+int chunk_add_option(ChunkSpec *chunk, const char *option, const char *value){
+    int *field;
+    long min;
+    if (strcmp(option, CHUNK_JOBS_FLAG) == 0) {
+        field = &chunk->max_jobs;
+        min = 1;
+    } else if (strcmp(option, CHUNK_FIXED_FLAG) == 0) {
+        field = &chunk->fixed;
+        min = 0;
+    } else {
+        ERR_PRINT(ERR_CHUNK_USAGE);
+        return -1;
+    }
+
+    char *end;
+    long n = (value != NULL) ? strtol(value, &end, 10) : -1;
+    if (value == NULL || *value == '\0' || *end != '\0' || n < min || n > INT_MAX) {
+        ERR_PRINT(ERR_CHUNK_USAGE);
+        return -1;
+    }
+    *field = n;
+    return 0;
+}
+
+// what one string costs in the exec's argument area
+static size_t arg_cost(const char *arg){
+    return strlen(arg) + 1 + sizeof(char *);
+}
+
+// the number of leading options, through a "--" that ends them
+static int leading_options(char **args){
+    int n = 0;
+    while (args[n] != NULL && args[n][0] == '-' && args[n][1] != '\0') {
+        if (strcmp(args[n++], "--") == 0) break;
+    }
+    return n;
+}
+
+// waits for one batch, returning its exit code (128+N for signal N)
+static int wait_batch(void){
+    int status;
+    while (waitpid(-1, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            return 1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+void chunk_run_child(Command *command){
+    ChunkSpec *chunk = command->chunk;
+    if (chunk == NULL) return;
+
+    char **args = command->args;
+    int argc = 0;
+    while (args[argc] != NULL) argc++;
+
+    int fixed = 1 + (chunk->fixed >= 0 ? chunk->fixed : leading_options(args + 1));
+    if (fixed > argc) fixed = argc;
+
+    long long budget = sysconf(_SC_ARG_MAX);
+    if (budget <= 0) budget = _POSIX_ARG_MAX;
+    budget -= CHUNK_HEADROOM + sizeof(char *) * 2;      // both NULLs
+    for (char **env = shell_envp != NULL ? shell_envp : environ; *env; env++) {
+        budget -= arg_cost(*env);
+    }
+    for (int i = 0; i < fixed; i++) {
+        budget -= arg_cost(args[i]);
+    }
+
+    char **argv = malloc((argc + 1) * sizeof(char *));
+    if (argv == NULL) {
+        perror("chunked");
+        _exit(EXIT_FAILURE);
+    }
+    memcpy(argv, args, fixed * sizeof(char *));
+
+    int running = 0, worst = 0;
+    int next = fixed;
+    do {
+        // as many arguments as fit, but always at least one
+        int end = next;
+        long long used = 0;
+        while (end < argc && (end == next || used + arg_cost(args[end]) <= budget)) {
+            used += arg_cost(args[end++]);
+        }
+
+        if (running == chunk->max_jobs) {
+            int code = wait_batch();
+            if (code > worst) worst = code;
+            running--;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            worst = worst ? worst : EXIT_FAILURE;
+            break;
+        } else if (pid == 0) {
+            // the batch goes on to run the command with its own argv
+            memcpy(argv + fixed, args + next, (end - next) * sizeof(char *));
+            argv[fixed + end - next] = NULL;
+            command->args = argv;
+            return;
+        }
+        running++;
+        next = end;
+    } while (next < argc);
+
+    while (running-- > 0) {
+        int code = wait_batch();
+        if (code > worst) worst = code;
+    }
+    _exit(worst);
+}
@@ -0,0 +1,577 @@
+#include "shell.h"
+
+#include <ctype.h>
+#include <time.h>
+
+/*
+** DAG mode (--dag, -j N): runs a script as a dependency graph rather
+** than top to bottom.
+**
+**   PATH=/usr/bin:/bin                  lines before the first node run
+**   @fetch produces: src.tar            first, in order, like a script
+**   curl -o src.tar http://...
+**   @unpack consumes: src.tar produces: src
+**   tar xf src.tar
+**   @lint after: unpack
+**   ...
+**
+** A node is an `@NAME` header plus the lines up to the next header
+** (a bare `@` makes an unnamed one-off node). It waits for the nodes
+** listed after `after:` and for every node that produces something it
+** consumes; what is consumed or produced is just a name, usually a
+** file. Ready nodes run concurrently, up to -j at a time, each in a
+** forked subshell whose lines go through script_run and execute_line
+** like any script, with a private copy of the variables. When several
+** are ready the one heading the longest chain of dependents goes first.
+**
+** A failed node skips everything that depends on it; unrelated nodes
+** carry on. The timing of every node and the critical path (the chain
+** of dependencies that took longest) are printed to stderr at the end.
+*/
+
+enum NodeState { NODE_WAITING, NODE_RUNNING, NODE_OK, NODE_FAILED, NODE_SKIPPED };
+
+typedef struct NameList {
+    char **items;
+    size_t num;
+} NameList;
+
+typedef struct DagNode {
+    char *name;
+    int line_no;
+    NameList after;
+    NameList consumes;
+    NameList produces;
+    Script *script;
+    Variable **root;
+
+    int *deps;              // nodes this one waits for
+    size_t num_deps;
+    int *dependents;        // nodes waiting for this one
+    size_t num_dependents;
+    int waiting;            // deps that have not succeeded yet
+    int depth;              // longest chain of dependents, itself included
+
+    int state;
+    int code;
+    Job *job;
+    Command stage;          // stands for the subshell in its job
+    long long start_us, end_us;
+} DagNode;
+
+typedef struct Dag {
+    DagNode *nodes;
+    size_t num, cap;
+} Dag;
+
+
+static long long dag_now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int list_add(NameList *list, const char *name, size_t len){
+    char **grown = realloc(list->items, (list->num + 1) * sizeof(char *));
+    if (grown == NULL) {
+        perror("dag");
+        return -1;
+    }
+    list->items = grown;
+    if ((list->items[list->num] = strndup(name, len)) == NULL) {
+        perror("dag");
+        return -1;
+    }
+    list->num++;
+    return 0;
+}
+
+static void list_free(NameList *list){
+    for (size_t i = 0; i < list->num; i++) {
+        free(list->items[i]);
+    }
+    free(list->items);
+}
+
+static int find_node(Dag *dag, const char *name){
+    for (size_t i = 0; i < dag->num; i++) {
+        if (strcmp(dag->nodes[i].name, name) == 0) return (int) i;
+    }
+    return -1;
+}
+
+static void dag_free(Dag *dag){
+    for (size_t i = 0; i < dag->num; i++) {
+        DagNode *node = &dag->nodes[i];
+        free(node->name);
+        list_free(&node->after);
+        list_free(&node->consumes);
+        list_free(&node->produces);
+        if (node->script != NULL) script_free(node->script);
+        free(node->deps);
+        free(node->dependents);
+    }
+    free(dag->nodes);
+}
+
+
+/*
+** Parses `@NAME after: a,b consumes: x produces: y` into a new node.
+** Lists may be split by commas or blanks.
+**
+** Returns 0 on success, -1 (after printing why) on a bad header.
+*/
+static int parse_header(Dag *dag, const char *line, int line_no){
+    if (dag->num == dag->cap) {
+        size_t cap = dag->cap ? dag->cap * 2 : 16;
+        DagNode *grown = realloc(dag->nodes, cap * sizeof(DagNode));
+        if (grown == NULL) {
+            perror("dag");
+            return -1;
+        }
+        dag->nodes = grown;
+        dag->cap = cap;
+    }
+    DagNode *node = &dag->nodes[dag->num];
+    memset(node, 0, sizeof(DagNode));
+    node->line_no = line_no;
+    dag->num++;
+
+    const char *p = line;
+    while (isspace((unsigned char)*p)) p++;
+    p++;    // the '@'
+    const char *name = p;
+    while (*p && !isspace((unsigned char)*p)) p++;
+    char anon[32];
+    if (p == name) {
+        snprintf(anon, sizeof(anon), "line%d", line_no);
+        node->name = strdup(anon);
+    } else {
+        node->name = strndup(name, p - name);
+    }
+    if (node->name == NULL) {
+        perror("dag");
+        return -1;
+    }
+    if (strchr(node->name, ':') != NULL) {
+        ERR_PRINT(ERR_SCRIPT_SYNTAX, line_no, "node name missing before the lists");
+        return -1;
+    }
+    if (find_node(dag, node->name) != (int) dag->num - 1) {
+        ERR_PRINT(ERR_DAG_DUPLICATE, node->name);
+        return -1;
+    }
+
+    NameList *list = NULL;
+    while (*p) {
+        while (isspace((unsigned char)*p) || *p == ',') p++;
+        if (*p == '\0' || *p == '#') break;
+        const char *word = p;
+        while (*p && !isspace((unsigned char)*p) && *p != ',') p++;
+        size_t len = p - word;
+
+        if (word[len - 1] == ':') {
+            if (len == sizeof(DAG_AFTER) - 1 && strncmp(word, DAG_AFTER, len) == 0) {
+                list = &node->after;
+            } else if (len == sizeof(DAG_CONSUMES) - 1 &&
+                       strncmp(word, DAG_CONSUMES, len) == 0) {
+                list = &node->consumes;
+            } else if (len == sizeof(DAG_PRODUCES) - 1 &&
+                       strncmp(word, DAG_PRODUCES, len) == 0) {
+                list = &node->produces;
+            } else {
+                ERR_PRINT(ERR_SCRIPT_SYNTAX, line_no, "unknown node list");
+                return -1;
+            }
+            continue;
+        }
+        if (list == NULL) {
+            ERR_PRINT(ERR_SCRIPT_SYNTAX, line_no,
+                      "expected after:, consumes: or produces:");
+            return -1;
+        }
+        if (list_add(list, word, len) < 0) return -1;
+    }
+    return 0;
+}
+
+// compiles the body lines of the newest node
+static int compile_body(Dag *dag, char **lines, size_t num_lines){
+    DagNode *node = &dag->nodes[dag->num - 1];
+    int incomplete;
+    node->script = script_compile(lines, num_lines, &incomplete);
+    if (node->script == NULL) {
+        if (incomplete) {
+            ERR_PRINT(ERR_SCRIPT_SYNTAX, node->line_no, "node ends inside a block");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static int add_dep(DagNode *nodes, int from, int to){
+    DagNode *node = &nodes[from];
+    if (from == to) return 0;
+    for (size_t i = 0; i < node->num_deps; i++) {
+        if (node->deps[i] == to) return 0;
+    }
+    int *deps = realloc(node->deps, (node->num_deps + 1) * sizeof(int));
+    DagNode *dep = &nodes[to];
+    int *dependents = realloc(dep->dependents, (dep->num_dependents + 1) * sizeof(int));
+    if (deps != NULL) node->deps = deps;
+    if (dependents != NULL) dep->dependents = dependents;
+    if (deps == NULL || dependents == NULL) {
+        perror("dag");
+        return -1;
+    }
+    node->deps[node->num_deps++] = to;
+    dep->dependents[dep->num_dependents++] = from;
+    return 0;
+}
+
+/*
+** Turns the after: and consumes:/produces: lists into edges, checks
+** that they form no cycle and works out each node's depth.
+**
+** Returns 0 on success, -1 (after printing why) on an unknown node or
+** a cycle.
+*/
+static int link_nodes(Dag *dag){
+    DagNode *nodes = dag->nodes;
+    for (size_t i = 0; i < dag->num; i++) {
+        for (size_t a = 0; a < nodes[i].after.num; a++) {
+            int dep = find_node(dag, nodes[i].after.items[a]);
+            if (dep < 0) {
+                ERR_PRINT(ERR_DAG_UNKNOWN, nodes[i].name, nodes[i].after.items[a]);
+                return -1;
+            }
+            if (add_dep(nodes, i, dep) < 0) return -1;
+        }
+        for (size_t c = 0; c < nodes[i].consumes.num; c++) {
+            for (size_t j = 0; j < dag->num; j++) {
+                for (size_t p = 0; p < nodes[j].produces.num; p++) {
+                    if (strcmp(nodes[j].produces.items[p],
+                               nodes[i].consumes.items[c]) == 0 &&
+                        add_dep(nodes, i, j) < 0) {
+                        return -1;
+                    }
+                }
+            }
+        }
+    }
+
+    // Kahn's algorithm from the sinks, so depths come out on the way
+    int *order = malloc(dag->num * sizeof(int));
+    int *left = malloc(dag->num * sizeof(int));
+    if (order == NULL || left == NULL) {
+        perror("dag");
+        free(order);
+        free(left);
+        return -1;
+    }
+    size_t head = 0, tail = 0;
+    for (size_t i = 0; i < dag->num; i++) {
+        left[i] = nodes[i].num_dependents;
+        nodes[i].waiting = nodes[i].num_deps;
+        if (left[i] == 0) order[tail++] = i;
+    }
+    while (head < tail) {
+        DagNode *node = &nodes[order[head++]];
+        node->depth = 1;
+        for (size_t d = 0; d < node->num_dependents; d++) {
+            int below = nodes[node->dependents[d]].depth + 1;
+            if (below > node->depth) node->depth = below;
+        }
+        for (size_t d = 0; d < node->num_deps; d++) {
+            if (--left[node->deps[d]] == 0) order[tail++] = node->deps[d];
+        }
+    }
+    int bad = tail != dag->num;
+    if (bad) {
+        for (size_t i = 0; i < dag->num; i++) {
+            if (left[i] > 0) {
+                ERR_PRINT(ERR_DAG_CYCLE, nodes[i].name);
+                break;
+            }
+        }
+    }
+    free(order);
+    free(left);
+    return bad ? -1 : 0;
+}
+
+/*
+** Splits the script into its prelude (compiled into *prelude) and
+** nodes.
+**
+** Returns 0 on success, -1 on error.
+*/
+static int load_dag(Dag *dag, char **lines, size_t num_lines, Script **prelude){
+    size_t first = 0;
+    while (first < num_lines) {
+        const char *p = lines[first];
+        while (isspace((unsigned char)*p)) p++;
+        if (*p == DAG_NODE_MARKER) break;
+        first++;
+    }
+
+    int incomplete;
+    *prelude = NULL;
+    if (first > 0) {
+        *prelude = script_compile(lines, first, &incomplete);
+        if (*prelude == NULL) {
+            if (incomplete) {
+                ERR_PRINT(ERR_SCRIPT_SYNTAX, (int) first, "unexpected start of node");
+            }
+            return -1;
+        }
+    }
+
+    size_t body = first;
+    for (size_t i = first; i < num_lines; i++) {
+        const char *p = lines[i];
+        while (isspace((unsigned char)*p)) p++;
+        if (*p != DAG_NODE_MARKER) continue;
+        if (i > first && compile_body(dag, lines + body, i - body) < 0) return -1;
+        if (parse_header(dag, lines[i], (int) i + 1) < 0) return -1;
+        body = i + 1;
+    }
+    if (num_lines > first && compile_body(dag, lines + body, num_lines - body) < 0) {
+        return -1;
+    }
+    return link_nodes(dag);
+}
+
+
+static int run_node(void *arg){
+    DagNode *node = arg;
+    int status = 0;
+    // the subshell has nothing left to do after the node's last line
+    script_allow_tail_exec(node->script);
+    int ret = script_run(node->script, node->root, &status);
+    if (ret == SCRIPT_ERROR && status == 0) status = 1;
+    return status;
+}
+
+static void skip_dependents(DagNode *nodes, DagNode *node, size_t *finished){
+    for (size_t d = 0; d < node->num_dependents; d++) {
+        DagNode *dep = &nodes[node->dependents[d]];
+        if (dep->state != NODE_WAITING) continue;
+        dep->state = NODE_SKIPPED;
+        (*finished)++;
+        skip_dependents(nodes, dep, finished);
+    }
+}
+
+// the waiting node heading the longest chain, or -1 if none is ready
+static int next_ready(Dag *dag){
+    int best = -1;
+    for (size_t i = 0; i < dag->num; i++) {
+        DagNode *node = &dag->nodes[i];
+        if (node->state != NODE_WAITING || node->waiting > 0) continue;
+        if (best < 0 || node->depth > dag->nodes[best].depth) best = (int) i;
+    }
+    return best;
+}
+
+static void print_us(const char *prefix, long long us){
+    fprintf(stderr, "%s%lld.%03llds", prefix, us / 1000000, us / 1000 % 1000);
+}
+
+/*
+** Prints each node's status, start offset and run time, then the
+** critical path: the chain of dependencies whose run times add up to
+** the most, which bounds the run time no matter how large -j is.
+*/
+static void print_report(Dag *dag, long long start_us, long long end_us, int max_jobs){
+    DagNode *nodes = dag->nodes;
+    int width = 4;
+    for (size_t i = 0; i < dag->num; i++) {
+        int len = (int) strlen(nodes[i].name);
+        if (len > width) width = len;
+    }
+
+    // nodes are linked in topological order, so one pass in that order
+    // sees every dependency's path before the node itself
+    long long *path = calloc(dag->num, sizeof(long long));
+    int *prev = malloc(dag->num * sizeof(int));
+    int *order = malloc(dag->num * sizeof(int));
+    int *left = malloc(dag->num * sizeof(int));
+    if (path == NULL || prev == NULL || order == NULL || left == NULL) {
+        perror("dag");
+        free(path);
+        free(prev);
+        free(order);
+        free(left);
+        return;
+    }
+    size_t head = 0, tail = 0;
+    for (size_t i = 0; i < dag->num; i++) {
+        left[i] = nodes[i].num_deps;
+        if (left[i] == 0) order[tail++] = i;
+    }
+    while (head < tail) {
+        int i = order[head++];
+        for (size_t d = 0; d < nodes[i].num_dependents; d++) {
+            if (--left[nodes[i].dependents[d]] == 0) order[tail++] = nodes[i].dependents[d];
+        }
+    }
+
+    int last = -1;
+    for (size_t k = 0; k < tail; k++) {
+        int i = order[k];
+        DagNode *node = &nodes[i];
+        prev[i] = -1;
+        if (node->state != NODE_OK && node->state != NODE_FAILED) continue;
+        for (size_t d = 0; d < node->num_deps; d++) {
+            int dep = node->deps[d];
+            int ran = nodes[dep].state == NODE_OK || nodes[dep].state == NODE_FAILED;
+            if (ran && (prev[i] < 0 || path[dep] > path[prev[i]])) {
+                prev[i] = dep;
+            }
+        }
+        path[i] = (node->end_us - node->start_us) + (prev[i] >= 0 ? path[prev[i]] : 0);
+        if (last < 0 || path[i] > path[last]) last = i;
+    }
+
+    fprintf(stderr, "dag: %-*s  %-8s %9s %9s\n", width, "node", "status",
+            "start", "time");
+    for (size_t i = 0; i < dag->num; i++) {
+        DagNode *node = &nodes[i];
+        char status[32];
+        switch (node->state) {
+            case NODE_OK: snprintf(status, sizeof(status), "ok"); break;
+            case NODE_FAILED: snprintf(status, sizeof(status), "exit %d", node->code); break;
+            case NODE_SKIPPED: snprintf(status, sizeof(status), "skipped"); break;
+            default: snprintf(status, sizeof(status), "not run"); break;
+        }
+        if (node->state != NODE_OK && node->state != NODE_FAILED) {
+            fprintf(stderr, "dag: %-*s  %s\n", width, node->name, status);
+            continue;
+        }
+        long long offset = (node->start_us - start_us) / 1000;
+        long long took = (node->end_us - node->start_us) / 1000;
+        fprintf(stderr, "dag: %-*s  %-8s %+5lld.%03llds %5lld.%03llds\n", width,
+                node->name, status, offset / 1000, offset % 1000, took / 1000,
+                took % 1000);
+    }
+
+    if (last >= 0) {
+        // walk back from the end of the path, then print it forwards
+        size_t len = 0;
+        for (int i = last; i >= 0; i = prev[i]) order[len++] = i;
+        print_us("dag: critical path ", path[last]);
+        fprintf(stderr, ":");
+        while (len > 0) {
+            len--;
+            fprintf(stderr, " %s%s", nodes[order[len]].name, len ? " ->" : "");
+        }
+        fprintf(stderr, "\n");
+    }
+    print_us("dag: wall time ", end_us - start_us);
+    fprintf(stderr, " with -j %d\n", max_jobs);
+
+    free(path);
+    free(prev);
+    free(order);
+    free(left);
+}
+
+/*
+** Runs ready nodes, at most max_jobs at once, until every node has
+** finished or been skipped (or a signal stops the run).
+**
+** Returns the exit code of the last node that failed, 0 if none did.
+*/
+static int schedule(Dag *dag, int max_jobs){
+    DagNode *nodes = dag->nodes;
+    size_t finished = 0;
+    int running = 0, stopping = 0, code = 0;
+
+    while (finished < dag->num) {
+        int next;
+        while (!stopping && running < max_jobs && (next = next_ready(dag)) >= 0) {
+            DagNode *node = &nodes[next];
+            node->start_us = dag_now_us();
+            node->job = job_start_subshell(&node->stage, run_node, node);
+            if (node->job == NULL) {
+                stopping = 1;
+                break;
+            }
+            node->state = NODE_RUNNING;
+            running++;
+        }
+        if (running == 0) break;
+
+        if (executor_run_once(-1) < 0) {
+            stopping = 1;
+        }
+        if (shell_pending_exit_signal()) {
+            stopping = 1;
+        }
+
+        for (size_t i = 0; i < dag->num; i++) {
+            DagNode *node = &nodes[i];
+            if (node->state != NODE_RUNNING || !node->job->done) continue;
+            node->end_us = dag_now_us();
+            node->code = job_wait(node->job);
+            if (node->code < 0) node->code = 1;
+            job_free(node->job);
+            node->job = NULL;
+            running--;
+            finished++;
+
+            if (node->code == 0) {
+                node->state = NODE_OK;
+                for (size_t d = 0; d < node->num_dependents; d++) {
+                    nodes[node->dependents[d]].waiting--;
+                }
+            } else {
+                node->state = NODE_FAILED;
+                code = node->code;
+                skip_dependents(nodes, node, &finished);
+            }
+        }
+    }
+    if (code == 0 && finished < dag->num) code = 1;
+    return code;
+}
+
+int run_dag(char *file_path, Variable **root, int max_jobs){
+    FILE *file = fopen(file_path, "r");
+    if (file == NULL) {
+        ERR_PRINT(ERR_INIT_SCRIPT, file_path);
+        return -1;
+    }
+    char **lines;
+    size_t num_lines;
+    int failed = read_lines(file, &lines, &num_lines);
+    fclose(file);
+    if (failed) return -1;
+
+    Dag dag = { 0 };
+    Script *prelude;
+    failed = load_dag(&dag, lines, num_lines, &prelude);
+    free_lines(lines, num_lines);
+    if (failed) {
+        dag_free(&dag);
+        return -1;
+    }
+
+    // the prelude sets up what every node inherits
+    int ret = SCRIPT_OK;
+    if (prelude != NULL) {
+        ret = script_run(prelude, root, &shell_last_status);
+        script_free(prelude);
+    }
+    if (ret == SCRIPT_OK && dag.num > 0 && !shell_pending_exit_signal()) {
+        for (size_t i = 0; i < dag.num; i++) {
+            dag.nodes[i].root = root;
+        }
+        long long start_us = dag_now_us();
+        shell_last_status = schedule(&dag, max_jobs);
+        print_report(&dag, start_us, dag_now_us(), max_jobs);
+    }
+    dag_free(&dag);
+    return ret == SCRIPT_ERROR ? -1 : 0;
+}
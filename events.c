@@ -0,0 +1,214 @@
+
+#include "shell.h"
+
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/*
+** Machine-readable events for orchestrators: `cscshell --events-fd=N`.
+**
+** One JSON object per line, "ts" in Unix milliseconds:
+**   {"event":"line","ts":..,"seq":1,"line":3,"text":"ls | wc -l"}
+**   {"event":"spawn","ts":..,"seq":1,"pid":123,"stage":0,"exec":"/bin/ls","argv":["ls"]}
+**   {"event":"exit","ts":..,"pid":123,"stage":0,"code":0,"signal":0,
+**    "duration_ms":1.2,"user_ms":0.4,"sys_ms":0.6,"maxrss_kb":1800}
+** and {"event":"dropped","count":N} if N events did not fit the queue.
+**
+** Events are queued, and the executor writes the queue out once per
+** batch: after a line's stages are forked, after each round of reaping.
+** Writes never block. A slow reader just makes the queue grow, up to
+** EVENTS_MAX_BUFFER, and the event loop finishes the write when the fd
+** turns writable. A FIFO is reopened through /proc with its own
+** O_NONBLOCK, so whoever else holds the pipe does not see the flag; a
+** socket gets MSG_DONTWAIT instead.
+*/
+
+static int out_fd = -1;
+static int out_is_socket = 0;
+static char *queue = NULL;
+static size_t queue_len = 0, queue_cap = 0;
+static unsigned long long dropped = 0;
+static long long line_seq = 0;
+
+int events_enable(const char *arg){
+    char *end;
+    long n = strtol(arg, &end, 10);
+    struct stat st;
+    if (*arg == '\0' || *end != '\0' || n < 0 || n > INT_MAX || fstat(n, &st) < 0) {
+        ERR_PRINT(ERR_ARGS_EVENTS, arg);
+        return -1;
+    }
+
+    int fd = -1;
+    if (S_ISFIFO(st.st_mode)) {
+        char proc[32];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%ld", n);
+        fd = open(proc, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    }
+    if (fd < 0) {
+        fd = fcntl(n, F_DUPFD_CLOEXEC, STDERR_FILENO + 1);
+        if (fd < 0) {
+            perror("--events-fd");
+            return -1;
+        }
+        if (S_ISFIFO(st.st_mode)) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+    // the orchestrator's copy would otherwise leak into every stage
+    if (n > STDERR_FILENO) close(n);
+
+    out_fd = fd;
+    out_is_socket = S_ISSOCK(st.st_mode);
+    return 0;
+}
+
+int events_fd(void){
+    return out_fd;
+}
+
+void events_forget(void){
+    if (out_fd >= 0) close(out_fd);
+    out_fd = -1;
+    free(queue);
+    queue = NULL;
+    queue_len = queue_cap = 0;
+}
+
+static int reserve(size_t n){
+    if (queue_len + n <= queue_cap) return 0;
+    size_t cap = queue_cap ? queue_cap * 2 : 4096;
+    while (cap < queue_len + n) cap *= 2;
+    char *grown = realloc(queue, cap);
+    if (grown == NULL) return -1;
+    queue = grown;
+    queue_cap = cap;
+    return 0;
+}
+
+static void put(const char *fmt, ...){
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || reserve(n + 1) < 0) return;
+    va_start(ap, fmt);
+    vsnprintf(queue + queue_len, n + 1, fmt, ap);
+    va_end(ap);
+    queue_len += n;
+}
+
+// s as a JSON string; bytes past ASCII go through as they are
+static void put_string(const char *s){
+    if (s == NULL) {
+        put("null");
+        return;
+    }
+    put("\"");
+    for (const unsigned char *c = (const unsigned char *) s; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            put("\\%c", *c);
+        } else if (*c == '\n') {
+            put("\\n");
+        } else if (*c == '\t') {
+            put("\\t");
+        } else if (*c < 0x20) {
+            put("\\u%04x", *c);
+        } else if (reserve(1) == 0) {
+            queue[queue_len++] = *c;
+        }
+    }
+    put("\"");
+}
+
+// opens an event, unless the queue is full; returns 0 if it did
+static int begin(const char *event){
+    if (out_fd < 0) return -1;
+    if (queue_len >= EVENTS_MAX_BUFFER) {
+        dropped++;
+        return -1;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long ms = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+    if (dropped > 0) {
+        put("{\"event\":\"dropped\",\"ts\":%lld,\"count\":%llu}\n", ms, dropped);
+        dropped = 0;
+    }
+    put("{\"event\":\"%s\",\"ts\":%lld", event, ms);
+    return 0;
+}
+
+void events_line(int line_no, const char *text){
+    line_seq++;
+    if (begin("line") < 0) return;
+    put(",\"seq\":%lld,\"line\":%d,\"text\":", line_seq, line_no);
+    put_string(text);
+    put("}\n");
+}
+
+void events_spawn(const Command *cmd){
+    if (begin("spawn") < 0) return;
+    put(",\"seq\":%lld,\"pid\":%d,\"stage\":%d,\"exec\":", line_seq, (int) cmd->pid,
+        cmd->stage);
+    put_string(cmd->exec_path);
+    put(",\"argv\":[");
+    for (int i = 0; cmd->args != NULL && cmd->args[i] != NULL; i++) {
+        if (i > 0) put(",");
+        put_string(cmd->args[i]);
+    }
+    put("]}\n");
+}
+
+static double tv_ms(struct timeval tv){
+    return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+void events_exit(const Command *cmd, int status, int code, const struct rusage *ru){
+    if (begin("exit") < 0) return;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    put(",\"pid\":%d,\"stage\":%d,\"code\":%d,\"signal\":%d,\"duration_ms\":%.3f,"
+        "\"user_ms\":%.3f,\"sys_ms\":%.3f,\"maxrss_kb\":%ld}\n",
+        (int) cmd->pid, cmd->stage, code, WIFSIGNALED(status) ? WTERMSIG(status) : 0,
+        cmd->started_ns ? (now - cmd->started_ns) / 1e6 : 0.0,
+        tv_ms(ru->ru_utime), tv_ms(ru->ru_stime), ru->ru_maxrss);
+}
+
+int events_flush(void){
+    if (queue_len == 0) return 0;
+    size_t off = 0;
+    while (out_fd >= 0 && off < queue_len) {
+        ssize_t n = out_is_socket
+            ? send(out_fd, queue + off, queue_len - off, MSG_DONTWAIT | MSG_NOSIGNAL)
+            : write(out_fd, queue + off, queue_len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            // the reader is gone: nobody is left to tell
+            events_forget();
+            return 0;
+        }
+        off += n;
+    }
+    memmove(queue, queue + off, queue_len - off);
+    queue_len -= off;
+    return queue_len > 0;
+}
+
+void events_finish(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    long long deadline = ts.tv_sec * 1000LL + ts.tv_nsec / 1000000 + EVENTS_EXIT_TIMEOUT_MS;
+    while (events_flush()) {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        long long left = deadline - (ts.tv_sec * 1000LL + ts.tv_nsec / 1000000);
+        struct pollfd pfd = { .fd = out_fd, .events = POLLOUT };
+        if (left <= 0 || poll(&pfd, 1, (int) left) <= 0) break;
+    }
+    events_forget();
+}
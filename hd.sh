@@ -0,0 +1,6 @@
+cat <<EOF
+line $HOME
+EOF
+cat <<"EOF"
+raw $HOME
+EOF
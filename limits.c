@@ -0,0 +1,328 @@
+#include "shell.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <sys/resource.h>
+
+/*
+** Per-command resource limits: `limit mem=2G cpu=30s nofile=4096 -- cmd`
+**
+** Plain limits are applied with setrlimit in the child just before
+** execv. With the `cgroup` flag the child is also moved into a fresh
+** cgroup v2 leaf carrying memory.max / cpu.max, when the shell's own
+** cgroup is writable (a delegated subtree) and can enable controllers
+** for its children. Each leaf is removed once its command is reaped.
+*/
+
+// cgroup v2 directory the shell creates leaves in, "" if unusable
+static char cgroup_base[MAX_PATH_STR];
+static int cgroup_probed = 0;
+static unsigned int cgroup_counter = 0;
+
+
+int parse_size(const char *value, long long *out){
+    char *end;
+    errno = 0;
+    long long n = strtoll(value, &end, 10);
+    if (end == value || n < 0 || errno == ERANGE) return -1;
+    long long mult = 1;
+    switch (toupper((unsigned char)*end)) {
+        case 'T': mult *= 1024;     // fall through
+        case 'G': mult *= 1024;     // fall through
+        case 'M': mult *= 1024;     // fall through
+        case 'K': mult *= 1024; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if (*end == 'B' || *end == 'b') end++;
+    if (*end != '\0' || n > LLONG_MAX / mult) return -1;
+    *out = n * mult;
+    return 0;
+}
+
+// parses "30", "30s", "5m", "1h" into seconds
+static int parse_seconds(const char *value, long long *out){
+    char *end;
+    errno = 0;
+    long long n = strtoll(value, &end, 10);
+    if (end == value || n < 0 || errno == ERANGE) return -1;
+    long long mult = 1;
+    switch (*end) {
+        case 'h': mult *= 60;       // fall through
+        case 'm': mult *= 60;       // fall through
+        case 's': end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if (*end != '\0' || n > LLONG_MAX / mult) return -1;
+    *out = n * mult;
+    return 0;
+}
+
+// parses a CPU share like "0.5" or "2" into a cpu.max quota per period
+static int parse_cpus(const char *value, long long *out){
+    char *end;
+    double cpus = strtod(value, &end);
+    if (end == value || *end != '\0' || cpus <= 0) return -1;
+    *out = (long long) (cpus * CGROUP_CPU_PERIOD_US);
+    return 0;
+}
+
+
+int parse_limit_spec(ResourceLimits *limits, const char *spec){
+    if (strcmp(spec, LIMIT_CGROUP_FLAG) == 0) {
+        limits->use_cgroup = 1;
+        return 0;
+    }
+
+    const char *eq = strchr(spec, '=');
+    if (eq == NULL) {
+        ERR_PRINT(ERR_LIMIT_SPEC, spec);
+        return -1;
+    }
+    size_t key_len = eq - spec;
+    const char *value = eq + 1;
+    int bad;
+
+    if (strncmp(spec, "mem", key_len) == 0 && key_len == 3) {
+        bad = parse_size(value, &limits->mem_bytes);
+    } else if (strncmp(spec, "cpu", key_len) == 0 && key_len == 3) {
+        bad = parse_seconds(value, &limits->cpu_sec);
+    } else if (strncmp(spec, "cpus", key_len) == 0 && key_len == 4) {
+        bad = parse_cpus(value, &limits->cpu_quota_us);
+        limits->use_cgroup = 1;
+    } else if (strncmp(spec, "nofile", key_len) == 0 && key_len == 6) {
+        bad = parse_size(value, &limits->nofile);
+    } else if (strncmp(spec, "nproc", key_len) == 0 && key_len == 5) {
+        bad = parse_size(value, &limits->nproc);
+    } else if (strncmp(spec, "fsize", key_len) == 0 && key_len == 5) {
+        bad = parse_size(value, &limits->fsize);
+    } else {
+        bad = -1;
+    }
+
+    if (bad) {
+        ERR_PRINT(ERR_LIMIT_SPEC, spec);
+        return -1;
+    }
+    return 0;
+}
+
+
+// writes a short string into a cgroup control file
+static int write_file(const char *dir, const char *file, const char *text){
+    char path[MAX_PATH_STR];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t len = strlen(text);
+    ssize_t n = write(fd, text, len);
+    close(fd);
+    return n == len ? 0 : -1;
+}
+
+/*
+** Finds the shell's cgroup v2 directory and makes sure child leaves
+** can have the memory and cpu controllers. Leaves cgroup_base empty
+** if there is no writable cgroup v2 hierarchy.
+*/
+static void probe_cgroup(void){
+    cgroup_probed = 1;
+    cgroup_base[0] = '\0';
+
+    char mount_point[MAX_PATH_STR] = "";
+    char rel_path[MAX_PATH_STR] = "";
+    char *line = NULL;
+    size_t cap = 0;
+
+    FILE *f = fopen("/proc/self/mountinfo", "r");
+    if (f == NULL) return;
+    while (getline(&line, &cap, f) > 0) {
+        // fields: id parent maj:min root mount-point opts... - fstype ...
+        char *sep = strstr(line, " - cgroup2 ");
+        if (sep == NULL) continue;
+        char mnt[MAX_PATH_STR];
+        if (sscanf(line, "%*s %*s %*s %*s %4095s", mnt) == 1) {
+            strcpy(mount_point, mnt);
+            break;
+        }
+    }
+    fclose(f);
+
+    f = fopen("/proc/self/cgroup", "r");
+    if (f == NULL) {
+        free(line);
+        return;
+    }
+    while (getline(&line, &cap, f) > 0) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(rel_path, sizeof(rel_path), "%s", line + 3);
+            break;
+        }
+    }
+    fclose(f);
+    free(line);
+
+    if (mount_point[0] == '\0') return;
+
+    char base[MAX_PATH_STR];
+    if (snprintf(base, sizeof(base), "%s%s", mount_point,
+                 strcmp(rel_path, "/") == 0 ? "" : rel_path) >=
+        (int) sizeof(base)) {
+        return;
+    }
+    if (access(base, W_OK) != 0) return;
+
+    // a cgroup holding processes (the shell itself, usually) cannot hand
+    // controllers to its children; the shell is never moved to make room,
+    // since nothing would move it back or remove the cgroup it left in
+    if (write_file(base, "cgroup.subtree_control", "+memory +cpu") < 0) return;
+    snprintf(cgroup_base, sizeof(cgroup_base), "%s", base);
+}
+
+
+int limits_prepare(Command *command){
+    ResourceLimits *limits = command->limits;
+    if (limits == NULL || !limits->use_cgroup) return 0;
+
+    if (!cgroup_probed) probe_cgroup();
+    if (cgroup_base[0] == '\0') {
+        if (limits->cpu_quota_us) {
+            ERR_PRINT(ERR_NO_CGROUP);
+        }
+        limits->use_cgroup = 0;
+        return 0;
+    }
+
+    char leaf[MAX_PATH_STR];
+    if (snprintf(leaf, sizeof(leaf), "%s/cscshell-%d-%u", cgroup_base,
+                 (int) getpid(), cgroup_counter++) >= (int) sizeof(leaf) ||
+        mkdir(leaf, 0755) < 0) {
+        perror("limits_prepare");
+        return -1;
+    }
+
+    char value[64];
+    int ok = 0;
+    if (limits->mem_bytes) {
+        snprintf(value, sizeof(value), "%lld", limits->mem_bytes);
+        ok |= write_file(leaf, "memory.max", value);
+        // without swap the limit is a hard one
+        write_file(leaf, "memory.swap.max", "0");
+    }
+    if (limits->cpu_quota_us) {
+        snprintf(value, sizeof(value), "%lld %d", limits->cpu_quota_us,
+                 CGROUP_CPU_PERIOD_US);
+        ok |= write_file(leaf, "cpu.max", value);
+    }
+    if (ok < 0) {
+        perror("limits_prepare");
+        rmdir(leaf);
+        return -1;
+    }
+
+    limits->cgroup_path = strdup(leaf);
+    if (limits->cgroup_path == NULL) {
+        perror("strdup");
+        rmdir(leaf);
+        return -1;
+    }
+    return 0;
+}
+
+
+// child side: one setrlimit, soft and hard limits alike
+static void set_one_limit(int resource, long long value, const char *name){
+    struct rlimit rl = { .rlim_cur = value, .rlim_max = value };
+    if (setrlimit(resource, &rl) < 0) {
+        perror(name);
+        _exit(EXIT_FAILURE);
+    }
+}
+
+void limits_apply_child(ResourceLimits *limits){
+    if (limits == NULL) return;
+
+    if (limits->cgroup_path != NULL &&
+        write_file(limits->cgroup_path, "cgroup.procs", "0") < 0) {
+        perror("cgroup.procs");
+        _exit(EXIT_FAILURE);
+    }
+
+    // a cgroup enforces mem itself; RLIMIT_AS is the fallback
+    if (limits->mem_bytes && limits->cgroup_path == NULL) {
+        set_one_limit(RLIMIT_AS, limits->mem_bytes, "limit mem");
+    }
+    if (limits->cpu_sec) {
+        // soft limit sends SIGXCPU, the hard one a second later SIGKILL
+        struct rlimit rl = { .rlim_cur = limits->cpu_sec,
+                             .rlim_max = limits->cpu_sec + 1 };
+        if (setrlimit(RLIMIT_CPU, &rl) < 0) {
+            perror("limit cpu");
+            _exit(EXIT_FAILURE);
+        }
+    }
+    if (limits->nofile) set_one_limit(RLIMIT_NOFILE, limits->nofile, "limit nofile");
+    if (limits->nproc) set_one_limit(RLIMIT_NPROC, limits->nproc, "limit nproc");
+    if (limits->fsize) set_one_limit(RLIMIT_FSIZE, limits->fsize, "limit fsize");
+}
+
+
+// reads "oom_kill N" out of the leaf's memory.events
+static long read_oom_kills(const char *leaf){
+    char path[MAX_PATH_STR];
+    snprintf(path, sizeof(path), "%s/memory.events", leaf);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return 0;
+    char key[64];
+    long value, kills = 0;
+    while (fscanf(f, "%63s %ld", key, &value) == 2) {
+        if (strcmp(key, "oom_kill") == 0) kills = value;
+    }
+    fclose(f);
+    return kills;
+}
+
+int limits_finish(Command *command, int code){
+    ResourceLimits *limits = command->limits;
+    if (limits == NULL) return code;
+
+    const char *hit = NULL;
+    int limit_code = code;
+
+    if (code == 128 + SIGXCPU ||
+        (code == 128 + SIGKILL && limits->cpu_sec)) {
+        hit = "cpu";
+        limit_code = LIMIT_EXIT_BASE + SIGXCPU;
+    } else if (code == 128 + SIGXFSZ) {
+        hit = "fsize";
+        limit_code = LIMIT_EXIT_BASE + SIGXFSZ;
+    }
+
+    if (limits->cgroup_path != NULL) {
+        if (limits->mem_bytes && read_oom_kills(limits->cgroup_path) > 0) {
+            hit = "mem";
+            limit_code = LIMIT_EXIT_BASE + SIGKILL;
+        }
+        rmdir(limits->cgroup_path);
+        free(limits->cgroup_path);
+        limits->cgroup_path = NULL;
+    }
+
+    if (hit != NULL) {
+        ERR_PRINT(ERR_LIMIT_HIT, command->args[0], hit);
+        return limit_code;
+    }
+    return code;
+}
+
+
+void free_limits(ResourceLimits *limits){
+    if (limits == NULL) return;
+    if (limits->cgroup_path != NULL) {
+        rmdir(limits->cgroup_path);
+        free(limits->cgroup_path);
+    }
+    free(limits);
+}
@@ -0,0 +1,512 @@
+#include "shell.h"
+
+#include <sys/sendfile.h>
+#include <time.h>
+
+/*
+** Content-addressed result cache: `memo [--inputs F,G] [--vars A,B]
+** [--mtime] -- cmd args...`
+**
+** The key is a SHA-256 over the working directory, the resolved
+** executable, argv, the named variables and the input files (their
+** content, or with --mtime just their size and modification time).
+** An entry is two files in the store (memodir=, by default
+** ~/.cache/cscshell/memo): KEY.out with the command's stdout and
+** KEY.st with its exit status, which is written last and so marks the
+** entry complete.
+**
+** Everything happens in the forked stage. On a hit it copies KEY.out to
+** its stdout and exits with the stored status. On a miss it forks
+** again: the grandchild runs the command with stdout into a pipe, and
+** the stage tees that pipe to its own stdout and a temp file which is
+** renamed into place once the command has exited normally. Entries are
+** evicted least recently used first (KEY.st's mtime is touched on each
+** hit) once the store outgrows memosize=.
+*/
+
+typedef struct Sha256 {
+    uint32_t state[8];
+    uint64_t bits;
+    uint8_t block[64];
+    size_t used;
+} Sha256;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_init(Sha256 *h){
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(h->state, initial, sizeof(initial));
+    h->bits = 0;
+    h->used = 0;
+}
+
+static void sha256_block(Sha256 *h, const uint8_t *p){
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 |
+               (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h->state[0], b = h->state[1], c = h->state[2], d = h->state[3];
+    uint32_t e = h->state[4], f = h->state[5], g = h->state[6], k = h->state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) +
+                      ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h->state[0] += a; h->state[1] += b; h->state[2] += c; h->state[3] += d;
+    h->state[4] += e; h->state[5] += f; h->state[6] += g; h->state[7] += k;
+}
+
+static void sha256_update(Sha256 *h, const void *data, size_t len){
+    const uint8_t *p = data;
+    h->bits += (uint64_t) len * 8;
+    while (len > 0) {
+        size_t n = 64 - h->used;
+        if (n > len) n = len;
+        memcpy(h->block + h->used, p, n);
+        h->used += n;
+        p += n;
+        len -= n;
+        if (h->used == 64) {
+            sha256_block(h, h->block);
+            h->used = 0;
+        }
+    }
+}
+
+// finishes the hash as 64 lowercase hex digits
+static void sha256_hex(Sha256 *h, char hex[65]){
+    uint64_t bits = h->bits;
+    uint8_t pad = 0x80;
+    sha256_update(h, &pad, 1);
+    pad = 0;
+    while (h->used != 56) sha256_update(h, &pad, 1);
+    uint8_t len[8];
+    for (int i = 0; i < 8; i++) len[i] = (uint8_t) (bits >> (56 - 8 * i));
+    sha256_update(h, len, 8);
+    for (int i = 0; i < 8; i++) {
+        snprintf(hex + 8 * i, 9, "%08x", h->state[i]);
+    }
+}
+
+// adds a string and its terminator, so "ab","c" and "a","bc" differ
+static void hash_string(Sha256 *h, const char *text){
+    sha256_update(h, text, strlen(text) + 1);
+}
+
+
+void free_memo(MemoSpec *memo){
+    if (memo == NULL) return;
+    free(memo->inputs);
+    free(memo->vars);
+    free(memo);
+}
+
+int memo_add_option(MemoSpec *memo, const char *option, const char *value){
+    char **list;
+    if (strcmp(option, MEMO_INPUTS_FLAG) == 0) {
+        list = &memo->inputs;
+    } else if (strcmp(option, MEMO_VARS_FLAG) == 0) {
+        list = &memo->vars;
+    } else {
+        ERR_PRINT(ERR_MEMO_USAGE);
+        return -1;
+    }
+    if (value == NULL || *value == '\0') {
+        ERR_PRINT(ERR_MEMO_USAGE);
+        return -1;
+    }
+
+    // repeated flags add to the comma-separated list
+    size_t old_len = *list ? strlen(*list) : 0;
+    char *joined = realloc(*list, old_len + strlen(value) + 2);
+    if (joined == NULL) {
+        perror("memo");
+        return -1;
+    }
+    if (old_len > 0) joined[old_len++] = ',';
+    strcpy(joined + old_len, value);
+    *list = joined;
+    return 0;
+}
+
+// adds one input file: its content, or its size and mtime
+static void hash_input(Sha256 *h, const char *path, int by_mtime){
+    hash_string(h, path);
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        hash_string(h, "\001missing");
+        return;
+    }
+    if (by_mtime) {
+        long long meta[3] = { (long long) st.st_size, (long long) st.st_mtim.tv_sec,
+                              (long long) st.st_mtim.tv_nsec };
+        sha256_update(h, meta, sizeof(meta));
+        return;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        hash_string(h, "\001unreadable");
+        return;
+    }
+    char buf[65536];
+    ssize_t n;
+    uint64_t total = 0;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        sha256_update(h, buf, n);
+        total += n;
+    }
+    sha256_update(h, &total, sizeof(total));
+    close(fd);
+}
+
+// calls fn on each item of a comma-separated list
+static void for_each_item(const char *list, Sha256 *h, int by_mtime,
+                          void (*fn)(Sha256 *, const char *, int)){
+    if (list == NULL) return;
+    char *copy = strdup(list);
+    if (copy == NULL) return;
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        fn(h, item, by_mtime);
+    }
+    free(copy);
+}
+
+static Variable *memo_vars;
+
+static void hash_var(Sha256 *h, const char *name, int unused){
+    (void) unused;
+    hash_string(h, name);
+    for (Variable *var = memo_vars; var; var = var->next) {
+        if (strcmp(var->name, name) == 0) {
+            hash_string(h, var->value);
+            return;
+        }
+    }
+    hash_string(h, "\001unset");
+}
+
+static void memo_key(Command *command, char hex[65]){
+    Sha256 h;
+    sha256_init(&h);
+    hash_string(&h, "cscshell-memo-1");
+
+    char cwd[MAX_PATH_STR];
+    hash_string(&h, getcwd(cwd, sizeof(cwd)) ? cwd : "");
+    hash_string(&h, command->exec_path);
+    for (char **arg = command->args; *arg; arg++) {
+        hash_string(&h, *arg);
+    }
+
+    MemoSpec *memo = command->memo;
+    hash_string(&h, "\001vars");
+    memo_vars = command->variables ? *command->variables : NULL;
+    for_each_item(memo->vars, &h, 0, hash_var);
+    hash_string(&h, "\001inputs");
+    for_each_item(memo->inputs, &h, memo->by_mtime, hash_input);
+
+    sha256_hex(&h, hex);
+}
+
+
+// the store directory, created on first use; "" if there is none
+static const char *store_dir(void){
+    static char dir[MAX_PATH_STR];
+    if (shell_options.memo_dir != NULL) {
+        snprintf(dir, sizeof(dir), "%s", shell_options.memo_dir);
+    } else {
+        const char *home = getenv("HOME");
+        if (home == NULL) return "";
+        if (snprintf(dir, sizeof(dir), "%s/%s", home, MEMO_DEFAULT_DIR) >=
+            (int) sizeof(dir)) {
+            return "";
+        }
+    }
+
+    // mkdir -p
+    for (char *slash = dir + 1; ; slash++) {
+        if (*slash != '/' && *slash != '\0') continue;
+        char saved = *slash;
+        *slash = '\0';
+        int bad = mkdir(dir, 0755) < 0 && errno != EEXIST;
+        *slash = saved;
+        if (bad) {
+            perror(dir);
+            return "";
+        }
+        if (saved == '\0') break;
+    }
+    return dir;
+}
+
+// copies all of fd to stdout
+static int copy_to_stdout(int fd){
+    while (1) {
+        ssize_t n = sendfile(STDOUT_FILENO, fd, NULL, 1 << 20);
+        if (n == 0) return 0;
+        if (n > 0) continue;
+        if (errno == EINTR) continue;
+        if (errno != EINVAL && errno != ENOSYS) return -1;
+        // stdout that sendfile cannot write to (e.g. O_APPEND)
+        char buf[65536];
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            if (write_all(STDOUT_FILENO, buf, n) < 0) return -1;
+        }
+        return n < 0 ? -1 : 0;
+    }
+}
+
+// exits the way a signal would have ended the command
+static void die_by_signal(int sig){
+    signal(sig, SIG_DFL);
+    raise(sig);
+    _exit(128 + sig);
+}
+
+// stamps an entry's status file with the precise time (file times are
+// only as fine as the kernel tick, which would tie back-to-back uses)
+static void mark_used(const char *status_path){
+    struct timespec now[2];
+    clock_gettime(CLOCK_REALTIME, &now[0]);
+    now[1] = now[0];
+    utimensat(AT_FDCWD, status_path, now, 0);
+}
+
+typedef struct MemoEntry {
+    char name[80];
+    struct timespec used;
+    long long size;
+} MemoEntry;
+
+static int compare_entries(const void *a, const void *b){
+    const MemoEntry *x = a, *y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+// removes least recently used entries until the store fits memosize
+static void evict(const char *dir){
+    DIR *d = opendir(dir);
+    if (d == NULL) return;
+
+    MemoEntry *entries = NULL;
+    size_t num = 0, cap = 0;
+    long long total = 0;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len != 64 + strlen(MEMO_STATUS_EXT) ||
+            strcmp(ent->d_name + 64, MEMO_STATUS_EXT) != 0) {
+            continue;
+        }
+        char path[MAX_PATH_STR];
+        struct stat st, out_st;
+        snprintf(path, sizeof(path), "%s/%.64s%s", dir, ent->d_name, MEMO_OUTPUT_EXT);
+        if (stat(path, &out_st) < 0) out_st.st_size = 0;
+        snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+        if (stat(path, &st) < 0) continue;
+
+        if (num == cap) {
+            cap = cap ? cap * 2 : 64;
+            MemoEntry *grown = realloc(entries, cap * sizeof(MemoEntry));
+            if (grown == NULL) break;
+            entries = grown;
+        }
+        snprintf(entries[num].name, sizeof(entries[num].name), "%.64s", ent->d_name);
+        entries[num].used = st.st_mtim;
+        entries[num].size = st.st_size + out_st.st_size;
+        total += entries[num].size;
+        num++;
+    }
+    closedir(d);
+
+    long long max = shell_options.memo_max ? shell_options.memo_max : MEMO_DEFAULT_MAX;
+    if (total > max) {
+        qsort(entries, num, sizeof(MemoEntry), compare_entries);
+        for (size_t i = 0; i < num && total > max; i++) {
+            char path[MAX_PATH_STR];
+            // the status goes first, so a half-removed entry is a miss
+            snprintf(path, sizeof(path), "%s/%s%s", dir, entries[i].name, MEMO_STATUS_EXT);
+            unlink(path);
+            snprintf(path, sizeof(path), "%s/%s%s", dir, entries[i].name, MEMO_OUTPUT_EXT);
+            unlink(path);
+            total -= entries[i].size;
+        }
+    }
+    free(entries);
+}
+
+// replays a complete entry and exits, or returns if there is none
+static void try_hit(const char *dir, const char *key){
+    char path[MAX_PATH_STR];
+    snprintf(path, sizeof(path), "%s/%s%s", dir, key, MEMO_STATUS_EXT);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return;
+    int status;
+    int ok = fscanf(f, "%d", &status) == 1;
+    fclose(f);
+    if (!ok) return;
+
+    snprintf(path, sizeof(path), "%s/%s%s", dir, key, MEMO_OUTPUT_EXT);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return;
+
+    // most recently used now
+    snprintf(path, sizeof(path), "%s/%s%s", dir, key, MEMO_STATUS_EXT);
+    mark_used(path);
+
+    if (copy_to_stdout(fd) < 0) {
+        if (errno == EPIPE) die_by_signal(SIGPIPE);
+        perror("memo");
+        _exit(EXIT_FAILURE);
+    }
+    _exit(status);
+}
+
+/*
+** Runs the tee side of a miss: copies the command's output from in_fd
+** to stdout and the temp file, then commits the entry if the command
+** exited normally. Never returns.
+*/
+static void tee_and_commit(const char *dir, const char *key, pid_t pid,
+                           int in_fd, int tmp_fd, const char *tmp_path){
+    char buf[65536];
+    ssize_t n;
+    int store_ok = 1, reader_gone = 0;
+    // signals for the pipeline reach the command too; the tee outlives
+    // it to drop the partial output, then dies the same way
+    int ignored[] = { SIGPIPE, SIGINT, SIGTERM, SIGHUP, SIGQUIT };
+    for (size_t i = 0; i < sizeof(ignored) / sizeof(ignored[0]); i++) {
+        signal(ignored[i], SIG_IGN);
+    }
+
+    while ((n = read(in_fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            store_ok = 0;
+            break;
+        }
+        if (write_all(STDOUT_FILENO, buf, n) < 0) {
+            // let the command see the broken pipe, as it would have
+            reader_gone = (errno == EPIPE);
+            store_ok = 0;
+            break;
+        }
+        if (store_ok && write_all(tmp_fd, buf, n) < 0) {
+            store_ok = 0;
+        }
+    }
+    close(in_fd);
+    close(tmp_fd);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+
+    if (!store_ok || !WIFEXITED(status)) {
+        unlink(tmp_path);
+        if (reader_gone) die_by_signal(SIGPIPE);
+        if (WIFSIGNALED(status)) die_by_signal(WTERMSIG(status));
+        _exit(WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE);
+    }
+
+    char path[MAX_PATH_STR], st_tmp[MAX_PATH_STR];
+    snprintf(path, sizeof(path), "%s/%s%s", dir, key, MEMO_OUTPUT_EXT);
+    snprintf(st_tmp, sizeof(st_tmp), "%s.%d", tmp_path, (int) getpid());
+    FILE *f = fopen(st_tmp, "w");
+    int committed = 0;
+    if (f != NULL && rename(tmp_path, path) == 0) {
+        fprintf(f, "%d\n", WEXITSTATUS(status));
+        snprintf(path, sizeof(path), "%s/%s%s", dir, key, MEMO_STATUS_EXT);
+        committed = fclose(f) == 0 && rename(st_tmp, path) == 0;
+        if (committed) mark_used(path);
+        f = NULL;
+    }
+    if (f != NULL) fclose(f);
+    if (!committed) {
+        unlink(tmp_path);
+        unlink(st_tmp);
+    }
+    evict(dir);
+    _exit(WEXITSTATUS(status));
+}
+
+void memo_run_child(Command *command){
+    if (command->memo == NULL) return;
+
+    char key[65];
+    memo_key(command, key);
+    const char *dir = store_dir();
+    if (*dir == '\0') return;       // no store: just run the command
+
+    try_hit(dir, key);
+
+    // the tee never execs, so it must drop the shell's other pipe ends
+    close_cloexec_fds();
+
+    char tmp_path[MAX_PATH_STR];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s/%s.tmp.%d", dir, key,
+                 (int) getpid()) >= (int) sizeof(tmp_path)) {
+        return;
+    }
+    int tmp_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int fd[2];
+    if (tmp_fd < 0 || pipe(fd) < 0) {
+        if (tmp_fd >= 0) {
+            close(tmp_fd);
+            unlink(tmp_path);
+        }
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fd[0]);
+        close(fd[1]);
+        close(tmp_fd);
+        unlink(tmp_path);
+        return;
+    }
+    if (pid == 0) {
+        // the command itself, writing into the tee
+        close(fd[0]);
+        close(tmp_fd);
+        if (dup2(fd[1], STDOUT_FILENO) < 0) {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+        close(fd[1]);
+        return;
+    }
+    close(fd[1]);
+    tee_and_commit(dir, key, pid, fd[0], tmp_fd, tmp_path);
+}
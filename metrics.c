@@ -0,0 +1,135 @@
+
+#include "shell.h"
+
+#include <time.h>
+
+/*
+** Counters and histograms for long-running shells, in the Prometheus
+** text exposition format.
+**
+** The hot paths bump fields of shell_metrics directly; the shell is a
+** single thread, so a plain increment is all a counter costs. The
+** `stats` builtin prints them, and with metricsfile=PATH set they are
+** also written to PATH (for node-exporter's textfile collector) at most
+** every metricsinterval= seconds, after a line has run, and at exit.
+** The file is replaced by a rename, so a scrape never sees half of it.
+*/
+
+ShellMetrics shell_metrics = { 0 };
+
+// upper bounds of the fork latency buckets, in microseconds
+static const long fork_bucket_us[METRICS_FORK_BUCKETS] = {
+    25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+static long long last_write_ms = 0;
+
+static long long monotonic_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void metrics_observe_fork(long long ns){
+    int b = 0;
+    while (b < METRICS_FORK_BUCKETS && ns > fork_bucket_us[b] * 1000LL) b++;
+    shell_metrics.fork_buckets[b]++;
+    shell_metrics.fork_ns_sum += ns;
+}
+
+void metrics_observe_exit(int code, const struct rusage *ru){
+    if (code < 0) code = 0;
+    if (code > METRICS_MAX_CODE) code = METRICS_MAX_CODE;
+    shell_metrics.exit_codes[code]++;
+    long long rss = (long long) ru->ru_maxrss * 1024;     // KiB on Linux
+    if (rss > shell_metrics.peak_rss) shell_metrics.peak_rss = rss;
+}
+
+int metrics_print(FILE *out){
+    ShellMetrics *m = &shell_metrics;
+
+    fprintf(out, "# HELP cscshell_lines_parsed_total Command lines tokenized and parsed.\n"
+            "# TYPE cscshell_lines_parsed_total counter\n"
+            "cscshell_lines_parsed_total %llu\n", m->lines_parsed);
+    fprintf(out, "# HELP cscshell_lines_executed_total Command lines executed.\n"
+            "# TYPE cscshell_lines_executed_total counter\n"
+            "cscshell_lines_executed_total %llu\n", m->lines_executed);
+    fprintf(out, "# HELP cscshell_commands_spawned_total Processes forked for pipeline stages.\n"
+            "# TYPE cscshell_commands_spawned_total counter\n"
+            "cscshell_commands_spawned_total %llu\n", m->commands_spawned);
+    fprintf(out, "# HELP cscshell_command_cache_lookups_total Script statements looked up in "
+            "the parsed command cache.\n"
+            "# TYPE cscshell_command_cache_lookups_total counter\n"
+            "cscshell_command_cache_lookups_total{result=\"hit\"} %llu\n"
+            "cscshell_command_cache_lookups_total{result=\"miss\"} %llu\n",
+            m->cache_hits, m->cache_misses);
+    fprintf(out, "# HELP cscshell_path_index_lookups_total Commands looked up in the "
+            "shared executable index.\n"
+            "# TYPE cscshell_path_index_lookups_total counter\n"
+            "cscshell_path_index_lookups_total{result=\"hit\"} %llu\n"
+            "cscshell_path_index_lookups_total{result=\"miss\"} %llu\n",
+            m->path_index_hits, m->path_index_misses);
+
+    fprintf(out, "# HELP cscshell_fork_seconds Time the shell spends in fork() for a stage.\n"
+            "# TYPE cscshell_fork_seconds histogram\n");
+    unsigned long long count = 0;
+    for (int b = 0; b <= METRICS_FORK_BUCKETS; b++) {
+        count += m->fork_buckets[b];
+        if (b < METRICS_FORK_BUCKETS) {
+            fprintf(out, "cscshell_fork_seconds_bucket{le=\"%g\"} %llu\n",
+                    fork_bucket_us[b] / 1e6, count);
+        }
+    }
+    fprintf(out, "cscshell_fork_seconds_bucket{le=\"+Inf\"} %llu\n"
+            "cscshell_fork_seconds_sum %.9f\n"
+            "cscshell_fork_seconds_count %llu\n", count, m->fork_ns_sum / 1e9, count);
+
+    fprintf(out, "# HELP cscshell_child_exits_total Pipeline stages reaped, by exit code.\n"
+            "# TYPE cscshell_child_exits_total counter\n");
+    for (int code = 0; code <= METRICS_MAX_CODE; code++) {
+        if (m->exit_codes[code] > 0) {
+            fprintf(out, "cscshell_child_exits_total{code=\"%d\"} %llu\n",
+                    code, m->exit_codes[code]);
+        }
+    }
+
+    fprintf(out, "# HELP cscshell_child_peak_rss_bytes Largest resident set of any "
+            "reaped stage.\n"
+            "# TYPE cscshell_child_peak_rss_bytes gauge\n"
+            "cscshell_child_peak_rss_bytes %lld\n", m->peak_rss);
+    return ferror(out) ? -1 : 0;
+}
+
+int metrics_write_file(void){
+    const char *path = shell_options.metrics_file;
+    if (path == NULL) return 0;
+    last_write_ms = monotonic_ms();
+
+    char tmp[MAX_PATH_STR];
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid()) >= (int) sizeof(tmp)) {
+        ERR_PRINT(ERR_BAD_OPTION, OPT_METRICSFILE, path);
+        return -1;
+    }
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        perror(tmp);
+        return -1;
+    }
+    int bad = metrics_print(out);
+    if (fclose(out) != 0) bad = -1;
+    if (bad || rename(tmp, path) < 0) {
+        perror(path);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_tick(void){
+    if (shell_options.metrics_file == NULL) return;
+    long interval = shell_options.metrics_interval > 0 ? shell_options.metrics_interval
+                                                       : METRICS_DEFAULT_INTERVAL;
+    if (monotonic_ms() - last_write_ms >= interval * 1000LL) {
+        metrics_write_file();
+    }
+}
@@ -126,10 +126,169 @@ Variable *createVariable(char *name, char *value) {
 
     // Set the next pointer to NULL
     newVar->next = NULL;
+    newVar->env_index = -1;
 
     return newVar;
 }
 
+/*
+** The environment passed to execve. It starts as a copy of the shell's
+** own environ; exported variables own one "NAME=VALUE" slot each, which
+** is replaced in place whenever the variable changes, so nothing is
+** rebuilt per fork. env_owner[i] is the Variable owning slot i, or NULL
+** for entries inherited from environ.
+*/
+char **shell_envp = NULL;
+static Variable **env_owner = NULL;
+static size_t env_count = 0;
+static size_t env_cap = 0;
+
+// builds a heap "NAME=VALUE" string
+static char *make_env_entry(const char *name, const char *value){
+    size_t name_len = strlen(name), value_len = strlen(value);
+    char *entry = malloc(name_len + value_len + 2);
+    if (entry == NULL) {
+        perror("make_env_entry");
+        return NULL;
+    }
+    memcpy(entry, name, name_len);
+    entry[name_len] = '=';
+    memcpy(entry + name_len + 1, value, value_len + 1);
+    return entry;
+}
+
+// grows envp so it can hold `needed` entries plus the NULL terminator
+static int env_reserve(size_t needed){
+    if (needed + 1 <= env_cap) return 0;
+    size_t cap = env_cap ? env_cap * 2 : 64;
+    while (cap < needed + 1) cap *= 2;
+    char **envp = realloc(shell_envp, cap * sizeof(char *));
+    if (envp == NULL) {
+        perror("env_reserve");
+        return -1;
+    }
+    shell_envp = envp;
+    Variable **owner = realloc(env_owner, cap * sizeof(Variable *));
+    if (owner == NULL) {
+        perror("env_reserve");
+        return -1;
+    }
+    env_owner = owner;
+    env_cap = cap;
+    return 0;
+}
+
+// index of the NAME=... entry in envp, or -1
+static long env_find(const char *name){
+    size_t name_len = strlen(name);
+    for (size_t i = 0; i < env_count; i++) {
+        if (strncmp(shell_envp[i], name, name_len) == 0 &&
+            shell_envp[i][name_len] == '=') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// drops slot i by moving the last entry into it
+static void env_remove_slot(size_t i){
+    free(shell_envp[i]);
+    env_count--;
+    if (i != env_count) {
+        shell_envp[i] = shell_envp[env_count];
+        env_owner[i] = env_owner[env_count];
+        if (env_owner[i] != NULL) {
+            env_owner[i]->env_index = i;
+        }
+    }
+    shell_envp[env_count] = NULL;
+}
+
+int init_shell_env(void){
+    extern char **environ;
+    size_t n = 0;
+    while (environ[n] != NULL) n++;
+    if (env_reserve(n) < 0) return -1;
+    for (size_t i = 0; i < n; i++) {
+        shell_envp[i] = strdup(environ[i]);
+        if (shell_envp[i] == NULL) {
+            perror("init_shell_env");
+            return -1;
+        }
+        env_owner[i] = NULL;
+    }
+    env_count = n;
+    shell_envp[n] = NULL;
+    return 0;
+}
+
+// makes var part of the environment given to children
+static int export_variable(Variable *var){
+    if (var->env_index >= 0) return 0;
+    if (shell_envp == NULL && init_shell_env() < 0) return -1;
+
+    char *entry = make_env_entry(var->name, var->value);
+    if (entry == NULL) return -1;
+
+    long i = env_find(var->name);
+    if (i >= 0) {
+        // take over the inherited entry of the same name
+        free(shell_envp[i]);
+    } else {
+        if (env_reserve(env_count + 1) < 0) {
+            free(entry);
+            return -1;
+        }
+        i = env_count++;
+        shell_envp[env_count] = NULL;
+    }
+    shell_envp[i] = entry;
+    env_owner[i] = var;
+    var->env_index = i;
+    return 0;
+}
+
+// sets a variable's value, keeping its envp slot (if any) in sync
+static int set_variable_value(Variable *var, const char *value){
+    char *copy = strdup(value);
+    if (copy == NULL) return -1;
+    if (var->env_index >= 0) {
+        char *entry = make_env_entry(var->name, copy);
+        if (entry == NULL) {
+            free(copy);
+            return -1;
+        }
+        free(shell_envp[var->env_index]);
+        shell_envp[var->env_index] = entry;
+    }
+    free(var->value);
+    var->value = copy;
+    return 0;
+}
+
+/*
+** A new shell variable. A name the shell inherited in its environ keeps
+** that slot, now owned and updated by the variable, so assigning
+** PATH or HOME changes what children see without an export.
+*/
+static Variable *new_variable(char *name, char *value){
+    Variable *var = createVariable(name, value);
+    if (var == NULL || shell_envp == NULL) return var;
+    long i = env_find(name);
+    if (i >= 0 && env_owner[i] == NULL && export_variable(var) < 0) {
+        free_variable(var, 0);
+        return NULL;
+    }
+    return var;
+}
+
+// the value of name in the inherited environ, or NULL
+static char *inherited_value(const char *name){
+    long i = (shell_envp != NULL) ? env_find(name) : -1;
+    if (i < 0 || env_owner[i] != NULL) return NULL;
+    return shell_envp[i] + strlen(name) + 1;
+}
+
 // MAKE SURE TO SET PATH TO BE THE HEAD OF THE LINKEDLIST FIRST
 // Function to add or update a variable in a list:
 int addOrUpdateVariable(Variable **variables, char *name, char *value) {
@@ -140,12 +299,14 @@ int addOrUpdateVariable(Variable **variables, char *name, char *value) {
 
     }
 
+    set_shell_option(name, value);
+
     Variable *current = *variables;
     Variable *prev = NULL;
 
     // Handle empty list
     if (current == NULL) {
-        Variable *newVar = createVariable(name, value);
+        Variable *newVar = new_variable(name, value);
         if (newVar == NULL) {
             return -1; // Memory allocation failed
         }
@@ -156,17 +317,16 @@ int addOrUpdateVariable(Variable **variables, char *name, char *value) {
 
     if (strcmp(name, "PATH") == 0) {
         if (strcmp(current->name, "PATH") != 0) {
-            Variable *newVar = createVariable(name, value);
+            Variable *newVar = new_variable(name, value);
             if (newVar == NULL) {
                 return -1;
             }
             newVar->next = *variables;
+            *variables = newVar;
             return 0;
         } else {
             // Here, the head of the list is the PATH variable
-            free(current->value);
-            current->value = strdup(value);
-            return current->value ? 0 : -1;
+            return set_variable_value(current, value);
         }
     }
     //empty variables list
@@ -174,17 +334,15 @@ int addOrUpdateVariable(Variable **variables, char *name, char *value) {
     // Traverse the list to find if the variable already exists
     while (current != NULL) {
         if (strcmp(current->name, name) == 0) {
-            // Variable found, update its value
-            free(current->value); // Free the old value
-            current->value = strdup(value); // Assign the new value
-            return current->value ? 0 : -1; // Check strdup success
+            // Variable found, update its value (and its envp slot)
+            return set_variable_value(current, value);
         }
         prev = current; // Keep track of the previous node
         current = current->next; // Move to the next node in the list
     }
 
     // Variable not found, add a new variable to the list
-    Variable *newVar = createVariable(name, value);
+    Variable *newVar = new_variable(name, value);
     if (newVar == NULL) {
         return -1;
     }
@@ -208,20 +366,603 @@ int startsWithEqualSign(char *line) {
 }
 
 
-int defines_path_variable(char *line) {
-    // Look for "PATH=" at the start of the line
-    const char *pathPrefix = "PATH=";
-    
-    // Check if the line starts with "PATH="
-    if (strncmp(line, pathPrefix, strlen(pathPrefix)) == 0) {
-        // Line defines the PATH variable
+
+
+char* find_value_from_name(char* name, Variable *variables);
+
+/*
+** A command line is split into tokens before commands are built from
+** it. Words are unquoted and their variables expanded in the same pass,
+** straight into one argument buffer, so a value is always data: a |
+** or a < inside $VAR never changes the parse. Blanks in an unquoted
+** expansion do split it into several words, as in sh, except in the
+** value of an assignment. Each token's text is a slice of that buffer,
+** which the head command then keeps as its arg_buf.
+*/
+typedef enum TokenKind {
+    TOK_WORD,
+    TOK_PIPE,           // |
+    TOK_OUT,            // >
+    TOK_APPEND,         // >>
+    TOK_IN,             // <
+    TOK_HEREDOC,        // <<
+    TOK_HERESTRING,     // <<<
+    TOK_SUBST_IN,       // <(...), text is the inner line
+    TOK_SUBST_OUT,      // >(...)
+    TOK_SUBSHELL,       // ( list ) as a stage, text is the list
+    TOK_GROUP,          // { list; }
+} TokenKind;
+
+typedef struct Token {
+    uint8_t kind;
+    uint8_t quoted;     // the word had quotes or escapes in it
+    size_t off;         // where text starts in the buffer while it grows
+    char *text;
+} Token;
+
+typedef struct ArgBuf {
+    char *data;
+    size_t len;
+    size_t cap;
+} ArgBuf;
+
+static int buf_put(ArgBuf *buf, const char *s, size_t n){
+    if (buf->len + n + 1 > buf->cap) {
+        size_t cap = (buf->len + n + 1) * 2;
+        char *grown = realloc(buf->data, cap);
+        if (grown == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        buf->data = grown;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, s, n);
+    buf->len += n;
+    return 0;
+}
+
+/*
+** Helper for replace_variables_mk_line and the tokenizer: expands the
+** variable usage at line[i], if one starts there. *value is the text
+** it stands for (an arithmetic result is formatted into arith_text) and
+** *resume the index right after the usage.
+**
+** Returns 1 if it expanded, 0 if line[i] starts no usage, -1 on a
+** usage error (printed) or -2 if a system call failed.
+*/
+static int expand_dollar(const char *line, int i, Variable **variables,
+                         char *arith_text, const char **value, int *resume){
+    int name_start, name_end;
+
+    if (line[i] != '$') {
+        return 0;
+    } else if (line[i + 1] == '(' && line[i + 2] == '(') {
+        // $(( expr )): find the "))" closing it, skipping nested parens
+        int j = i + 3, depth = 0;
+        while (line[j] != '\0') {
+            if (line[j] == '(') {
+                depth++;
+            } else if (line[j] == ')') {
+                if (depth == 0 && line[j + 1] == ')') break;
+                depth--;
+            }
+            j++;
+        }
+        if (line[j] == '\0') {
+            ERR_PRINT(ERR_VAR_USAGE, line);
+            return -1;
+        }
+        char *expr = strndup(line + i + 3, j - (i + 3));
+        if (expr == NULL) {
+            perror("strndup");
+            return -2;
+        }
+        long long result;
+        int bad = arith_eval(expr, variables, &result);
+        free(expr);
+        if (bad) {
+            return -1;
+        }
+        snprintf(arith_text, 32, "%lld", result);
+        *value = arith_text;
+        *resume = j + 2;
         return 1;
+
+    } else if (line[i + 1] == '{') {
+        if (line[i + 2] == '=') {
+            ERR_PRINT(ERR_VAR_START);
+            return -1;
+        }
+
+        int j = i + 2;
+        while (line[j] != '}' && line[j] != '\0') {
+            if (!isValidVarChar(line[j])) {
+                ERR_PRINT(ERR_VAR_NAME, &(line[j]));
+                return -1;
+            }
+            j++;
+        }
+
+        if (line[j] == '\0') { // Unmatched '{'
+            ERR_PRINT(ERR_VAR_USAGE, line);
+            return -1;
+        }
+        name_start = i + 2;
+        name_end = j;
+        *resume = j + 1; // Move past the '}'
+
+    } else if (isdigit((unsigned char)line[i + 1])) {
+        // positional parameter of a script function, a single digit
+        name_start = i + 1;
+        name_end = i + 2;
+        *resume = i + 2;
+
+    } else if (isValidVarChar(line[i + 1])) {
+        int j = i + 1;
+        while (isValidVarChar(line[j])) {
+            j++;
+        }
+        name_start = i + 1;
+        name_end = j;
+        *resume = j; // the terminating char is copied as usual
+
+    } else if (line[i + 1] == '=') {
+        ERR_PRINT(ERR_VAR_START);
+        return -1;
+    } else {
+        return 0;
+    }
+
+    char *var_name = strndup(line + name_start, name_end - name_start);
+    if (var_name == NULL) {
+        perror("strndup");
+        return -2;
     }
-    
-    // Line does not define the PATH variable
+    *value = find_value_from_name(var_name, *variables);
+    free(var_name);
+    return (*value == NULL) ? -1 : 1;   // Variable not found
+}
+
+// helper for tokenize: the ')' closing the '(' at open, or NULL
+static const char *match_paren(const char *open){
+    int depth = 0;
+    char quote = 0;
+    for (const char *c = open; *c != '\0'; c++) {
+        if (quote) {
+            if (*c == quote) quote = 0;
+        } else if (*c == '\\' && c[1] != '\0') {
+            c++;
+        } else if (*c == '\'' || *c == '"') {
+            quote = *c;
+        } else if (*c == '(') {
+            depth++;
+        } else if (*c == ')' && --depth == 0) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+// true if c ends a word that is a reserved word such as { or }
+static int ends_reserved(char c){
+    return c == '\0' || isspace((unsigned char)c) || c == ';' || c == '|' ||
+        c == '<' || c == '>' || c == ')';
+}
+
+// helper for tokenize: the '}' word closing the '{' at open, or NULL
+static const char *match_brace(const char *open){
+    int depth = 0;
+    char quote = 0;
+    for (const char *c = open + 1; *c != '\0'; c++) {
+        int word_start = isspace((unsigned char)c[-1]) || c[-1] == ';' ||
+            c[-1] == '|' || c[-1] == '(';
+        if (quote) {
+            if (*c == quote) quote = 0;
+        } else if (*c == '\\' && c[1] != '\0') {
+            c++;
+        } else if (*c == '\'' || *c == '"') {
+            quote = *c;
+        } else if (*c == '{' && word_start && isspace((unsigned char)c[1])) {
+            depth++;
+        } else if (*c == '}' && word_start && ends_reserved(c[1]) && depth-- == 0) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/*
+** Helper for tokenize: appends the word at line[*i] to buf, unquoted
+** and (if expand) with its variables replaced. '...' keeps everything
+** literally; inside "..." a backslash only escapes " \ $ and `;
+** elsewhere it escapes any character. Stops at blanks and at | < >
+** outside quotes. If split, the blanks of unquoted expansions become
+** NUL bytes, where tokenize cuts the word into fields.
+**
+** Returns 0, or -1 on an error (printed).
+*/
+static int read_word(const char *line, int *i, ArgBuf *buf,
+                     Variable **variables, int expand, int split, uint8_t *quoted){
+    int p = *i;
+    char quote = 0;
+    while (line[p] != '\0' && (quote ||
+           (!isspace((unsigned char)line[p]) &&
+            line[p] != '|' && line[p] != '<' && line[p] != '>'))) {
+        // the run of plain characters up to the next one that matters
+        int run = p;
+        while (line[run] != '\0' && !strchr("'\"\\$", line[run]) &&
+               (quote || (!isspace((unsigned char)line[run]) &&
+                          line[run] != '|' && line[run] != '<' &&
+                          line[run] != '>'))) {
+            run++;
+        }
+        if (run > p) {
+            if (buf_put(buf, line + p, run - p) < 0) return -1;
+            p = run;
+            continue;
+        }
+
+        char c = line[p];
+        const char *value;
+        char arith_text[32];
+        int resume;
+        if (quote == '\'') {
+            if (c == '\'') {
+                quote = 0;
+            } else if (buf_put(buf, &c, 1) < 0) {
+                return -1;
+            }
+            p++;
+        } else if (c == '\'' && quote == 0) {
+            *quoted = 1;
+            quote = c;
+            p++;
+        } else if (c == '"') {
+            *quoted = 1;
+            quote = quote ? 0 : c;
+            p++;
+        } else if (c == '\\' && line[p + 1] != '\0' &&
+                   (quote == 0 || strchr("\"\\$`", line[p + 1]))) {
+            *quoted = 1;
+            if (buf_put(buf, line + p + 1, 1) < 0) return -1;
+            p += 2;
+        } else if (c == '$' && expand) {
+            int found = expand_dollar(line, p, variables, arith_text,
+                                      &value, &resume);
+            if (found < 0) return -1;
+            if (found == 0) {
+                resume = p + 1;
+                value = "$";
+            }
+            size_t start = buf->len;
+            if (buf_put(buf, value, strlen(value)) < 0) return -1;
+            for (size_t b = start; split && quote == 0 && b < buf->len; b++) {
+                if (strchr(" \t\n", buf->data[b])) buf->data[b] = '\0';
+            }
+            p = resume;
+        } else {
+            if (buf_put(buf, &c, 1) < 0) return -1;
+            p++;
+        }
+    }
+    if (quote) {
+        ERR_PRINT(ERR_PARSING_LINE);
+        return -1;
+    }
+    *i = p;
     return 0;
 }
 
+/*
+** Splits line into tokens, expanding and unquoting words as it goes,
+** and if split, cutting unquoted expansions into fields at blanks.
+** The text of every token ends up NUL-terminated in *arg_buf.
+**
+** Returns a heap array of *num_tokens tokens, or NULL on an error
+** (printed), in which case nothing needs freeing.
+*/
+static Token *tokenize(const char *line, Variable **variables, int split,
+                       char **arg_buf, size_t *num_tokens){
+    size_t num = 0, cap = 16;
+    Token *tokens = malloc(cap * sizeof(Token));
+    ArgBuf buf = { NULL, 0, 0 };
+    int i = 0;
+
+    if (tokens == NULL) {
+        perror("tokenize");
+        return NULL;
+    }
+    if (buf_put(&buf, "", 0) < 0) goto error;
+    while (1) {
+        while (isspace((unsigned char)line[i])) i++;
+        if (line[i] == '\0' || line[i] == '#') break;
+
+        if (num == cap) {
+            cap *= 2;
+            Token *grown = realloc(tokens, cap * sizeof(Token));
+            if (grown == NULL) {
+                perror("tokenize");
+                goto error;
+            }
+            tokens = grown;
+        }
+        Token *tok = &tokens[num++];
+        tok->quoted = 0;
+        tok->off = buf.len;
+
+        int stage_start = (num == 1 || tokens[num - 2].kind == TOK_PIPE);
+        if (stage_start && (line[i] == '(' ||
+            (line[i] == '{' && isspace((unsigned char)line[i + 1])))) {
+            // a group's list is compiled on its own later, so it is copied raw
+            const char *close = (line[i] == '(') ? match_paren(line + i)
+                                                 : match_brace(line + i);
+            if (close == NULL) {
+                ERR_PRINT(ERR_PARSING_LINE);
+                goto error;
+            }
+            tok->kind = (line[i] == '(') ? TOK_SUBSHELL : TOK_GROUP;
+            if (buf_put(&buf, line + i + 1, close - (line + i + 1)) < 0) {
+                goto error;
+            }
+            i = close + 1 - line;
+        } else if ((line[i] == '<' || line[i] == '>') && line[i + 1] == '(') {
+            // the inner line is parsed on its own later, so it is copied raw
+            const char *close = match_paren(line + i + 1);
+            if (close == NULL) {
+                ERR_PRINT(ERR_PARSING_LINE);
+                goto error;
+            }
+            tok->kind = (line[i] == '<') ? TOK_SUBST_IN : TOK_SUBST_OUT;
+            if (buf_put(&buf, line + i + 2, close - (line + i + 2)) < 0) {
+                goto error;
+            }
+            i = close + 1 - line;
+        } else if (line[i] == '|') {
+            tok->kind = TOK_PIPE;
+            i++;
+        } else if (line[i] == '>') {
+            tok->kind = (line[i + 1] == '>') ? TOK_APPEND : TOK_OUT;
+            i += (line[i + 1] == '>') ? 2 : 1;
+        } else if (line[i] == '<' && line[i + 1] == '<' && line[i + 2] == '<') {
+            tok->kind = TOK_HERESTRING;
+            i += 3;
+        } else if (line[i] == '<' && line[i + 1] == '<') {
+            tok->kind = TOK_HEREDOC;
+            i += 2;
+        } else if (line[i] == '<') {
+            tok->kind = TOK_IN;
+            i++;
+        } else {
+            tok->kind = TOK_WORD;
+            // a here-doc delimiter is taken as written
+            int expand = !(num > 1 && tokens[num - 2].kind == TOK_HEREDOC);
+            if (read_word(line, &i, &buf, variables, expand, split, &tok->quoted) < 0) {
+                goto error;
+            }
+            if (split && memchr(buf.data + tok->off, '\0', buf.len - tok->off)) {
+                // fields of an unquoted expansion; empty ones are dropped
+                Token word = *tok;
+                num--;
+                for (size_t at = word.off; at < buf.len; ) {
+                    size_t len = strnlen(buf.data + at, buf.len - at);
+                    if (len > 0) {
+                        if (num == cap) {
+                            cap *= 2;
+                            Token *grown = realloc(tokens, cap * sizeof(Token));
+                            if (grown == NULL) {
+                                perror("tokenize");
+                                goto error;
+                            }
+                            tokens = grown;
+                        }
+                        word.off = at;
+                        tokens[num++] = word;
+                    }
+                    at += len + 1;
+                }
+            } else if (buf.len == tok->off && !tok->quoted) {
+                // an unquoted word that expanded to nothing is dropped
+                num--;
+                continue;
+            }
+        }
+        if (buf_put(&buf, "", 1) < 0) goto error;
+    }
+
+    for (size_t t = 0; t < num; t++) {
+        tokens[t].text = buf.data + tokens[t].off;
+    }
+    *arg_buf = buf.data;
+    *num_tokens = num;
+    return tokens;
+
+error:
+    free(tokens);
+    free(buf.data);
+    return NULL;
+}
+
+char **split_words(const char *line, Variable **variables, char **arg_buf,
+                   size_t *num_words){
+    size_t num = 0;
+    Token *tokens = tokenize(line, variables, 1, arg_buf, &num);
+    if (tokens == NULL) return NULL;
+
+    char **words = malloc((num + 1) * sizeof(char *));
+    if (words == NULL) {
+        perror("split_words");
+        goto error;
+    }
+    for (size_t t = 0; t < num; t++) {
+        if (tokens[t].kind != TOK_WORD) {
+            ERR_PRINT(ERR_PARSING_LINE);
+            free(words);
+            goto error;
+        }
+        words[t] = tokens[t].text;
+    }
+    words[num] = NULL;
+    free(tokens);
+    *num_words = num;
+    return words;
+
+error:
+    free(tokens);
+    free(*arg_buf);
+    return NULL;
+}
+
+/*
+** Helper for parse_line: parses the inner line of a <(cmd) or >(cmd)
+** token into a substitution of cmd. The argument it takes points at
+** the substitution's fd_path, filled in once the job has started cmd.
+*/
+static int add_proc_subst(Command *cmd, Token *tok, Variable **variables,
+                          int arg_count){
+    ProcSubst *subst = calloc(1, sizeof(ProcSubst));
+    if (subst == NULL) {
+        perror("add_proc_subst");
+        return -1;
+    }
+    subst->is_output = (tok->kind == TOK_SUBST_OUT);
+    subst->fd = -1;
+    // the raw inner line is ours to parse in place, and expands there
+    subst->commands = parse_line(tok->text, variables);
+    if (subst->commands == NULL || subst->commands == (Command *) -1) {
+        if (subst->commands == NULL) {
+            ERR_PRINT(ERR_PARSING_LINE);
+        }
+        free(subst);
+        return -1;
+    }
+
+    // keep them in argument order
+    ProcSubst **tail = &cmd->substs;
+    while (*tail != NULL) tail = &(*tail)->next;
+    *tail = subst;
+
+    subst->arg_index = arg_count;
+    snprintf(subst->fd_path, sizeof(subst->fd_path), "/dev/fd/-1");
+    cmd->args[arg_count] = subst->fd_path;
+    return 0;
+}
+
+/*
+** Helper for parse_line: makes cmd the ( list ) or { list; } of tok,
+** with the list compiled as a script of its own.
+*/
+static int set_group(Command *cmd, Token *tok, Variable **variables){
+    int incomplete;
+    char *list = tok->text;
+    cmd->group = script_compile(&list, 1, &incomplete);
+    if (cmd->group == NULL) {
+        return -1;
+    }
+    cmd->group_is_brace = (tok->kind == TOK_GROUP);
+    cmd->variables = variables;
+    cmd->exec_path = strdup(cmd->group_is_brace ? "{" : "(");
+    cmd->args = calloc(2, sizeof(char *));
+    if (cmd->exec_path == NULL || cmd->args == NULL) {
+        perror("set_group");
+        return -1;
+    }
+    cmd->args[0] = tok->text;
+    return 0;
+}
+
+void clear_heredoc(Command *cmd){
+    free(cmd->heredoc_delim);
+    free(cmd->heredoc_body);
+    cmd->heredoc_delim = NULL;
+    cmd->heredoc_body = NULL;
+    cmd->heredoc_len = 0;
+    cmd->heredoc_expand = 0;
+}
+
+// <<<word: the word followed by a newline is the whole body
+static int set_here_string(Command *cmd){
+    size_t len = strlen(cmd->heredoc_body);
+    char *body = realloc(cmd->heredoc_body, len + 2);
+    if (body == NULL) {
+        perror("realloc");
+        return -1;
+    }
+    body[len] = '\n';
+    body[len + 1] = '\0';
+    cmd->heredoc_body = body;
+    cmd->heredoc_len = len + 1;
+    return 0;
+}
+
+// true if text starts with the word kw followed by whitespace or the end
+static int is_keyword(const char *text, const char *kw){
+    size_t len = strlen(kw);
+    return strncmp(text, kw, len) == 0 &&
+        (text[len] == '\0' || isspace((unsigned char)text[len]));
+}
+
+// checks a variable name, printing why it is not valid
+static int valid_var_name(const char *name, size_t len){
+    if (len == 0) {
+        ERR_PRINT(ERR_VAR_START);
+        return 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isValidVarChar(name[i])) {
+            ERR_PRINT(ERR_VAR_NAME, name);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// one argument of `export`: NAME or NAME=VALUE
+static int export_word(Variable **variables, char *word){
+    char *eq = strchr(word, '=');
+    size_t name_len = eq ? (size_t)(eq - word) : strlen(word);
+    if (!valid_var_name(word, name_len)) return -1;
+
+    if (eq != NULL) {
+        *eq = '\0';
+        if (addOrUpdateVariable(variables, word, eq + 1) < 0) return -1;
+    }
+
+    Variable *var = *variables;
+    while (var != NULL && strcmp(var->name, word) != 0) var = var->next;
+    if (var == NULL) {
+        // exporting an unset name creates it empty, like sh
+        if (addOrUpdateVariable(variables, word, "") < 0) return -1;
+        for (var = *variables; strcmp(var->name, word) != 0; var = var->next);
+    }
+    return export_variable(var);
+}
+
+int unset_variable(Variable **variables, const char *name){
+    if (strcmp(name, PATH_VAR_NAME) == 0) {
+        ERR_PRINT(ERR_UNSET_PATH);
+        return -1;
+    }
+
+    for (Variable **vp = variables; *vp; vp = &(*vp)->next) {
+        Variable *var = *vp;
+        if (strcmp(var->name, name) == 0) {
+            if (var->env_index >= 0) {
+                env_remove_slot(var->env_index);
+            }
+            *vp = var->next;
+            free_variable(var, 0);
+            return 0;
+        }
+    }
+
+    // not a shell variable, but maybe inherited from our own environ
+    long i = (shell_envp != NULL) ? env_find(name) : -1;
+    if (i >= 0) {
+        env_remove_slot(i);
+    }
+    return 0;
+}
 
 
 Command *parse_line(char *line, Variable **variables){
@@ -244,24 +985,45 @@ while (line[j] != '\0' && isspace((unsigned char)line[j])) {
         return NULL;
     }
 
+    // export NAME[=VALUE]... and unset NAME... are handled like assignments,
+    // their words quoted and expanded like a command's
+    if (is_keyword(line + j, EXPORT_BUILTIN) || is_keyword(line + j, UNSET_BUILTIN)) {
+        int exporting = is_keyword(line + j, EXPORT_BUILTIN);
+        char *expanded = NULL;
+        size_t num_words = 0;
+        Token *words = tokenize(line + j, variables, 0, &expanded, &num_words);
+        if (words == NULL) {
+            return (Command *)-1;
+        }
+        int bad = 0;
+        for (size_t w = 1; w < num_words && !bad; w++) {
+            char *word = words[w].text;
+            if (words[w].kind != TOK_WORD) {
+                ERR_PRINT(ERR_PARSING_LINE);
+                bad = 1;
+            } else if (exporting) {
+                bad = export_word(variables, word) != 0;
+            } else {
+                bad = !valid_var_name(word, strlen(word)) ||
+                    unset_variable(variables, word);
+            }
+        }
+        free(words);
+        free(expanded);
+        return bad ? (Command *)-1 : NULL;
+    }
+
 // Check to see if a line is a variable assignment:
 if (startsWithEqualSign(line)) {
     printf(ERR_VAR_START);
     return (Command *)-1;
 }
 
-//Defining PATH Variable
-if (defines_path_variable(line) == 1) {
-    const char prefix[] = "PATH=";
-    char*s = "PATH";
-    char *pathValue = line + strlen(prefix); // Get the substring after "PATH="
-    int check = addOrUpdateVariable(variables, s, pathValue);
-    if (check == -1) {
-        return (Command *)-1;
-    }
-}
-
+// only the first word can be an assignment, `cmd --opt=x` is a command
 char *equalsPtr = strchr(line, '=');
+if (equalsPtr != NULL && strcspn(line, " \t") < (size_t)(equalsPtr - line)) {
+    equalsPtr = NULL;
+}
 if (equalsPtr != NULL) {
     char *temp = line;
 
@@ -279,8 +1041,20 @@ if (equalsPtr != NULL) {
     char *value = equalsPtr + 1;
 
 
+    // VAR=${VAR}x: the value is expanded and unquoted like one word of
+    // a command, so X="a b" holds one value with a blank
+    char *expanded = NULL;
+    size_t num_words = 0;
+    Token *words = tokenize(value, variables, 0, &expanded, &num_words);
+    if (words == NULL) {
+        return (Command *)-1;
+    }
+    value = (num_words > 0 && words[0].kind == TOK_WORD) ? words[0].text : "";
+    free(words);
+
     // Create new Variable and add new variable to linked-list.
     int check2 = addOrUpdateVariable(variables, name, value);
+    free(expanded);
     if (check2 == -1) {
         return (Command*)-1;
     }
@@ -291,202 +1065,263 @@ if (equalsPtr != NULL) {
 // Head is type Command** resresenting the whole linked list, current should point to a single command
 Command *head = NULL;
 Command **current = &head;
-char* new_line = replace_variables_mk_line(line, *variables);
-if (new_line == NULL || new_line == (char*)-1) {
-    fprintf(stderr, "There was an error with replace_variables");
-    free(new_line);
+char *new_line = NULL;
+size_t num_tokens = 0;
+shell_metrics.lines_parsed++;
+long long start = profile_clock();
+Token *tokens = tokenize(line, variables, 1, &new_line, &num_tokens);
+profile_add(PROFILE_EXPAND, start);
+if (tokens == NULL) {
     return (Command *)-1;
 }
-//curr points to the beginning of the new line
-char* curr = new_line;
-
-char* pipe_index = curr;
-
-// main while loop
-while (*curr != '\0') {
-
-    int arg_count = 0;
+size_t t = 0;
+
+// main while loop, one iteration per pipeline stage
+while (t < num_tokens) {
+    // the stage is tokens [t, stage_end)
+    size_t stage_end = t;
+    while (stage_end < num_tokens && tokens[stage_end].kind != TOK_PIPE) stage_end++;
+
+    if (t == stage_end || (tokens[t].kind != TOK_WORD &&
+        tokens[t].kind != TOK_SUBSHELL && tokens[t].kind != TOK_GROUP) ||
+        (stage_end < num_tokens && stage_end + 1 == num_tokens)) {
+        // an empty stage, one starting with a redirection, or nothing
+        // after a trailing '|'
+        ERR_PRINT(ERR_PARSING_LINE);
+        goto parse_error;
+    }
 
     Command *cmd = calloc(1, sizeof(Command));
     if (!cmd) {
         perror("Failed to allocate memory for Command");
-        return (Command*)-1;
+        goto parse_error;
     }
     *current = cmd;
-
-    while (*curr && isspace((unsigned char)*curr)) curr++;
-    if (!(isValidVarChar(*curr)) || *curr == '|' || *curr == '>' || *curr == '<') {
-        ERR_PRINT(ERR_PARSING_LINE);
-        return (Command *)-1;
-}
-// Curr points to the first letter of a executable
-
-    pipe_index = curr;
-    while (*pipe_index != '|' && *pipe_index != '\0') {
-        pipe_index++;
-    }
-    // pipe_index now points to a pipe symbol or null terminator
-
-    char* exec_start = curr;
-
-    while (*curr != ' ' && *curr != '>' && *curr != '<') {
-        curr++;
-    }
-    //curr now points to the char after the last char of a executable
-    char* exec_name = strndup(exec_start, (curr - exec_start));
-    if (exec_name == NULL) {
-        perror("strndup");
-        return (Command*)-1;
-    }
-
-    cmd->exec_path = resolve_executable(exec_name, variables[0]);
-    if (cmd->exec_path == NULL) {
-        ERR_PRINT(ERR_BAD_PATH, exec_name);
-        return (Command*)-1;
-    }
-    // check if the call above is NULL and handle it
-    cmd->args = calloc(2, sizeof(char*));
-    if (cmd->args == NULL) {
-        perror("calloc");
-        return (Command*)-1;
-    }
-    cmd->args[0] = strdup(exec_name);
     cmd->stdin_fd = STDIN_FILENO;
     cmd->stdout_fd = STDOUT_FILENO;
-    cmd->redir_in_path = NULL;
-    cmd->redir_out_path = NULL;
-    cmd->redir_append = 0;
-    cmd->next = NULL;
-
-    arg_count = 1;  
-    // per command loop
-    // After one iteration of the following loop, both curr and pipe_index should
-    // point to the space after a pipe symbol
-    
-    while (curr < pipe_index) {
-
-    if (*curr == '>') {
-        if (*(curr + 1) == '>') {
-            curr += 2;
-        while (*curr && isspace((unsigned char)*curr)) curr++;
-        if (*curr == '\0' || curr == pipe_index || *curr == '<' || *curr == '#' || *curr == '>') {
-            ERR_PRINT(ERR_PARSING_LINE);
-            return (Command*)-1;
+
+    int arg_count = 0;
+    if (tokens[t].kind == TOK_SUBSHELL || tokens[t].kind == TOK_GROUP) {
+        // ( list ) or { list; }: only redirections may follow
+        if (set_group(cmd, &tokens[t++], variables) < 0) goto parse_error;
+    } else {
+        char *exec_name = tokens[t++].text;
+
+        // memo [FLAGS] -- cmd: same shape as limit, and may wrap it
+        if (strcmp(exec_name, MEMO_BUILTIN) == 0) {
+            exec_name = NULL;
+            cmd->memo = calloc(1, sizeof(MemoSpec));
+            if (cmd->memo == NULL) {
+                perror("calloc");
+                goto parse_error;
+            }
+            while (t < stage_end && tokens[t].kind == TOK_WORD) {
+                char *flag = tokens[t++].text;
+                if (strcmp(flag, "--") == 0) {
+                    if (t < stage_end && tokens[t].kind == TOK_WORD) {
+                        exec_name = tokens[t++].text;
+                    }
+                    break;
+                }
+                int bad = 0;
+                char *eq = strchr(flag, '=');
+                if (strcmp(flag, MEMO_MTIME_FLAG) == 0) {
+                    cmd->memo->by_mtime = 1;
+                } else if (eq != NULL) {
+                    *eq = '\0';
+                    bad = memo_add_option(cmd->memo, flag, eq + 1);
+                } else {
+                    // --inputs F,G: the value is the next word
+                    char *value = NULL;
+                    if (t < stage_end && tokens[t].kind == TOK_WORD) {
+                        value = tokens[t++].text;
+                    }
+                    bad = memo_add_option(cmd->memo, flag, value);
+                }
+                if (bad) goto parse_error;
+            }
+            if (exec_name == NULL) {
+                ERR_PRINT(ERR_MEMO_USAGE);
+                goto parse_error;
+            }
         }
-        char* redirout_start = curr;
-        // curr points to a valid character of a filename
-        while (*curr != ' ' && *curr != '>' && *curr != '<') {
-        curr++;
-    }
-    if (curr == pipe_index) {
-        ERR_PRINT(ERR_PARSING_LINE);
-        return (Command*)-1;
-    }
-        char* outputredir_name = strndup(redirout_start, (curr - redirout_start));
-        if (outputredir_name == NULL) {
-            perror("strndup");
-            return (Command*)-1;
+
+        // limit KEY=VALUE... -- cmd: the specs come before the real command
+        if (strcmp(exec_name, LIMIT_BUILTIN) == 0) {
+            exec_name = NULL;
+            cmd->limits = calloc(1, sizeof(ResourceLimits));
+            if (cmd->limits == NULL) {
+                perror("calloc");
+                goto parse_error;
+            }
+            while (t < stage_end && tokens[t].kind == TOK_WORD) {
+                char *spec = tokens[t++].text;
+                if (strcmp(spec, "--") == 0) {
+                    if (t < stage_end && tokens[t].kind == TOK_WORD) {
+                        exec_name = tokens[t++].text;
+                    }
+                    break;
+                }
+                if (parse_limit_spec(cmd->limits, spec)) goto parse_error;
+            }
+            if (exec_name == NULL) {
+                ERR_PRINT(ERR_LIMIT_USAGE);
+                goto parse_error;
+            }
         }
 
-        cmd->redir_append = (uint8_t)1;
-        cmd->redir_out_path = outputredir_name;
+        // chunked [-j N] [--fixed N] -- cmd: batches of the remaining args
+        if (strcmp(exec_name, CHUNK_BUILTIN) == 0) {
+            exec_name = NULL;
+            cmd->chunk = calloc(1, sizeof(ChunkSpec));
+            if (cmd->chunk == NULL) {
+                perror("calloc");
+                goto parse_error;
+            }
+            cmd->chunk->max_jobs = 1;
+            cmd->chunk->fixed = -1;
+            while (t < stage_end && tokens[t].kind == TOK_WORD) {
+                char *flag = tokens[t++].text;
+                if (strcmp(flag, "--") == 0) {
+                    if (t < stage_end && tokens[t].kind == TOK_WORD) {
+                        exec_name = tokens[t++].text;
+                    }
+                    break;
+                }
+                char *value = strchr(flag, '=');
+                if (value != NULL) {
+                    *value++ = '\0';
+                } else if (t < stage_end && tokens[t].kind == TOK_WORD) {
+                    value = tokens[t++].text;
+                }
+                if (chunk_add_option(cmd->chunk, flag, value)) goto parse_error;
+            }
+            if (exec_name == NULL) {
+                ERR_PRINT(ERR_CHUNK_USAGE);
+                goto parse_error;
+            }
+        }
 
-            
+        // one allocation for the argument array: words and substitutions
+        int max_args = 1;
+        for (size_t i = t; i < stage_end; i++) {
+            if (tokens[i].kind == TOK_WORD || tokens[i].kind == TOK_SUBST_IN ||
+                tokens[i].kind == TOK_SUBST_OUT) {
+                max_args++;
+            }
+        }
+        cmd->args = calloc(max_args + 1, sizeof(char*));
+        if (cmd->args == NULL) {
+            perror("calloc");
+            goto parse_error;
+        }
+        cmd->args[0] = exec_name;
+        arg_count = 1;
+
+        // builtins run in the shell, unless limits need a real process
+        cmd->variables = variables;
+        cmd->builtin = cmd->limits ? NULL : find_builtin(exec_name);
+        if (cmd->builtin != NULL) {
+            cmd->exec_path = strdup(exec_name);
         } else {
-        curr += 1;
-        while (*curr && isspace((unsigned char)*curr)) curr++;
-        if (*curr == '\0' || curr == pipe_index || *curr == '<' || *curr == '#' || *curr == '>') {
-            ERR_PRINT(ERR_PARSING_LINE);
-            return (Command*)-1;
+            start = profile_clock();
+            cmd->exec_path = path_index_lookup(exec_name, variables[0]);
+            if (cmd->exec_path == NULL) {
+                cmd->exec_path = resolve_executable(exec_name, variables[0]);
+            }
+            profile_add(PROFILE_RESOLVE, start);
         }
-        char* redir_out_start = curr;
-        // curr points to a valid first character of a filename
-        while (*curr != ' ' && *curr != '>' && *curr != '<' && curr != pipe_index) {
-        curr++;
-    }
-    if (curr == pipe_index) {
-        ERR_PRINT(ERR_PARSING_LINE);
-        return (Command*)-1;
-    }
-    // curr now points to the character after the last char of a filename
-    char* outputredir_name = strndup(redir_out_start, (curr - redir_out_start));
-    if (outputredir_name == NULL) {
-            perror("strndup");
-            return (Command*)-1;
+        if (cmd->exec_path == NULL) {
+            ERR_PRINT(ERR_NO_EXECU, exec_name);
+            goto parse_error;
         }
-
-    cmd->redir_out_path = outputredir_name;
     }
-    } else if (*curr == '<') {
-        curr += 1;
-        while (*curr && isspace((unsigned char)*curr)) curr++;
-        if (*curr == '\0' || curr == pipe_index || *curr == '<' || *curr == '#' || *curr == '>') {
-            ERR_PRINT(ERR_PARSING_LINE);
-            return (Command*)-1;
-        }
 
-        char* redirin_start = curr;
+    // per command loop, stops at the pipe symbol (or end of line)
+    for (; t < stage_end; t++) {
+        Token *tok = &tokens[t];
+        char **target = NULL;
 
-        // curr points to a valid character of a filename
-        while (*curr != ' ' && *curr != '>' && *curr != '<') {
-        curr++;
-        }
-        if (curr == pipe_index) {
+        if (cmd->group != NULL && (tok->kind == TOK_WORD ||
+            tok->kind == TOK_SUBST_IN || tok->kind == TOK_SUBST_OUT ||
+            tok->kind == TOK_SUBSHELL || tok->kind == TOK_GROUP)) {
             ERR_PRINT(ERR_PARSING_LINE);
-            return (Command*)-1;
+            goto parse_error;
+        } else if (tok->kind == TOK_WORD) {
+            cmd->args[arg_count++] = tok->text;
+            continue;
+        } else if (tok->kind == TOK_SUBST_IN || tok->kind == TOK_SUBST_OUT) {
+            if (add_proc_subst(cmd, tok, variables, arg_count) < 0) {
+                goto parse_error;
+            }
+            arg_count++;
+            continue;
+        } else if (tok->kind == TOK_OUT || tok->kind == TOK_APPEND) {
+            cmd->redir_append = (tok->kind == TOK_APPEND);
+            target = &cmd->redir_out_path;
+        } else if (tok->kind == TOK_HERESTRING) {
+            // here-string: the word (plus a newline) becomes stdin
+            target = &cmd->heredoc_body;
+        } else if (tok->kind == TOK_HEREDOC) {
+            // here-doc: the body is read later by the caller up to the delimiter
+            target = &cmd->heredoc_delim;
+        } else {
+            target = &cmd->redir_in_path;
         }
 
-        // curr now points to the character after the last char of a filename
-        char* inputredir_name = strndup(redirin_start, (curr - redirin_start));
-        if (inputredir_name == NULL) {
-            perror("strndup");
-            return (Command*)-1;
+        if (t + 1 >= stage_end || tokens[t + 1].kind != TOK_WORD) {
+            ERR_PRINT(ERR_PARSING_LINE);
+            goto parse_error;
         }
-
-        cmd->redir_in_path = inputredir_name;
-        
-    } else if (*curr == '#') {
-        *curr = '\0'; 
-        return head;
-    } else if (*curr != ' ') {
-        // This case takes care of args, curr is now pointing to the first char of an arg
-        char* arg_start = curr;
-
-        while (*curr != ' ' && *curr != '>' && *curr != '<') {
-        curr++;
+        Token *word = &tokens[++t];
+        free(*target);
+        *target = strdup(word->text);
+        if (*target == NULL) {
+            perror("strdup");
+            goto parse_error;
         }
 
-        // curr now points to the character after the last char of an arg
-        // it could be the pipe_index
-
-        char* arg_name = strndup(arg_start, (curr - arg_start));
-        if (arg_name == NULL) {
-            perror("strndup");
-            return (Command*)-1;
-        }
-
-        cmd->args = realloc(cmd->args, (arg_count + 2) * sizeof(char*));
-        if (cmd->args == NULL) {
-            perror("realloc");
-            return (Command*)-1;
+        // the most recent input redirection wins
+        if (target == &cmd->redir_in_path) {
+            clear_heredoc(cmd);
+        } else if (target != &cmd->redir_out_path) {
+            free(cmd->redir_in_path);
+            cmd->redir_in_path = NULL;
+            if (target == &cmd->heredoc_body) {
+                free(cmd->heredoc_delim);
+                cmd->heredoc_delim = NULL;
+                if (set_here_string(cmd) < 0) goto parse_error;
+            } else {
+                free(cmd->heredoc_body);
+                cmd->heredoc_body = NULL;
+                cmd->heredoc_len = 0;
+                // <<EOF expands the body, <<'EOF' and <<"EOF" keep it literal
+                cmd->heredoc_expand = !word->quoted;
+            }
         }
-
-        cmd->args[arg_count] = arg_name;
-        arg_count += 1;
-
     }
 
-    curr++;
+    current = &((*current)->next);
+    t = stage_end + 1;      // past the '|'
 }
-// does args have to be null-terminated?
-cmd->args[arg_count] = NULL;
-
-current = &((*current)->next);
-curr = pipe_index + 1;
 
+free(tokens);
+if (head == NULL) {
+    free(new_line);     // nothing but blanks or a comment after expansion
+} else {
+    head->arg_buf = new_line;
 }
-    sleep(1);
-    return head;
+return head;
+
+parse_error:
+free(tokens);
+free(new_line);
+while (head != NULL) {
+    Command *next = head->next;
+    free_command(head);
+    head = next;
+}
+return (Command *)-1;
 
 }
 
@@ -499,6 +1334,10 @@ char* find_value_from_name(char* name, Variable *variables) {
         }
         current = current->next;
     }
+    char *value = inherited_value(name);
+    if (value != NULL) {
+        return value;
+    }
     ERR_PRINT(ERR_VAR_NOT_FOUND, name);
     return NULL;
 
@@ -515,117 +1354,41 @@ char* find_value_from_name(char* name, Variable *variables) {
 ** system calls fail and the shell needs to exit.
 */
 char *replace_variables_mk_line(const char *line,
-                                Variable *variables){
+                                Variable **variables){
 
     if (line == NULL) {
         return NULL;
     }
 
-    int length = strlen(line) + 1;
-    char *new_line = (char *)malloc(length);
-    if (new_line == NULL) {
-        perror("replace_variables_mk_line");
+    ArgBuf buf = { NULL, 0, 0 };
+    if (buf_put(&buf, "", 0) < 0) {
         return (char *) -1;
     }
-    new_line[0] = '\0';
     int i = 0;
 
     while (line[i] != '\0') {
-        if (line[i] == '$' && line[i + 1] == '{') {
-            if (line[i + 2] == '=') {
-                ERR_PRINT(ERR_VAR_START);
-                return NULL;
-            }
-
-            int j = i + 2;
-            while (line[j] != '}' && line[j] != '\0') {
-                if (!isValidVarChar(line[j])) {
-                    ERR_PRINT(ERR_VAR_NAME, &(line[j]));
-                    return NULL;
-                }
-                j++;
-            }
-
-            if (line[j] == '\0') { // Unmatched '{'
-                ERR_PRINT(ERR_VAR_USAGE, line);
-                free(new_line);
-                return NULL;
-            }
-
-            char *var_name = strndup(line + i + 2, j - (i + 2));
-
-            if (var_name == NULL) {
-                perror("strndup");
-                return (char*)-1;
-            }
-            char *var_value = find_value_from_name(var_name, variables);
-            free(var_name);
-
-            if (var_value == NULL) { // Variable not found
-                free(new_line);
-                return NULL;
-            }
-
-            int new_line_length = strlen(new_line) + strlen(var_value) + 1;
-            char *temp = realloc(new_line, new_line_length);
-            if (temp == NULL) {
-                free(new_line);
-                perror("realloc failed");
-                return (char *)-1;
-            }
-            new_line = temp;
-            strcat(new_line, var_value);
-
-            i = j + 1; // Move past the '}'
-
-        } else if (line[i] == '$') {
-            if (line[i + 1] == '=') {
-                ERR_PRINT(ERR_VAR_START);
-                return NULL;
-            }
-
-            int j = i + 1;
-            // implement this
-            while (line[j] != ' ' && line[j] != '.' && line[j] != '\0') {
-                if (!isValidVarChar(line[j])) {
-                    ERR_PRINT(ERR_VAR_NAME, &(line[j]));
-                    return NULL;
-                }
-                j++;
-            }
-            char *var_name = strndup(line + i + 1, j - (i + 1));
-            if (var_name == NULL) {
-                perror("strndup");
-                return (char*)-1;
-            }
-            char *var_value = find_value_from_name(var_name, variables);
-            free(var_name);
-
-            if (var_value == NULL) { // Variable not found
-                free(new_line);
-                return NULL;
-            }
-
-            int new_line_length = strlen(new_line) + strlen(var_value) + 1;
-            char *temp = realloc(new_line, new_line_length);
-            if (temp == NULL) {
-                free(new_line);
-                perror("realloc failed");
-                return (char *)-1;
-            }
-            new_line = temp;
-            strcat(new_line, var_value);
-
-            i = j + 1; // Move past the white space or dot
-
-        } else {
-            int new_line_len = strlen(new_line);
-            new_line[new_line_len] = line[i];
-            new_line[new_line_len + 1] = '\0';
-            i++;
+        const char *var_value;
+        char arith_text[32];
+        int resume;
+
+        int found = expand_dollar(line, i, variables, arith_text,
+                                  &var_value, &resume);
+        if (found < 0) {
+            free(buf.data);
+            return (found == -2) ? (char *)-1 : NULL;
+        }
+        if (found == 0) {
+            var_value = line + i;
+            resume = i + 1;
+        }
+        if (buf_put(&buf, var_value, found ? strlen(var_value) : 1) < 0) {
+            free(buf.data);
+            return (char *)-1;
         }
+        i = resume;
     }
-    return new_line;
+    buf.data[buf.len] = '\0';
+    return buf.data;
 }
 
 
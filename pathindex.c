@@ -0,0 +1,423 @@
+
+#include "shell.h"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <time.h>
+
+/*
+** A shared index of the executables on a PATH, so that a new shell
+** finds a command with one hash probe instead of reading every PATH
+** directory.
+**
+** There is one file per PATH value in pathindexdir= (by default
+** ~/.cache/cscshell/pathindex), named after a hash of the value. It
+** holds the identity and mtime of each directory, the PATH value
+** itself, the entries ("dir/name", the first directory winning as in
+** resolve_executable) and an open addressing table of their offsets.
+** Shells map it read-only and share its pages.
+**
+** The directories are stat'ed again at most every PATH_INDEX_RECHECK_MS.
+** The first shell to find one changed takes a lock, scans them into a
+** temp file and renames it over the index; shells that lose the race
+** for the lock scan PATH themselves until the new index is in place.
+** The mtimes are taken before the scan, so a change during it makes the
+** new index stale straight away rather than wrong.
+*/
+
+typedef struct IndexHeader {
+    char magic[8];
+    uint32_t size;          // of the whole file
+    uint32_t num_dirs;
+    uint32_t dirs_off;      // IndexDir[num_dirs]
+    uint32_t path_off;      // the PATH value, NUL terminated
+    uint32_t num_slots;     // a power of two
+    uint32_t slots_off;     // uint32_t[num_slots], entry offsets, 0 if empty
+} IndexHeader;
+
+typedef struct IndexDir {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+} IndexDir;
+
+// an entry, 4-byte aligned: its hash, where the name starts, "dir/name"
+typedef struct IndexEntry {
+    uint32_t hash;
+    uint32_t name_at;
+    char path[];
+} IndexEntry;
+
+static char *mapped_for = NULL;     // the PATH value of the current index
+static const char *map = NULL;
+static size_t map_size = 0;
+static long long checked_ms = 0;    // when the directories were last stat'ed
+
+static long long coarse_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a
+static uint32_t hash_name(const char *name){
+    uint32_t h = 2166136261u;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char) *name) * 16777619u;
+    }
+    return h;
+}
+
+static void unmap_index(void){
+    if (map != NULL) munmap((void *) map, map_size);
+    map = NULL;
+    map_size = 0;
+}
+
+void path_index_close(void){
+    unmap_index();
+    free(mapped_for);
+    mapped_for = NULL;
+}
+
+// the index file of path_value, "" if there is no index directory
+static const char *index_file(const char *path_value){
+    static char file[MAX_PATH_STR];
+    char dir[MAX_PATH_STR];
+    if (shell_options.path_index_dir != NULL) {
+        snprintf(dir, sizeof(dir), "%s", shell_options.path_index_dir);
+    } else {
+        const char *home = getenv("HOME");
+        if (home == NULL) return "";
+        if (snprintf(dir, sizeof(dir), "%s/%s", home, PATH_INDEX_DEFAULT_DIR) >=
+            (int) sizeof(dir)) {
+            return "";
+        }
+    }
+
+    // mkdir -p
+    for (char *slash = dir + 1; ; slash++) {
+        if (*slash != '/' && *slash != '\0') continue;
+        char saved = *slash;
+        *slash = '\0';
+        int bad = mkdir(dir, 0755) < 0 && errno != EEXIST;
+        *slash = saved;
+        if (bad) {
+            perror(dir);
+            return "";
+        }
+        if (saved == '\0') break;
+    }
+
+    // FNV-1a, 64 bit
+    uint64_t h = 14695981039346656037ull;
+    for (const char *c = path_value; *c; c++) {
+        h = (h ^ (unsigned char) *c) * 1099511628211ull;
+    }
+    if (snprintf(file, sizeof(file), "%s/%016llx.idx", dir, (unsigned long long) h) >=
+        (int) sizeof(file)) {
+        return "";
+    }
+    return file;
+}
+
+/*
+** Calls visit with each directory of path_value, in order, until it
+** returns nonzero. Returns that value, or 0.
+*/
+static int for_each_dir(const char *path_value, void *data,
+                        int (*visit)(const char *dir, int i, void *data)){
+    char *copy = strdup(path_value);
+    if (copy == NULL) {
+        perror("path index");
+        return -1;
+    }
+    int i = 0, ret = 0;
+    for (char *dir = strtok(copy, ":"); dir != NULL && ret == 0; dir = strtok(NULL, ":")) {
+        ret = visit(dir, i++, data);
+    }
+    free(copy);
+    return ret;
+}
+
+// a missing directory is recorded all zero, so its creation is a change
+static int stat_dir(const char *dir, IndexDir *out){
+    struct stat st;
+    memset(out, 0, sizeof(*out));
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) return -1;
+    out->dev = st.st_dev;
+    out->ino = st.st_ino;
+    out->mtime_sec = st.st_mtim.tv_sec;
+    out->mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+static int count_dir(const char *dir, int i, void *data){
+    (void) dir;
+    *(int *) data = i + 1;
+    return 0;
+}
+
+// 1 if a directory differs from what the index recorded
+static int dir_changed(const char *dir, int i, void *data){
+    const IndexHeader *head = data;
+    const IndexDir *dirs = (const IndexDir *)((const char *) head + head->dirs_off);
+    IndexDir now;
+    if ((uint32_t) i >= head->num_dirs) return 1;
+    stat_dir(dir, &now);
+    return memcmp(&now, &dirs[i], sizeof(now)) != 0;
+}
+
+// 1 if the mapped index is well formed, for path_value and up to date
+static int index_fresh(const char *path_value){
+    const IndexHeader *head = (const IndexHeader *) map;
+    if (map_size < sizeof(IndexHeader) || memcmp(head->magic, PATH_INDEX_MAGIC, 8) != 0 ||
+        head->size != map_size || head->dirs_off >= map_size ||
+        head->num_dirs > (map_size - head->dirs_off) / sizeof(IndexDir) ||
+        head->path_off >= map_size || head->slots_off >= map_size ||
+        head->num_slots == 0 || (head->num_slots & (head->num_slots - 1)) != 0 ||
+        head->num_slots > (map_size - head->slots_off) / sizeof(uint32_t) ||
+        strncmp(map + head->path_off, path_value, map_size - head->path_off) != 0) {
+        return 0;
+    }
+    int num_dirs = 0;
+    for_each_dir(path_value, &num_dirs, count_dir);
+    return (uint32_t) num_dirs == head->num_dirs &&
+        for_each_dir(path_value, (void *) head, dir_changed) == 0;
+}
+
+// maps file, keeping it only if it is fresh; returns 1 if it was
+static int map_index(const char *file, const char *path_value){
+    unmap_index();
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(IndexHeader)) {
+        close(fd);
+        return 0;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return 0;
+    map = p;
+    map_size = st.st_size;
+    if (!index_fresh(path_value)) {
+        unmap_index();
+        return 0;
+    }
+    return 1;
+}
+
+// the index being built: the whole file, and its table of entry offsets
+typedef struct IndexBuild {
+    char *buf;
+    size_t used, cap;
+    uint32_t *slots;
+    uint32_t num_slots, num_entries;
+    IndexDir *dirs;
+} IndexBuild;
+
+static int build_reserve(IndexBuild *b, size_t n){
+    if (b->used + n <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap * 2 : 1 << 16;
+    while (cap < b->used + n) cap *= 2;
+    char *grown = realloc(b->buf, cap);
+    if (grown == NULL) {
+        perror("path index");
+        return -1;
+    }
+    b->buf = grown;
+    b->cap = cap;
+    return 0;
+}
+
+// the slot for name: the one holding it, or the empty one it would go in
+static uint32_t *find_slot(const char *base, uint32_t *slots, uint32_t num_slots,
+                           const char *name, uint32_t hash){
+    for (uint32_t i = hash & (num_slots - 1); ; i = (i + 1) & (num_slots - 1)) {
+        if (slots[i] == 0) return &slots[i];
+        const IndexEntry *e = (const IndexEntry *)(base + slots[i]);
+        if (e->hash == hash && strcmp(e->path + e->name_at, name) == 0) {
+            return &slots[i];
+        }
+    }
+}
+
+static int grow_slots(IndexBuild *b){
+    uint32_t num_slots = b->num_slots ? b->num_slots * 2 : 1024;
+    uint32_t *slots = calloc(num_slots, sizeof(uint32_t));
+    if (slots == NULL) {
+        perror("path index");
+        return -1;
+    }
+    for (uint32_t i = 0; i < b->num_slots; i++) {
+        if (b->slots[i] == 0) continue;
+        const IndexEntry *e = (const IndexEntry *)(b->buf + b->slots[i]);
+        *find_slot(b->buf, slots, num_slots, e->path + e->name_at, e->hash) = b->slots[i];
+    }
+    free(b->slots);
+    b->slots = slots;
+    b->num_slots = num_slots;
+    return 0;
+}
+
+static int add_entry(IndexBuild *b, const char *dir, const char *name){
+    if (2 * (b->num_entries + 1) > b->num_slots && grow_slots(b) < 0) return -1;
+    uint32_t hash = hash_name(name);
+    uint32_t *slot = find_slot(b->buf, b->slots, b->num_slots, name, hash);
+    if (*slot != 0) return 0;       // an earlier directory has it
+
+    size_t dir_len = strlen(dir);
+    int slash = dir[dir_len - 1] != '/';
+    size_t len = (sizeof(IndexEntry) + dir_len + slash + strlen(name) + 1 + 3) & ~(size_t) 3;
+    if (build_reserve(b, len) < 0) return -1;
+    if (b->used + len > UINT32_MAX) return -1;
+    IndexEntry *e = (IndexEntry *)(b->buf + b->used);
+    e->hash = hash;
+    e->name_at = dir_len + slash;
+    snprintf(e->path, len - sizeof(IndexEntry), "%s%s%s", dir, slash ? "/" : "", name);
+    *slot = b->used;
+    b->used += len;
+    b->num_entries++;
+    return 0;
+}
+
+static int scan_dir(const char *dir, int i, void *data){
+    IndexBuild *b = data;
+    // taken before reading, so changes made meanwhile are not missed;
+    // a stale PATH entry adds nothing, like in resolve_executable
+    if (stat_dir(dir, &b->dirs[i]) < 0) return 0;
+    DIR *d = opendir(dir);
+    if (d == NULL) return 0;
+    struct dirent *ent;
+    int ret = 0;
+    while (ret == 0 && (ent = readdir(d)) != NULL) {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        ret = add_entry(b, dir, ent->d_name);
+    }
+    closedir(d);
+    return ret;
+}
+
+// scans path_value's directories into file; returns 0 on success
+static int build_index(const char *file, const char *path_value){
+    int num_dirs = 0;
+    if (for_each_dir(path_value, &num_dirs, count_dir) < 0 || num_dirs == 0) return -1;
+
+    IndexBuild b = { 0 };
+    size_t path_len = strlen(path_value) + 1;
+    size_t head_len = (sizeof(IndexHeader) + num_dirs * sizeof(IndexDir) + path_len + 3) &
+        ~(size_t) 3;
+    b.dirs = calloc(num_dirs, sizeof(IndexDir));
+    int ret = -1;
+    if (b.dirs == NULL || build_reserve(&b, head_len) < 0) goto build_cleanup;
+    memset(b.buf, 0, head_len);
+    b.used = head_len;
+    if (for_each_dir(path_value, &b, scan_dir) != 0) goto build_cleanup;
+    if (b.num_slots == 0 && grow_slots(&b) < 0) goto build_cleanup;
+
+    size_t slots_len = b.num_slots * sizeof(uint32_t);
+    if (build_reserve(&b, slots_len) < 0 || b.used + slots_len > UINT32_MAX) {
+        goto build_cleanup;
+    }
+    IndexHeader *head = (IndexHeader *) b.buf;
+    memcpy(head->magic, PATH_INDEX_MAGIC, 8);
+    head->num_dirs = num_dirs;
+    head->dirs_off = sizeof(IndexHeader);
+    memcpy(b.buf + head->dirs_off, b.dirs, num_dirs * sizeof(IndexDir));
+    head->path_off = head->dirs_off + num_dirs * sizeof(IndexDir);
+    memcpy(b.buf + head->path_off, path_value, path_len);
+    head->num_slots = b.num_slots;
+    head->slots_off = b.used;
+    memcpy(b.buf + b.used, b.slots, slots_len);
+    b.used += slots_len;
+    head->size = b.used;
+
+    char tmp[MAX_PATH_STR];
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", file, (int) getpid()) >= (int) sizeof(tmp)) {
+        goto build_cleanup;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(tmp);
+        goto build_cleanup;
+    }
+    int bad = write_all(fd, b.buf, b.used) < 0;
+    if (close(fd) < 0) bad = 1;
+    if (bad || rename(tmp, file) < 0) {
+        perror(file);
+        unlink(tmp);
+        goto build_cleanup;
+    }
+    ret = 0;
+
+build_cleanup:
+    free(b.buf);
+    free(b.slots);
+    free(b.dirs);
+    return ret;
+}
+
+// brings the mapped index up to date with path_value, if it can be
+static void refresh_index(const char *path_value){
+    if (map != NULL && index_fresh(path_value)) return;
+    const char *file = index_file(path_value);
+    if (*file == '\0' || map_index(file, path_value)) return;
+
+    char lock[MAX_PATH_STR];
+    if (snprintf(lock, sizeof(lock), "%s.lock", file) >= (int) sizeof(lock)) return;
+    int fd = open(lock, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+        // another shell may have rebuilt it before we got the lock
+        if (!map_index(file, path_value) && build_index(file, path_value) == 0) {
+            map_index(file, path_value);
+        }
+    }
+    close(fd);
+}
+
+char *path_index_lookup(const char *command_name, Variable *path){
+    if (command_name == NULL || path == NULL || strchr(command_name, '/') ||
+        strcmp(command_name, CD) == 0 || strcmp(path->name, PATH_VAR_NAME) != 0) {
+        return NULL;
+    }
+
+    long long now = coarse_ms();
+    if (mapped_for == NULL || strcmp(mapped_for, path->value) != 0) {
+        path_index_close();
+        mapped_for = strdup(path->value);
+        if (mapped_for == NULL) {
+            perror("path index");
+            return NULL;
+        }
+        checked_ms = now - PATH_INDEX_RECHECK_MS;
+    }
+    if (now - checked_ms >= PATH_INDEX_RECHECK_MS) {
+        refresh_index(mapped_for);
+        checked_ms = now;
+    }
+    if (map == NULL) {
+        shell_metrics.path_index_misses++;
+        return NULL;
+    }
+
+    const IndexHeader *head = (const IndexHeader *) map;
+    const uint32_t *slots = (const uint32_t *)(map + head->slots_off);
+    uint32_t hash = hash_name(command_name);
+    uint32_t i = hash & (head->num_slots - 1);
+    for (uint32_t probes = 0; probes < head->num_slots && slots[i] != 0; probes++) {
+        if (slots[i] >= map_size - sizeof(IndexEntry)) break;
+        const IndexEntry *e = (const IndexEntry *)(map + slots[i]);
+        if (e->hash == hash && strcmp(e->path + e->name_at, command_name) == 0) {
+            shell_metrics.path_index_hits++;
+            char *exec_path = strdup(e->path);
+            if (exec_path == NULL) perror("path index");
+            return exec_path;
+        }
+        i = (i + 1) & (head->num_slots - 1);
+    }
+    shell_metrics.path_index_misses++;
+    return NULL;
+}
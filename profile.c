@@ -0,0 +1,344 @@
+
+#include "shell.h"
+
+#include <ctype.h>
+#include <sys/resource.h>
+#include <time.h>
+
+/*
+** Per-line script profiler: `cscshell --profile[=FILE] SCRIPT-FILE`.
+**
+** Every executed statement is charged to its source line: a call
+** count, the wall time of the whole statement, the part of it spent in
+** each phase (parse, expand, resolve, fork, wait) and the CPU time of
+** the children reaped meanwhile. Lines run inside a function are kept
+** apart per call path, so the folded output nests them under the line
+** that made the call.
+**
+** At exit a report sorted by wall time goes to stderr, and FILE gets
+** one folded stack per path, line and phase ("script;L3: f;f();L7:
+** echo x;wait 1234", in microseconds) for flamegraph.pl and friends.
+**
+** When off, each hook is a single test of a static pointer.
+*/
+
+typedef struct ProfileEntry {
+    long long calls;
+    long long wall_ns;
+    long long cpu_ns;               // reaped children, user + system
+    long long phase_ns[NUM_PROFILE_PHASES];
+} ProfileEntry;
+
+// one call path: the script itself, or a function called from a line
+typedef struct ProfilePath {
+    char *frames;                   // folded frames, "script;L3: f x;f()"
+    int parent;
+    int call_line;
+    char *func;
+    ProfileEntry *lines;            // indexed by line number
+} ProfilePath;
+
+static const char *phase_names[NUM_PROFILE_PHASES] = {
+    "parse", "expand", "resolve", "fork", "wait"
+};
+
+static char *out_path = NULL;       // NULL while profiling is off
+static char **texts = NULL;         // the source lines, from line 1
+static size_t num_texts = 0;
+static ProfilePath *paths = NULL;
+static size_t num_paths = 0, paths_cap = 0;
+static int cur_path = 0;
+static ProfileEntry *current = NULL;    // the line running now
+static long long cpu_seen = 0;      // children's CPU time already charged
+static int waited = 0;              // a job was waited for since then
+static long long last_tick = 0;     // coarse time the last statement ended
+
+static long long clock_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+** A few ns instead of a few tens, but only at tick resolution. Summed
+** over many short runs the differences still average out to the real
+** time, which is what lines like (( i++ )) in a loop need.
+**
+** Such a line reads it only once, when it ends: it started where the
+** statement before it ended, so the dispatch in between is its own.
+*/
+static long long coarse_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static long long children_cpu_ns(void){
+    struct rusage ru;
+    getrusage(RUSAGE_CHILDREN, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000LL +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000LL;
+}
+
+void profile_enable(const char *path){
+    free(out_path);
+    out_path = strdup(path);
+    if (out_path == NULL) perror("profile_enable");
+}
+
+int profile_enabled(void){
+    return out_path != NULL;
+}
+
+// a line as a frame: "L12: text", with ';' kept out of the frame
+static void line_label(char *buf, size_t size, int line_no){
+    const char *text = (line_no >= 1 && (size_t) line_no <= num_texts)
+        ? texts[line_no - 1] : "";
+    while (isspace((unsigned char)*text)) text++;
+    int n = snprintf(buf, size, "L%d: %.60s", line_no, text);
+    for (int i = 0; i < n && (size_t) i < size; i++) {
+        if (buf[i] == ';') buf[i] = ',';
+    }
+}
+
+static int add_path(const char *frames, int parent, int call_line, const char *func){
+    if (num_paths == paths_cap) {
+        size_t cap = paths_cap ? paths_cap * 2 : 8;
+        ProfilePath *grown = realloc(paths, cap * sizeof(ProfilePath));
+        if (grown == NULL) {
+            perror("profile");
+            return -1;
+        }
+        paths = grown;
+        paths_cap = cap;
+    }
+    ProfilePath *path = &paths[num_paths];
+    path->frames = strdup(frames);
+    path->func = strdup(func);
+    path->lines = calloc(num_texts + 1, sizeof(ProfileEntry));
+    if (path->frames == NULL || path->func == NULL || path->lines == NULL) {
+        perror("profile");
+        free(path->frames);
+        free(path->func);
+        free(path->lines);
+        return -1;
+    }
+    path->parent = parent;
+    path->call_line = call_line;
+    return num_paths++;
+}
+
+int profile_begin(const char *name, char **lines, size_t num_lines){
+    if (out_path == NULL) return 0;
+    texts = calloc(num_lines ? num_lines : 1, sizeof(char *));
+    if (texts == NULL) {
+        perror("profile");
+        return -1;
+    }
+    for (num_texts = 0; num_texts < num_lines; num_texts++) {
+        texts[num_texts] = strdup(lines[num_texts]);
+        if (texts[num_texts] == NULL) {
+            perror("profile");
+            return -1;
+        }
+    }
+    cur_path = add_path(name, -1, 0, "");
+    cpu_seen = children_cpu_ns();
+    last_tick = coarse_ns();
+    return cur_path < 0 ? -1 : 0;
+}
+
+void profile_enter(ProfileMark *mark, int line_no){
+    mark->prev = current;
+    // statements the line runs in a function start from here
+    last_tick = coarse_ns();
+    if (texts == NULL || line_no < 1 || (size_t) line_no > num_texts) {
+        current = NULL;
+        return;
+    }
+    current = &paths[cur_path].lines[line_no];
+    current->calls++;
+    mark->start = clock_ns();
+}
+
+void profile_tick(int line_no){
+    long long now = coarse_ns();
+    if (texts != NULL && line_no >= 1 && (size_t) line_no <= num_texts) {
+        ProfileEntry *e = &paths[cur_path].lines[line_no];
+        e->calls++;
+        e->wall_ns += now - last_tick;
+    }
+    last_tick = now;
+}
+
+void profile_leave(ProfileMark *mark){
+    last_tick = coarse_ns();
+    if (current != NULL) {
+        current->wall_ns += clock_ns() - mark->start;
+        // children only add to RUSAGE_CHILDREN once they are reaped, so
+        // lines that waited for nothing skip the system call
+        if (waited) {
+            long long cpu = children_cpu_ns();
+            current->cpu_ns += cpu - cpu_seen;
+            cpu_seen = cpu;
+            waited = 0;
+        }
+    }
+    current = mark->prev;
+}
+
+long long profile_clock(void){
+    return current != NULL ? clock_ns() : 0;
+}
+
+void profile_add(int phase, long long start){
+    if (current != NULL && start != 0) {
+        current->phase_ns[phase] += clock_ns() - start;
+        waited |= (phase == PROFILE_WAIT);
+    }
+}
+
+void profile_call(const char *func, int line_no){
+    if (texts == NULL) return;
+    for (size_t p = 0; p < num_paths; p++) {
+        if (paths[p].parent == cur_path && paths[p].call_line == line_no &&
+            strcmp(paths[p].func, func) == 0) {
+            cur_path = p;
+            return;
+        }
+    }
+
+    char label[96];
+    line_label(label, sizeof(label), line_no);
+    size_t len = strlen(paths[cur_path].frames) + strlen(label) + strlen(func) + 8;
+    char *frames = malloc(len);
+    if (frames == NULL) {
+        perror("profile");
+        return;
+    }
+    snprintf(frames, len, "%s;%s;%s()", paths[cur_path].frames, label, func);
+    int path = add_path(frames, cur_path, line_no, func);
+    free(frames);
+    if (path >= 0) cur_path = path;
+}
+
+void profile_return(void){
+    if (texts != NULL && paths[cur_path].parent >= 0) {
+        cur_path = paths[cur_path].parent;
+    }
+}
+
+// parse as measured includes the expansion and resolving done inside it
+static long long own_phase(ProfileEntry *e, int phase){
+    if (phase != PROFILE_PARSE) return e->phase_ns[phase];
+    long long own = e->phase_ns[PROFILE_PARSE] - e->phase_ns[PROFILE_EXPAND] -
+        e->phase_ns[PROFILE_RESOLVE];
+    return own > 0 ? own : 0;
+}
+
+static void write_folded(void){
+    FILE *out = fopen(out_path, "w");
+    if (out == NULL) {
+        perror(out_path);
+        return;
+    }
+    char label[96];
+    for (size_t p = 0; p < num_paths; p++) {
+        for (size_t l = 1; l <= num_texts; l++) {
+            ProfileEntry *e = &paths[p].lines[l];
+            if (e->calls == 0) continue;
+            line_label(label, sizeof(label), l);
+            long long rest = e->wall_ns - e->phase_ns[PROFILE_PARSE] -
+                e->phase_ns[PROFILE_FORK] - e->phase_ns[PROFILE_WAIT];
+            for (int ph = 0; ph < NUM_PROFILE_PHASES; ph++) {
+                long long us = own_phase(e, ph) / 1000;
+                if (us > 0) {
+                    fprintf(out, "%s;%s;%s %lld\n", paths[p].frames, label,
+                            phase_names[ph], us);
+                }
+            }
+            // builtins and the shell's own bookkeeping
+            if (rest / 1000 > 0) {
+                fprintf(out, "%s;%s;shell %lld\n", paths[p].frames, label, rest / 1000);
+            }
+        }
+    }
+    fclose(out);
+}
+
+static ProfileEntry *report_lines = NULL;
+
+static int by_wall(const void *a, const void *b){
+    long long wa = report_lines[*(const size_t *)a].wall_ns;
+    long long wb = report_lines[*(const size_t *)b].wall_ns;
+    return (wa < wb) - (wa > wb);
+}
+
+static void print_report(void){
+    // every path's entries for a line add up to that line
+    report_lines = calloc(num_texts + 1, sizeof(ProfileEntry));
+    size_t *order = malloc((num_texts + 1) * sizeof(size_t));
+    if (report_lines == NULL || order == NULL) {
+        perror("profile");
+        free(report_lines);
+        free(order);
+        return;
+    }
+    long long total = 0;
+    size_t num = 0;
+    for (size_t l = 1; l <= num_texts; l++) {
+        ProfileEntry *sum = &report_lines[l];
+        for (size_t p = 0; p < num_paths; p++) {
+            ProfileEntry *e = &paths[p].lines[l];
+            sum->calls += e->calls;
+            sum->wall_ns += e->wall_ns;
+            sum->cpu_ns += e->cpu_ns;
+            for (int ph = 0; ph < NUM_PROFILE_PHASES; ph++) {
+                sum->phase_ns[ph] += e->phase_ns[ph];
+            }
+        }
+        if (sum->calls > 0) order[num++] = l;
+        // a call is no statement itself, so no line's time holds another's
+        total += sum->wall_ns;
+    }
+    qsort(order, num, sizeof(size_t), by_wall);
+
+    fprintf(stderr, "profile: %s, %zu lines run, %.3f ms in statements\n",
+            paths[0].frames, num, total / 1e6);
+    fprintf(stderr, "%6s %9s %10s %9s %9s %9s %9s %10s %10s  %s\n", "line",
+            "calls", "total ms", "parse", "expand", "resolve", "fork", "wait",
+            "cpu ms", "text");
+    for (size_t i = 0; i < num; i++) {
+        ProfileEntry *e = &report_lines[order[i]];
+        const char *text = texts[order[i] - 1];
+        while (isspace((unsigned char)*text)) text++;
+        fprintf(stderr, "%6zu %9lld %10.3f %9.3f %9.3f %9.3f %9.3f %10.3f %10.3f  %.60s\n",
+                order[i], e->calls, e->wall_ns / 1e6,
+                own_phase(e, PROFILE_PARSE) / 1e6, e->phase_ns[PROFILE_EXPAND] / 1e6,
+                e->phase_ns[PROFILE_RESOLVE] / 1e6, e->phase_ns[PROFILE_FORK] / 1e6,
+                e->phase_ns[PROFILE_WAIT] / 1e6, e->cpu_ns / 1e6, text);
+    }
+    fprintf(stderr, "profile: folded stacks in %s\n", out_path);
+    free(report_lines);
+    report_lines = NULL;
+    free(order);
+}
+
+void profile_finish(void){
+    if (texts == NULL) return;
+    current = NULL;
+    print_report();
+    write_folded();
+
+    for (size_t p = 0; p < num_paths; p++) {
+        free(paths[p].frames);
+        free(paths[p].func);
+        free(paths[p].lines);
+    }
+    free(paths);
+    paths = NULL;
+    num_paths = paths_cap = 0;
+    free_lines(texts, num_texts);
+    texts = NULL;
+    num_texts = 0;
+}
@@ -2,6 +2,16 @@
 #include "shell.h"
 
 #include <unistd.h> 
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
 
 int cd_cscshell(const char *target_dir) {
     if (target_dir == NULL) {
@@ -27,129 +37,825 @@ int cd_cscshell(const char *target_dir) {
 
 
 
-int *execute_line(Command *head){
+ShellOptions shell_options = { 0 };
 
-    if (head == NULL) {
-        return NULL; // No commands to execute.
+static volatile sig_atomic_t pending_signal = 0;
+static int exit_signal = 0;
+static int shell_is_interactive = 0;
+static int shell_owns_tty = 0;
+
+static const int forwarded_signals[] = { SIGINT, SIGTERM, SIGHUP, SIGQUIT };
+#define NUM_FORWARDED (sizeof(forwarded_signals) / sizeof(forwarded_signals[0]))
+
+static void shell_signal_handler(int sig){
+    pending_signal = sig;
+}
+
+void init_shell_signals(int interactive){
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = shell_signal_handler;
+    sigemptyset(&sa.sa_mask);
+    // no SA_RESTART: fgets at the prompt must see EINTR
+    sa.sa_flags = 0;
+
+    for (size_t i = 0; i < NUM_FORWARDED; i++) {
+        sigaction(forwarded_signals[i], &sa, NULL);
     }
+    // a reader that goes away must not kill the shell mid-write
+    signal(SIGPIPE, SIG_IGN);
 
-    int *result = malloc(sizeof(int));
-    if (result == NULL) {
-        perror("malloc");
-        return NULL; 
+    shell_is_interactive = interactive;
+    shell_owns_tty = interactive && isatty(STDIN_FILENO) &&
+        tcgetpgrp(STDIN_FILENO) == getpgrp();
+    if (shell_owns_tty) {
+        // we hand the terminal to each pipeline and take it back after
+        signal(SIGTTOU, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
     }
-    *result = 0; // Initialize result
+}
 
-    int lastInput = STDIN_FILENO, fd[2];
+int shell_pending_exit_signal(void){
+    if (exit_signal == 0 && pending_signal != 0) {
+        // a signal that arrived while no pipeline was running
+        if (!(shell_is_interactive && pending_signal == SIGINT)) {
+            exit_signal = pending_signal;
+        }
+        pending_signal = 0;
+    }
+    return exit_signal;
+}
 
-    for (Command *current = head; current; current = current->next) {
-        if (current->next && pipe(fd) == -1) {
-            perror("pipe");
-            *result = -1;
-            break;
+void set_shell_option(const char *name, const char *value){
+    if (strcmp(name, OPT_TIMEOUT) == 0) {
+        char *end;
+        long sec = strtol(value, &end, 10);
+        if (*end != '\0' || sec < 0) {
+            ERR_PRINT(ERR_BAD_OPTION, name, value);
+            return;
+        }
+        shell_options.timeout_sec = sec;
+    } else if (strcmp(name, OPT_PIPESIZE) == 0) {
+        long long size;
+        if (parse_size(value, &size) < 0) {
+            ERR_PRINT(ERR_BAD_OPTION, name, value);
+            return;
+        }
+        // unprivileged users cannot go past the system-wide maximum
+        FILE *f = fopen(PIPE_MAX_SIZE_FILE, "r");
+        long long max;
+        if (f != NULL) {
+            if (fscanf(f, "%lld", &max) == 1 && size > max) {
+                size = max;
+            }
+            fclose(f);
+        }
+        shell_options.pipe_size = size;
+    } else if (strcmp(name, OPT_AFFINITY) == 0) {
+        if (affinity_set(value) < 0) {
+            ERR_PRINT(ERR_BAD_OPTION, name, value);
+        }
+    } else if (strcmp(name, OPT_MEMODIR) == 0) {
+        char *dir = *value ? strdup(value) : NULL;
+        if (*value && dir == NULL) {
+            perror("strdup");
+            return;
+        }
+        free(shell_options.memo_dir);
+        shell_options.memo_dir = dir;
+    } else if (strcmp(name, OPT_MEMOSIZE) == 0) {
+        long long size;
+        if (parse_size(value, &size) < 0) {
+            ERR_PRINT(ERR_BAD_OPTION, name, value);
+            return;
+        }
+        shell_options.memo_max = size;
+    } else if (strcmp(name, OPT_METRICSFILE) == 0) {
+        char *path = *value ? strdup(value) : NULL;
+        if (*value && path == NULL) {
+            perror("strdup");
+            return;
+        }
+        free(shell_options.metrics_file);
+        shell_options.metrics_file = path;
+        metrics_write_file();
+    } else if (strcmp(name, OPT_METRICSINTERVAL) == 0) {
+        char *end;
+        long sec = strtol(value, &end, 10);
+        if (*end != '\0' || sec < 0) {
+            ERR_PRINT(ERR_BAD_OPTION, name, value);
+            return;
+        }
+        shell_options.metrics_interval = sec;
+    } else if (strcmp(name, OPT_STDERRBUF) == 0) {
+        long long size;
+        if (parse_size(value, &size) < 0) {
+            ERR_PRINT(ERR_BAD_OPTION, name, value);
+            return;
+        }
+        shell_options.stderr_buf = size;
+    } else if (strcmp(name, OPT_PATHINDEXDIR) == 0) {
+        char *dir = *value ? strdup(value) : NULL;
+        if (*value && dir == NULL) {
+            perror("strdup");
+            return;
         }
+        free(shell_options.path_index_dir);
+        shell_options.path_index_dir = dir;
+        path_index_close();
+    }
+}
 
-        // Special handling for "cd" command, if present
-        if (strcmp(current->exec_path, "cd") == 0) {
-            *result = cd_cscshell(current->args[1]); 
-            continue; // Move to next command or finish.
+// converts a wait status into a shell exit code (128+N for signal N)
+static int status_to_code(int status){
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return -1;
+}
+
+
+int write_all(int fd, const char *buf, size_t len){
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
         }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
 
-        current->stdin_fd = lastInput;
 
-        if (current->next) {
-            current->stdout_fd = fd[1];
-        } else {
-            current->stdout_fd = STDOUT_FILENO;
+/*
+** Executor core: a single epoll set multiplexes child exits, line
+** timeouts and pipes the shell itself reads or writes.
+**
+** Children are watched through pidfds. On kernels without pidfd_open
+** SIGCHLD stays blocked and is read from a signalfd instead, after
+** which every running stage is polled with a non-blocking wait4.
+** SIGINT/SIGTERM/SIGHUP/SIGQUIT are only unblocked inside epoll_pwait,
+** so a signal can never slip in between the check and the wait.
+*/
+typedef struct Watch Watch;
+typedef void (*watch_fn)(Watch *watch, uint32_t events);
+
+struct Watch {
+    int fd;
+    watch_fn on_ready;
+    void *data;
+    Job *job;
+    uint8_t is_io;          // counted in job->num_io
+    uint8_t dead;
+    Watch *next_dead;
+};
+
+// a buffer the loop writes into a non-blocking pipe as it drains
+typedef struct PipeWriter {
+    char *buf;
+    size_t len;
+    size_t off;
+} PipeWriter;
+
+static int epoll_fd = -1;
+static int have_pidfd = 0;
+static sigset_t forwarded_set;
+static Job *running_jobs = NULL;
+static Watch *dead_watches = NULL;
+
+static int pidfd_open(pid_t pid){
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+static long long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static long long now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+Watch *executor_watch(int fd, uint32_t events, watch_fn on_ready,
+                      void *data, Job *job){
+    Watch *watch = calloc(1, sizeof(Watch));
+    if (watch == NULL) {
+        perror("executor_watch");
+        return NULL;
+    }
+    watch->fd = fd;
+    watch->on_ready = on_ready;
+    watch->data = data;
+    watch->job = job;
+
+    struct epoll_event ev = { .events = events, .data.ptr = watch };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        free(watch);
+        return NULL;
+    }
+    if (job != NULL) {
+        watch->is_io = 1;
+        job->num_io++;
+    }
+    return watch;
+}
+
+// stops watching and closes the fd; freed once the current batch is done
+void executor_unwatch(Watch *watch){
+    if (watch->dead) return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+    close(watch->fd);
+    if (watch->is_io) watch->job->num_io--;
+    watch->dead = 1;
+    watch->next_dead = dead_watches;
+    dead_watches = watch;
+}
+
+static void on_pipe_writable(Watch *watch, uint32_t events){
+    PipeWriter *writer = watch->data;
+    while (!(events & EPOLLERR) && writer->off < writer->len) {
+        ssize_t n = write(watch->fd, writer->buf + writer->off,
+                          writer->len - writer->off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return;
+            break;      // EPIPE: the reader is gone
         }
+        writer->off += n;
+    }
+    free(writer->buf);
+    free(writer);
+    executor_unwatch(watch);
+}
+
+int executor_write_pipe(int fd, const char *buf, size_t len){
+    PipeWriter *writer = calloc(1, sizeof(PipeWriter));
+    if (writer == NULL || (writer->buf = malloc(len)) == NULL) {
+        perror("executor_write_pipe");
+        free(writer);
+        return -1;
+    }
+    memcpy(writer->buf, buf, len);
+    writer->len = len;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (executor_watch(fd, EPOLLOUT, on_pipe_writable, writer, NULL) == NULL) {
+        free(writer->buf);
+        free(writer);
+        return -1;
+    }
+    return 0;
+}
 
-        *result = run_command(current);
+/*
+** stderrbuf=SIZE gives every forked stage a stderr pipe of its own. The
+** event loop drains it as it fills into a ring that keeps the last SIZE
+** bytes, so a chatty stage never blocks on it, and the ring is printed,
+** each line under the stage's prefix, only if the stage fails.
+**
+** The pipe's watch belongs to the job, which is not retired before the
+** pipe is at EOF; whichever comes last of EOF and the reaped stage
+** prints the ring, so it holds everything the stage wrote.
+*/
+typedef struct StderrRing {
+    char *buf;
+    size_t size;
+    long long total;        // bytes read so far
+    int write_fd;           // the stage's end, until it is forked
+    Watch *watch;           // NULL once the pipe is at EOF
+    Command *cmd;
+    int code;               // the stage's exit code, once reaped
+    uint8_t reaped;
+} StderrRing;
 
-        if (lastInput != STDIN_FILENO) {
-            close(lastInput);
+static void ring_drain(StderrRing *ring){
+    while (ring->watch != NULL) {
+        size_t pos = ring->total % ring->size;
+        ssize_t n = read(ring->watch->fd, ring->buf + pos, ring->size - pos);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) return;
+        if (n <= 0) {
+            executor_unwatch(ring->watch);
+            ring->watch = NULL;
+            return;
+        }
+        ring->total += n;
+    }
+}
+
+static void ring_close(Command *cmd){
+    StderrRing *ring = cmd->stderr_ring;
+    if (ring == NULL) return;
+    if (ring->write_fd >= 0) close(ring->write_fd);
+    if (ring->watch != NULL) executor_unwatch(ring->watch);
+    free(ring->buf);
+    free(ring);
+    cmd->stderr_ring = NULL;
+}
+
+// prints what the stage kept of its stderr, every line prefixed
+static void ring_dump(Command *cmd){
+    StderrRing *ring = cmd->stderr_ring;
+    if (ring->total == 0) return;
+    const char *name = (cmd->args != NULL && cmd->args[0] != NULL)
+        ? cmd->args[0] : cmd->exec_path;
+
+    char *text = NULL;
+    size_t text_len = 0;
+    FILE *out = open_memstream(&text, &text_len);
+    if (out == NULL) {
+        perror("open_memstream");
+        return;
+    }
+    size_t len = ring->total < (long long) ring->size ? ring->total : ring->size;
+    size_t start = ring->total < (long long) ring->size ? 0 : ring->total % ring->size;
+    size_t i = 0;
+    if (ring->total > (long long) ring->size) {
+        // the oldest line lost its beginning, so it goes too
+        while (i < len && ring->buf[(start + i) % ring->size] != '\n') i++;
+        if (i < len) i++;
+        fprintf(out, STDERR_DUMP_DROPPED, cmd->stage, name,
+                ring->total - (long long) (len - i));
+    }
+    int line_start = 1;
+    for (; i < len; i++) {
+        char c = ring->buf[(start + i) % ring->size];
+        if (line_start) fprintf(out, STDERR_DUMP_PREFIX, cmd->stage, name);
+        putc(c, out);
+        line_start = (c == '\n');
+    }
+    if (!line_start) putc('\n', out);
+    fclose(out);
+    write_all(STDERR_FILENO, text, text_len);
+    free(text);
+}
+
+// the stage is reaped and its pipe at EOF: prints the ring if it failed
+static void ring_finish(StderrRing *ring){
+    if (ring->code != 0) ring_dump(ring->cmd);
+    ring_close(ring->cmd);
+}
+
+static void on_stderr_readable(Watch *watch, uint32_t events){
+    StderrRing *ring = watch->data;
+    ring_drain(ring);
+    if (ring->watch == NULL && ring->reaped) ring_finish(ring);
+}
+
+// a ring and its pipe, or NULL (the stage then keeps the shell's stderr)
+static StderrRing *ring_open(Job *job, Command *cmd){
+    StderrRing *ring = calloc(1, sizeof(StderrRing));
+    if (ring == NULL || (ring->buf = malloc(shell_options.stderr_buf)) == NULL) {
+        perror("stderrbuf");
+        free(ring);
+        return NULL;
+    }
+    ring->size = shell_options.stderr_buf;
+    ring->cmd = cmd;
+
+    // only the shell's end may be non-blocking, the stage's must block
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) < 0) {
+        perror("pipe");
+        free(ring->buf);
+        free(ring);
+        return NULL;
+    }
+    fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+    ring->write_fd = fd[1];
+    ring->watch = executor_watch(fd[0], EPOLLIN, on_stderr_readable, ring, job);
+    if (ring->watch == NULL) {
+        close(fd[0]);
+        close(fd[1]);
+        free(ring->buf);
+        free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+// records a reaped stage and retires its job once everything is done
+static void finish_stage(Job *job, Command *cmd, int status, struct rusage *ru){
+    int code = limits_finish(cmd, status_to_code(status));
+    metrics_observe_exit(code, ru);
+    events_exit(cmd, status, code, ru);
+    if (cmd->stderr_ring != NULL) {
+        // a child the stage left behind may still hold the pipe
+        StderrRing *ring = cmd->stderr_ring;
+        ring_drain(ring);
+        ring->code = code;
+        ring->reaped = 1;
+        if (ring->watch == NULL) ring_finish(ring);
+    }
+    cmd->pid = 0;
+    if (cmd == job->tail) {
+        job->last_code = code;
+    }
+    job->num_running--;
+}
+
+static void on_child_exit(Watch *watch, uint32_t events){
+    Command *cmd = watch->data;
+    int status;
+    struct rusage ru;
+    if (wait4(cmd->pid, &status, WNOHANG, &ru) <= 0) return;
+    finish_stage(watch->job, cmd, status, &ru);
+    executor_unwatch(watch);
+}
+
+// reaps whatever has exited among a pipeline and its substitutions
+static void poll_stages(Job *job, Command *head){
+    for (Command *cmd = head; cmd; cmd = cmd->next) {
+        for (ProcSubst *subst = cmd->substs; subst; subst = subst->next) {
+            poll_stages(job, subst->commands);
         }
+        int status;
+        struct rusage ru;
+        if (cmd->pid > 0 && wait4(cmd->pid, &status, WNOHANG, &ru) > 0) {
+            finish_stage(job, cmd, status, &ru);
+        }
+    }
+}
+
+static void on_sigchld(Watch *watch, uint32_t events){
+    struct signalfd_siginfo info;
+    while (read(watch->fd, &info, sizeof(info)) == sizeof(info)) {
+        // coalesced: one SIGCHLD may stand for many exits
+    }
+    for (Job *job = running_jobs; job; job = job->next) {
+        poll_stages(job, job->head);
+    }
+}
+
+static Watch *events_watch = NULL;
 
-        lastInput = fd[0];
+static void on_events_writable(Watch *watch, uint32_t events){
+    if (!events_flush()) {
+        executor_unwatch(watch);
+        events_watch = NULL;
+    }
+}
+
+// sends the queued events, leaving what the reader cannot take yet to the loop
+static void flush_events(void){
+    if (!events_flush() || events_watch != NULL) return;
+    int fd = fcntl(events_fd(), F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) return;
+    events_watch = executor_watch(fd, EPOLLOUT, on_events_writable, NULL, NULL);
+    if (events_watch == NULL) close(fd);
+}
+
+static int executor_init(void){
+    if (epoll_fd >= 0) return 0;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    sigemptyset(&forwarded_set);
+    for (size_t i = 0; i < NUM_FORWARDED; i++) {
+        sigaddset(&forwarded_set, forwarded_signals[i]);
+    }
+
+    int probe = pidfd_open(getpid());
+    if (probe >= 0) {
+        close(probe);
+        have_pidfd = 1;
+        return 0;
+    }
+
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    int sfd = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sfd < 0 || executor_watch(sfd, EPOLLIN, on_sigchld, NULL, NULL) == NULL) {
+        perror("signalfd");
+        return -1;
+    }
+    return 0;
+}
+
+static void forward_pending_signal(void){
+    if (pending_signal == 0 || running_jobs == NULL) return;
+    int sig = pending_signal;
+    pending_signal = 0;
+    for (Job *job = running_jobs; job; job = job->next) {
+        kill(-job->pgid, sig);
+    }
+    if (!(shell_is_interactive && sig == SIGINT)) {
+        exit_signal = sig;
+    }
+}
 
-        if (!current->next || *result != 0) {
-            if (current->next) {
-                close(fd[0]);
-                close(fd[1]);
+// escalates timed-out jobs and returns ms until the next deadline, or -1
+static int check_deadlines(void){
+    int next = -1;
+    long long now = now_ms();
+    for (Job *job = running_jobs; job; job = job->next) {
+        if (job->deadline_ms == 0 || job->num_running == 0) continue;
+        if (now >= job->deadline_ms) {
+            if (!job->timed_out) {
+                job->timed_out = 1;
+                ERR_PRINT(ERR_TIMEOUT, job->timeout_sec);
+                kill(-job->pgid, SIGTERM);
+                job->deadline_ms = now + TIMEOUT_KILL_GRACE * 1000LL;
+            } else {
+                kill(-job->pgid, SIGKILL);
+                job->deadline_ms = 0;
+                continue;
             }
-            break;
+        }
+        int left = (int) (job->deadline_ms - now);
+        if (next < 0 || left < next) next = left;
+    }
+    return next;
+}
+
+int executor_run_once(int timeout_ms){
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    sigset_t wait_mask;
+
+    if (executor_init() < 0) return -1;
+
+    sigprocmask(SIG_BLOCK, &forwarded_set, &wait_mask);
+    forward_pending_signal();
+    int deadline = check_deadlines();
+    if (deadline >= 0 && (timeout_ms < 0 || deadline < timeout_ms)) {
+        timeout_ms = deadline;
+    }
+
+    int n = epoll_pwait(epoll_fd, events, MAX_EPOLL_EVENTS, timeout_ms,
+                        &wait_mask);
+    int saved_errno = errno;
+    sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+    if (n < 0 && saved_errno != EINTR) {
+        perror("epoll_pwait");
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        Watch *watch = events[i].data.ptr;
+        if (!watch->dead) {
+            watch->on_ready(watch, events[i].events);
+        }
+    }
+    forward_pending_signal();
+    check_deadlines();
+    flush_events();
+
+    while (dead_watches != NULL) {
+        Watch *next = dead_watches->next_dead;
+        free(dead_watches);
+        dead_watches = next;
+    }
+
+    // retire finished jobs
+    for (Job **jp = &running_jobs; *jp; ) {
+        if ((*jp)->num_running == 0 && (*jp)->num_io == 0) {
+            (*jp)->done = 1;
+            *jp = (*jp)->next;
         } else {
+            jp = &(*jp)->next;
+        }
+    }
+    return 0;
+}
+
+
+/*
+** Returns a readable fd holding the command's here-doc body.
+**
+** Bodies that fit in a pipe are written into one up front, so the
+** write can never block. Larger bodies go into an anonymous memfd
+** file instead of a pipe nobody drains while the shell waits; without
+** memfd support the event loop streams them through the pipe.
+*/
+static int open_heredoc(Command *command){
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) < 0) {
+        perror("open_heredoc");
+        return -1;
+    }
+    int capacity = fcntl(fd[1], F_GETPIPE_SZ);
+    if (capacity > 0 && command->heredoc_len <= (size_t) capacity) {
+        if (write_all(fd[1], command->heredoc_body,
+                      command->heredoc_len) < 0) {
+            perror("open_heredoc");
+            close(fd[0]);
             close(fd[1]);
+            return -1;
         }
+        close(fd[1]);
+        return fd[0];
     }
 
-    if (lastInput != STDIN_FILENO) {
-        close(lastInput);
+    int mfd = memfd_create("cscshell-heredoc", MFD_CLOEXEC);
+    if (mfd < 0) {
+        if (executor_init() < 0 ||
+            executor_write_pipe(fd[1], command->heredoc_body,
+                                command->heredoc_len) < 0) {
+            close(fd[0]);
+            close(fd[1]);
+            return -1;
+        }
+        return fd[0];
     }
+    close(fd[0]);
+    close(fd[1]);
 
-    return result; 
+    if (write_all(mfd, command->heredoc_body, command->heredoc_len) < 0 ||
+        lseek(mfd, 0, SEEK_SET) < 0) {
+        perror("open_heredoc");
+        close(mfd);
+        return -1;
+    }
+    return mfd;
+}
 
-    
-    #ifdef DEBUG
-    printf("\n***********************\n");
-    printf("BEGIN: Executing line...\n");
-    #endif
+// child side: moves fd onto target, exits the child on failure
+static void child_dup(int fd, int target){
+    if (fd == target) return;
+    if (dup2(fd, target) < 0) {
+        perror("dup2");
+        _exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
 
-    #ifdef DEBUG
-    printf("All children created\n");
-    #endif
+// child side: applies pipes, file redirections and here-docs
+static void setup_child_fds(Command *command, int heredoc_fd){
+    if (command->stdin_fd != STDIN_FILENO) {
+        child_dup(command->stdin_fd, STDIN_FILENO);
+    }
+    if (command->stdout_fd != STDOUT_FILENO) {
+        child_dup(command->stdout_fd, STDOUT_FILENO);
+    }
+    if (command->stderr_ring != NULL) {
+        child_dup(command->stderr_ring->write_fd, STDERR_FILENO);
+    }
 
-    // Wait for all the children to finish
+    if (heredoc_fd >= 0) {
+        child_dup(heredoc_fd, STDIN_FILENO);
+    } else if (command->redir_in_path != NULL) {
+        int fd = open(command->redir_in_path, O_RDONLY);
+        if (fd < 0) {
+            perror(command->redir_in_path);
+            _exit(EXIT_FAILURE);
+        }
+        child_dup(fd, STDIN_FILENO);
+    }
 
-    #ifdef DEBUG
-    printf("All children finished\n");
-    #endif
+    if (command->redir_out_path != NULL) {
+        int flags = O_WRONLY | O_CREAT |
+            (command->redir_append ? O_APPEND : O_TRUNC);
+        int fd = open(command->redir_out_path, flags, 0644);
+        if (fd < 0) {
+            perror(command->redir_out_path);
+            _exit(EXIT_FAILURE);
+        }
+        child_dup(fd, STDOUT_FILENO);
+    }
+}
 
-    #ifdef DEBUG
-    printf("END: Executing line...\n");
-    printf("***********************\n\n");
-    #endif
 
-    // return NULL;
+void close_cloexec_fds(void){
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == NULL) return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int fd = atoi(entry->d_name);
+        if (fd > STDERR_FILENO && fd != dirfd(dir) &&
+            (fcntl(fd, F_GETFD) & FD_CLOEXEC)) {
+            close(fd);
+        }
+    }
+    closedir(dir);
+}
+
+// child side: a fresh event loop, the parent's epoll set and jobs are not ours
+static void executor_forget(void){
+    if (epoll_fd >= 0) close(epoll_fd);
+    epoll_fd = -1;
+    running_jobs = NULL;
+    dead_watches = NULL;
+    events_watch = NULL;
+    shell_owns_tty = 0;
+    events_forget();
+}
+
+// child side: runs the list of a ( list ) or piped { list; } stage
+static int run_group(Command *command){
+    int status = 0;
+    // nothing is left to do after the list's last command
+    script_allow_tail_exec(command->group);
+    int ret = script_run(command->group, command->variables, &status);
+    if (ret == SCRIPT_ERROR && status == 0) status = 1;
+    fflush(NULL);
+    return status;
+}
+
+// child side: undoes the shell's signal handling before an exec
+static void reset_child_signals(void){
+    int defaulted[] = { SIGINT, SIGTERM, SIGHUP, SIGQUIT, SIGPIPE,
+                        SIGTTOU, SIGTTIN };
+    for (size_t i = 0; i < sizeof(defaulted) / sizeof(defaulted[0]); i++) {
+        signal(defaulted[i], SIG_DFL);
+    }
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
 }
 
 
 /*
 ** Forks a new process and execs the command
 ** making sure all file descriptors are set up correctly.
+** The child joins process group command->pgid, or leads a
+** new one when it is 0.
 **
-** Parent process returns -1 on error.
+** Parent process returns the child's pid, or -1 on error.
 ** Any child processes should not return.
 */
 int run_command(Command *command){
 
+    if (limits_prepare(command) < 0) {
+        return -1;
+    }
+
+    // the child picks up the shell's input where `read` left it
+    if (command->heredoc_body == NULL && command->redir_in_path == NULL) {
+        shell_input_sync(command->stdin_fd);
+    }
+
+    int heredoc_fd = -1;
+    if (command->heredoc_body != NULL) {
+        heredoc_fd = open_heredoc(command);
+        if (heredoc_fd < 0) {
+            return -1;
+        }
+    }
+
+    long long fork_start = now_ns();
     int pid = fork();
     if (pid == -1) {
         perror("fork");
+        if (heredoc_fd >= 0) close(heredoc_fd);
         return -1;
     } else if (pid == 0) { // Child process
-        if (command->stdin_fd != STDIN_FILENO) {
-            dup2(command->stdin_fd, STDIN_FILENO);
-            close(command->stdin_fd);
+        setpgid(0, command->pgid);
+        reset_child_signals();
+        setup_child_fds(command, heredoc_fd);
+
+        // the stage's own ends of <(cmd) / >(cmd) pipes survive the exec
+        for (ProcSubst *subst = command->substs; subst; subst = subst->next) {
+            fcntl(subst->fd, F_SETFD, 0);
         }
 
-        if (command->stdout_fd != STDOUT_FILENO) {
-            dup2(command->stdout_fd, STDOUT_FILENO);
-            close(command->stdout_fd);
+        // a cache hit exits here; a miss runs on in a child feeding the cache
+        memo_run_child(command);
+        limits_apply_child(command->limits);
+        affinity_apply_child(command->stage);
+        // each batch of a chunked command returns here with its own args
+        chunk_run_child(command);
+
+        if (command->builtin != NULL) {
+            close_cloexec_fds();
+            shell_input_forget();
+            _exit(command->builtin(command, STDIN_FILENO, STDOUT_FILENO));
+        }
+        if (command->group != NULL) {
+            // the list runs right here: this child is the subshell
+            executor_forget();
+            close_cloexec_fds();
+            shell_input_forget();
+            init_shell_signals(0);
+            _exit(run_group(command));
         }
 
-        execv(command->exec_path, command->args);
-        perror("execv");
-        exit(EXIT_FAILURE);
+        execve(command->exec_path, command->args,
+               shell_envp != NULL ? shell_envp : environ);
+        perror("execve");
+        _exit(EXIT_FAILURE);
     }
 
-    // Parent process
-    int status;
-    waitpid(pid, &status, 0);
-    if (WIFEXITED(status)) {
-        return WEXITSTATUS(status);
-    }
-    return -1; 
+    metrics_observe_fork(now_ns() - fork_start);
+    shell_metrics.commands_spawned++;
+    command->started_ns = fork_start;
+    if (heredoc_fd >= 0) close(heredoc_fd);
 
+    // Parent process; also set here so kill(-pgid) works right away
+    setpgid(pid, command->pgid ? command->pgid : pid);
 
     #ifdef DEBUG
     printf("Running command: %s\n", command->exec_path);
@@ -176,49 +882,577 @@ int run_command(Command *command){
     #ifdef DEBUG
     printf("Parent process created child PID [%d] for %s\n", pid, command->exec_path);
     #endif
+
+    return pid;
 }
 
+/*
+** Runs a builtin that makes up the whole line inside the shell, with
+** its redirections opened here rather than in a child.
+**
+** Returns the builtin's exit status, or 1 if a redirection failed.
+*/
+static int run_builtin(Command *command, int in_fd){
+    int out_fd = STDOUT_FILENO;
 
-int run_script(char *file_path, Variable **root){
-    file_path = "./cscshell_init";
-    //handle case where no path is defined in init script
+    if (command->heredoc_body != NULL) {
+        in_fd = open_heredoc(command);
+    } else if (command->redir_in_path != NULL) {
+        in_fd = open(command->redir_in_path, O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0) perror(command->redir_in_path);
+    }
+    if (in_fd < 0) return 1;
 
-    FILE *file = fopen(file_path, "r"); // Open the script file for reading
-    if (file == NULL) {
-        ERR_PRINT(ERR_INIT_SCRIPT, file_path);
-        return -1; // Return error if the file cannot be opened
+    if (command->redir_out_path != NULL) {
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC |
+            (command->redir_append ? O_APPEND : O_TRUNC);
+        out_fd = open(command->redir_out_path, flags, 0644);
+        if (out_fd < 0) {
+            perror(command->redir_out_path);
+            out_fd = STDOUT_FILENO;
+            in_fd = -1;
+        }
     }
 
-    char line[MAX_SINGLE_LINE]; 
-    int *exec_result;
+    int code = in_fd >= 0 ? command->builtin(command, in_fd, out_fd) : 1;
 
-    while (fgets(line, sizeof(line), file) != NULL) { // Read the file line by line
-        Command *commands = parse_line(line, root);
+    if (in_fd >= 0 && in_fd != shell_input_fd()) {
+        // a private fd: its number may be reused by the next open
+        shell_input_sync(in_fd);
+        close(in_fd);
+    }
+    if (out_fd != STDOUT_FILENO) close(out_fd);
+    return code;
+}
+
+void exec_tail(Command *command){
+    // anything the shell would still have to do after the command
+    // (wait on a pipeline, enforce a timeout or limit, feed a here-doc,
+    // run a builtin, keep reading loop input, write the metricsfile,
+    // report the exit on --events-fd or capture stderr) rules it out
+    if (command->next != NULL || command->builtin != NULL ||
+        command->substs != NULL ||
+        strcmp(command->exec_path, CD) == 0 || command->limits != NULL ||
+        command->memo != NULL || command->chunk != NULL || command->group != NULL ||
+        command->heredoc_body != NULL || shell_options.timeout_sec > 0 ||
+        shell_options.metrics_file != NULL || events_fd() >= 0 ||
+        shell_options.stderr_buf > 0 ||
+        running_jobs != NULL || shell_pending_exit_signal() ||
+        shell_input_fd() != STDIN_FILENO) {
+        return;
+    }
+
+    fflush(NULL);
+    reset_child_signals();
+    command->stdin_fd = STDIN_FILENO;
+    command->stdout_fd = STDOUT_FILENO;
+    setup_child_fds(command, -1);
+    affinity_apply_child(0);
+    execve(command->exec_path, command->args,
+           shell_envp != NULL ? shell_envp : environ);
+    // exactly what a forked child would have reported
+    perror("execve");
+    _exit(EXIT_FAILURE);
+}
+
+// adds a pidfd watch that reaps the stage when it becomes readable
+static int watch_child(Job *job, Command *cmd){
+    int pfd = pidfd_open(cmd->pid);
+    if (pfd < 0) {
+        perror("pidfd_open");
+        return -1;
+    }
+    Watch *watch = executor_watch(pfd, EPOLLIN, on_child_exit, cmd, NULL);
+    if (watch == NULL) {
+        close(pfd);
+        return -1;
+    }
+    // a child watch does not count as job I/O
+    watch->job = job;
+    return 0;
+}
 
-        if (commands == (Command *) -1){
-            ERR_PRINT(ERR_PARSING_LINE);
-            fclose(file);
+static int start_pipeline(Job *job, Command *head, int in_fd, int out_fd);
+
+/*
+** Starts the <(cmd) and >(cmd) pipelines of a stage as more stages of
+** its job, each connected to the stage by a pipe that the stage sees
+** as /dev/fd/N in its arguments.
+**
+** Returns 0 on success, -1 on error.
+*/
+static int start_substs(Job *job, Command *command){
+    for (ProcSubst *subst = command->substs; subst; subst = subst->next) {
+        int fd[2];
+        if (pipe2(fd, O_CLOEXEC) < 0) {
+            perror("pipe");
             return -1;
+        }
+        int bad;
+        if (subst->is_output) {
+            subst->fd = fd[1];
+            bad = start_pipeline(job, subst->commands, fd[0], STDOUT_FILENO);
+            close(fd[0]);
+        } else {
+            subst->fd = fd[0];
+            bad = start_pipeline(job, subst->commands, shell_input_fd(), fd[1]);
+            close(fd[1]);
+        }
+
+        if (bad) return -1;
+        snprintf(subst->fd_path, sizeof(subst->fd_path), "/dev/fd/%d", subst->fd);
+    }
+    return 0;
+}
+
+// parent side: the stage has its own copies of the substitution pipes
+static void close_substs(Command *command){
+    for (ProcSubst *subst = command->substs; subst; subst = subst->next) {
+        if (subst->fd >= 0) close(subst->fd);
+        subst->fd = -1;
     }
+}
 
-    if (commands != NULL) { // If there are commands to execute
-        exec_result = execute_line(commands);
+/*
+** Starts every stage of one pipeline as part of job, the first reading
+** in_fd and the last writing out_fd.
+**
+** Returns 0 on success, -1 if a stage could not be started.
+*/
+static int start_pipeline(Job *job, Command *head, int in_fd, int out_fd){
+    int lastInput = in_fd, fd[2];
+    int stage = 0;
+    int failed = 0;
 
-        if (exec_result == (int*)-1 || exec_result == NULL) {
-            ERR_PRINT(ERR_EXECUTE_LINE);
-            free(exec_result);
-                fclose(file); // Close the file before returning
-                return -1;
+    for (Command *current = head; current; current = current->next) {
+        current->pid = 0;
+        current->stage = stage++;
+
+        // Special handling for "cd" command, if present
+        if (strcmp(current->exec_path, "cd") == 0) {
+            job->last_code = cd_cscshell(current->args[1]); 
+            continue; // Move to next command or finish.
         }
-        free(exec_result); // Free the allocated result
+
+        // a lone builtin needs no process at all, unless it is memoized
+        // or chunked
+        if (current->builtin != NULL && current == job->head &&
+            current->next == NULL && current->substs == NULL &&
+            current->memo == NULL && current->chunk == NULL) {
+            job->last_code = run_builtin(current, in_fd);
+            continue;
+        }
+
+        if (current->next && pipe2(fd, O_CLOEXEC) == -1) {
+            perror("pipe");
+            failed = 1;
+            break;
+        }
+        if (current->next && shell_options.pipe_size > 0 &&
+            fcntl(fd[1], F_SETPIPE_SZ, (int) shell_options.pipe_size) < 0) {
+            // e.g. the user's pipe-user-pages-soft quota is used up;
+            // the pipe still works at its default size
+            perror("F_SETPIPE_SZ");
+        }
+
+        current->stdin_fd = lastInput;
+
+        if (current->next) {
+            current->stdout_fd = fd[1];
+        } else {
+            current->stdout_fd = out_fd;
+        }
+
+        if (shell_options.stderr_buf > 0) {
+            current->stderr_ring = ring_open(job, current);
+        }
+
+        // every stage joins the process group led by the first one
+        pid_t pid = -1;
+        if (start_substs(job, current) == 0) {
+            current->pgid = job->pgid;
+            pid = run_command(current);
+        }
+        close_substs(current);
+        if (pid < 0) {
+            ring_close(current);
+        } else if (current->stderr_ring != NULL) {
+            close(current->stderr_ring->write_fd);
+            current->stderr_ring->write_fd = -1;
+        }
+
+        if (lastInput != in_fd) {
+            close(lastInput);
+        }
+        lastInput = in_fd;
+        if (current->next) {
+            close(fd[1]);
+            lastInput = fd[0];
+        }
+
+        if (pid < 0) {
+            failed = 1;
+            break;
+        }
+        if (job->pgid == 0) {
+            job->pgid = pid;
+            if (job->foreground) {
+                tcsetpgrp(STDIN_FILENO, job->pgid);
+            }
+        }
+        current->pid = pid;
+        job->num_running++;
+        events_spawn(current);
+
+        if (have_pidfd && watch_child(job, current) < 0) {
+            failed = 1;
+            break;
+        }
+    }
+
+    if (lastInput != in_fd) {
+        close(lastInput);
+    }
+    return failed ? -1 : 0;
+}
+
+Job *job_start(Command *head, int foreground){
+    if (executor_init() < 0) return NULL;
+
+    Job *job = calloc(1, sizeof(Job));
+    if (job == NULL) {
+        perror("job_start");
+        return NULL;
+    }
+    job->head = head;
+    job->tail = head;
+    while (job->tail->next != NULL) {
+        job->tail = job->tail->next;
+    }
+    job->foreground = foreground && shell_owns_tty;
+
+    if (start_pipeline(job, head, shell_input_fd(), STDOUT_FILENO) < 0) {
+        job->failed = 1;
+    }
+
+    #ifdef DEBUG
+    printf("All children created\n");
+    #endif
+    flush_events();
+
+    if (job->failed && job->pgid != 0) {
+        // a later stage could not start, do not leave the rest running
+        kill(-job->pgid, SIGTERM);
+    }
+
+    if (job->num_running > 0) {
+        if (shell_options.timeout_sec > 0) {
+            job->timeout_sec = shell_options.timeout_sec;
+            job->deadline_ms = now_ms() + job->timeout_sec * 1000LL;
+        }
+        job->next = running_jobs;
+        running_jobs = job;
+    } else {
+        job->done = 1;
+    }
+    return job;
+}
+
+Job *job_start_subshell(Command *stage, int (*body)(void *arg), void *arg){
+    if (executor_init() < 0) return NULL;
+
+    Job *job = calloc(1, sizeof(Job));
+    if (job == NULL) {
+        perror("job_start_subshell");
+        return NULL;
+    }
+    job->head = job->tail = stage;
+
+    fflush(NULL);
+    long long fork_start = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        job->failed = job->done = 1;
+        return job;
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        executor_forget();
+        int code = body(arg);
+        fflush(NULL);
+        _exit(code);
     }
 
-    free_command(commands);
+    metrics_observe_fork(now_ns() - fork_start);
+    shell_metrics.commands_spawned++;
+    setpgid(pid, pid);
+    stage->pid = pid;
+    stage->started_ns = fork_start;
+    events_spawn(stage);
+    job->pgid = pid;
+    job->num_running = 1;
+    if (have_pidfd && watch_child(job, stage) < 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        stage->pid = 0;
+        job->failed = job->done = 1;
+        return job;
     }
-    fclose(file); // Close the file after processing all lines
+    job->next = running_jobs;
+    running_jobs = job;
+    return job;
+}
+
+int job_wait(Job *job){
+    while (!job->done) {
+        if (executor_run_once(-1) < 0) {
+            job->failed = 1;
+            break;
+        }
+    }
+    if (job->foreground && job->pgid != 0) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+    }
+
+    #ifdef DEBUG
+    printf("All children finished\n");
+    #endif
+
+    if (job->failed) return -1;
+    return job->timed_out ? TIMEOUT_EXIT_CODE : job->last_code;
+}
+
+void job_free(Job *job){
+    free(job);
+}
+
+
+int *execute_line(Command *head){
+
+    if (head == NULL) {
+        return NULL; // No commands to execute.
+    }
+
+    #ifdef DEBUG
+    printf("\n***********************\n");
+    printf("BEGIN: Executing line...\n");
+    #endif
+
+    shell_metrics.lines_executed++;
+    long long start = profile_clock();
+    Job *job = job_start(head, 1);
+    profile_add(PROFILE_FORK, start);
+    if (job == NULL) {
+        return (int *) -1;
+    }
+    start = profile_clock();
+    int code = job_wait(job);
+    profile_add(PROFILE_WAIT, start);
+    job_free(job);
+    metrics_tick();
+
+    #ifdef DEBUG
+    printf("END: Executing line...\n");
+    printf("***********************\n\n");
+    #endif
+
+    if (code == -1) {
+        return (int *) -1;
+    }
+
+    int *result = malloc(sizeof(int));
+    if (result == NULL) {
+        perror("malloc");
+        return (int *) -1;
+    }
+    *result = code;
+    return result; 
+}
+
+
+int read_heredocs(Command *head, FILE *src, Variable **variables){
+    char *line = NULL;
+    size_t line_cap = 0;
+    int interactive = (src == stdin && isatty(STDIN_FILENO));
+
+    for (Command *cmd = head; cmd != NULL; cmd = cmd->next) {
+        if (cmd->heredoc_delim == NULL) continue;
+
+        size_t cap = MAX_SINGLE_LINE, len = 0;
+        char *body = malloc(cap);
+        if (body == NULL) {
+            perror("read_heredocs");
+            free(line);
+            return -1;
+        }
+
+        ssize_t n;
+        while (1) {
+            if (interactive) {
+                printf(CONTINUATION_PROMPT_STR);
+                fflush(stdout);
+            }
+            if ((n = getline(&line, &line_cap, src)) < 0) {
+                ERR_PRINT(ERR_HEREDOC_EOF, cmd->heredoc_delim);
+                break;
+            }
+            if (n > 0 && line[n - 1] == '\n') line[--n] = '\0';
+            if (strcmp(line, cmd->heredoc_delim) == 0) break;
+
+            char *text = line;
+            if (cmd->heredoc_expand && strchr(line, VARIABLE_PARSE_MARKER)) {
+                text = replace_variables_mk_line(line, variables);
+                if (text == NULL || text == (char *) -1) {
+                    free(body);
+                    free(line);
+                    return -1;
+                }
+                n = strlen(text);
+            }
+
+            if (len + n + 2 > cap) {
+                cap = (len + n + 2) * 2;
+                char *grown = realloc(body, cap);
+                if (grown == NULL) {
+                    perror("read_heredocs");
+                    if (text != line) free(text);
+                    free(body);
+                    free(line);
+                    return -1;
+                }
+                body = grown;
+            }
+            memcpy(body + len, text, n);
+            len += n;
+            body[len++] = '\n';
+            if (text != line) free(text);
+        }
+        body[len] = '\0';
+
+        free(cmd->heredoc_delim);
+        cmd->heredoc_delim = NULL;
+        cmd->heredoc_body = body;
+        cmd->heredoc_len = len;
+    }
+
+    free(line);
+    return 0;
+}
+
+
+int shell_last_status = 0;
+
+void free_lines(char **lines, size_t num_lines){
+    for (size_t i = 0; i < num_lines; i++) {
+        free(lines[i]);
+    }
+    free(lines);
+}
+
+int read_lines(FILE *file, char ***lines_out, size_t *num_out){
+    char **lines = NULL;
+    size_t num = 0, cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t n;
+
+    while ((n = getline(&line, &line_cap, file)) >= 0) {
+        if (n > 0 && line[n - 1] == '\n') line[n - 1] = '\0';
+        if (num == cap) {
+            cap = cap ? cap * 2 : 64;
+            char **grown = realloc(lines, cap * sizeof(char *));
+            if (grown == NULL) {
+                perror("read_lines");
+                free(line);
+                free_lines(lines, num);
+                return -1;
+            }
+            lines = grown;
+        }
+        lines[num++] = line;
+        line = NULL;
+        line_cap = 0;
+    }
+    free(line);
+    *lines_out = lines;
+    *num_out = num;
     return 0;
 }
 
+// compiles and runs source lines (and frees them); is_main marks the
+// script or -c string, the last thing the shell runs
+static int run_lines(const char *name, char **lines, size_t num_lines,
+                     Variable **root, int is_main){
+    // the whole script is compiled once, then run from bytecode
+    int incomplete;
+    Script *script = script_compile(lines, num_lines, &incomplete);
+    int profiled = is_main && profile_enabled() && script != NULL &&
+        profile_begin(name, lines, num_lines) == 0;
+    free_lines(lines, num_lines);
+    if (script == NULL) {
+        if (incomplete) {
+            ERR_PRINT(ERR_SCRIPT_SYNTAX, (int) num_lines, "unexpected end of file");
+        }
+        return -1;
+    }
+
+    // an exec in our place would leave nobody to write the profile
+    if (profiled) {
+        script_enable_profile(script);
+    } else if (is_main && !profile_enabled()) {
+        script_allow_tail_exec(script);
+    }
+    int ret = script_run(script, root, &shell_last_status);
+    script_free(script);
+    if (profiled) {
+        profile_finish();
+    }
+    return ret == SCRIPT_ERROR ? -1 : 0;
+}
+
+static int run_file(char *file_path, Variable **root, int tail_exec){
+    //handle case where no path is defined in init script
+
+    FILE *file = fopen(file_path, "r"); // Open the script file for reading
+    if (file == NULL) {
+        ERR_PRINT(ERR_INIT_SCRIPT, file_path);
+        return -1; // Return error if the file cannot be opened
+    }
+
+    char **lines;
+    size_t num_lines;
+    int failed = read_lines(file, &lines, &num_lines);
+    fclose(file); // Close the file after reading all lines
+    if (failed) return -1;
+
+    return run_lines(file_path, lines, num_lines, root, tail_exec);
+}
+
+int run_script(char *file_path, Variable **root){
+    return run_file(file_path, root, 0);
+}
+
+int run_script_last(char *file_path, Variable **root){
+    return run_file(file_path, root, 1);
+}
+
+int run_string(const char *source, Variable **root){
+    FILE *file = fmemopen((void *) source, strlen(source), "r");
+    if (file == NULL) {
+        perror("run_string");
+        return -1;
+    }
+
+    char **lines;
+    size_t num_lines;
+    int failed = read_lines(file, &lines, &num_lines);
+    fclose(file);
+    if (failed) return -1;
+
+    return run_lines("-c", lines, num_lines, root, 1);
+}
+
 void free_command(Command *command){
     
     if (command == NULL) {
@@ -227,19 +1461,35 @@ void free_command(Command *command){
 
     free(command->exec_path);
 
-    // Free each argument in the args array
-    if (command->args != NULL) {
-        char **arg = command->args;
-        while (*arg) {
-            free(*arg); // Free each argument string
-            arg++; // Move to the next argument
-        }
-        free(command->args); // Free the array of pointers itself
-    }
+    // the arguments are slices of arg_buf, only the array is ours
+    free(command->args);
+    free(command->arg_buf);
 
     free(command->redir_in_path);
 
     free(command->redir_out_path);
 
+    clear_heredoc(command);
+
+    free_limits(command->limits);
+    free_memo(command->memo);
+    script_free(command->group);
+    free(command->chunk);
+
+    while (command->substs != NULL) {
+        ProcSubst *next = command->substs->next;
+        free_command_list(command->substs->commands);
+        free(command->substs);
+        command->substs = next;
+    }
+
     free(command);
 }
+
+void free_command_list(Command *head){
+    while (head != NULL) {
+        Command *next = head->next;
+        free_command(head);
+        head = next;
+    }
+}
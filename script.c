@@ -0,0 +1,1226 @@
+#include "shell.h"
+
+#include <ctype.h>
+
+/*
+** Control flow for scripts: if/elif/else/fi, while/until/do/done,
+** for NAME in WORDS, functions, break/continue/return/exit, and
+** (( expr )) arithmetic tests, which never fork.
+**
+** A script is compiled once into a flat array of instructions and run
+** by a small dispatch loop. Plain statements become OP_EXEC, which
+** goes through parse_line/execute_line. Their parsed commands are
+** cached per instruction when nothing in them depends on variables, so
+** a loop body is not re-tokenized on every iteration.
+**
+** Functions belong to the shell session, not to the script that
+** defines them: running a definition enters it in a table that later
+** scripts (the next interactive line, the script after the init file)
+** consult at run time. A table entry keeps its script alive.
+*/
+
+typedef enum Opcode {
+    OP_EXEC,        // a: statement text, b: here-doc bodies or -1
+    OP_CALL,        // a: function, b: statement text, the arguments after the name
+    OP_DEFINE,      // a: function, entered in the session table
+    OP_STATUS,      // a: exit status to set, b: statement text (true, false, :) or -1
+    OP_ARITH,       // a: expression text of (( expr )), b: statement text
+    OP_EXPAND,      // a: argument text of `: args`, expanded for effect, b: as OP_ARITH
+    OP_NOT,         // inverts the status
+    OP_JMP,         // a: target
+    OP_JMP_FAIL,    // a: target, taken when status != 0
+    OP_JMP_OK,      // a: target, taken when status == 0
+    OP_FOR_INIT,    // a: word list text, b: variable name
+    OP_FOR_NEXT,    // a: target once the words run out
+    OP_FOR_POP,
+    OP_INPUT,       // a: file of `done < file` or -1, b: its OP_INPUT_POP
+    OP_INPUT_POP,
+    OP_RETURN,      // a: status text or -1 to keep the status
+    OP_EXIT,        // a: status text or -1 to keep the status
+} Opcode;
+
+typedef struct Instr {
+    uint8_t op;
+    int32_t a;
+    int32_t b;
+    int32_t line_no;
+} Instr;
+
+typedef struct Function {
+    char *name;
+    int32_t entry;
+} Function;
+
+struct Script {
+    Instr *code;
+    Command **cache;        // parsed commands kept by OP_EXEC, per instruction
+    size_t len, cap;
+    char **strs;
+    size_t num_strs, strs_cap;
+    Function *funcs;
+    size_t num_funcs;
+    char *cache_path;       // PATH the cached commands were resolved with
+    uint8_t tail_exec;      // the last command may exec in place of the shell
+    uint8_t profiled;       // statements are charged to profile.c
+    unsigned refs;          // the owner, plus one per session function
+};
+
+// a function of the session; script holds its code
+typedef struct Defined {
+    Script *script;
+    int32_t func;
+} Defined;
+
+static Defined *defined = NULL;
+static size_t num_defined = 0;
+static int call_depth = 0;     // calls into other scripts, nested
+
+enum BlockKind { BLK_IF, BLK_WHILE, BLK_UNTIL, BLK_FOR, BLK_FUNC };
+
+typedef struct Block {
+    int kind;
+    int line_no;
+    int32_t head;           // `continue` target
+    int32_t cond_jump;      // forward jump patched at the next branch/end
+    int32_t input;          // a loop's OP_INPUT, filled in by `done < file`
+    int32_t *exits;         // forward jumps patched to the end of the block
+    size_t num_exits;
+    uint8_t seen_body;      // `then` / `do` / `{` seen
+} Block;
+
+typedef struct Compiler {
+    Script *script;
+    Block *blocks;
+    size_t depth, blocks_cap;
+    char **lines;
+    size_t num_lines;
+    size_t next_line;       // first source line not consumed yet
+    int line_no;
+    uint8_t incomplete;     // ran out of input inside a block or here-doc
+} Compiler;
+
+// runtime state of one `for` loop
+typedef struct ForIter {
+    char *buf;              // the expanded words, split_words' arg_buf
+    char **words;
+    size_t next;
+    int32_t var;
+} ForIter;
+
+// a function call; the positional parameters it replaced
+typedef struct Frame {
+    size_t ret;
+    size_t for_depth;
+    size_t input_depth;
+    char *saved[MAX_POSITIONAL];
+} Frame;
+
+
+static int32_t emit(Compiler *c, int op, int32_t a, int32_t b){
+    Script *s = c->script;
+    if (s->len == s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 64;
+        Instr *code = realloc(s->code, cap * sizeof(Instr));
+        if (code == NULL) {
+            perror("script_compile");
+            return -1;
+        }
+        s->code = code;
+        s->cap = cap;
+    }
+    Instr *in = &s->code[s->len];
+    in->op = op;
+    in->a = a;
+    in->b = b;
+    in->line_no = c->line_no;
+    return s->len++;
+}
+
+static int32_t add_str(Compiler *c, const char *text, size_t len){
+    Script *s = c->script;
+    if (s->num_strs == s->strs_cap) {
+        size_t cap = s->strs_cap ? s->strs_cap * 2 : 64;
+        char **strs = realloc(s->strs, cap * sizeof(char *));
+        if (strs == NULL) {
+            perror("script_compile");
+            return -1;
+        }
+        s->strs = strs;
+        s->strs_cap = cap;
+    }
+    char *copy = strndup(text, len);
+    if (copy == NULL) {
+        perror("script_compile");
+        return -1;
+    }
+    s->strs[s->num_strs] = copy;
+    return s->num_strs++;
+}
+
+static void patch(Compiler *c, int32_t at, int32_t target){
+    if (at >= 0) c->script->code[at].a = target;
+}
+
+static Block *push_block(Compiler *c, int kind){
+    if (c->depth == c->blocks_cap) {
+        size_t cap = c->blocks_cap ? c->blocks_cap * 2 : 8;
+        Block *blocks = realloc(c->blocks, cap * sizeof(Block));
+        if (blocks == NULL) {
+            perror("script_compile");
+            return NULL;
+        }
+        c->blocks = blocks;
+        c->blocks_cap = cap;
+    }
+    Block *b = &c->blocks[c->depth++];
+    memset(b, 0, sizeof(Block));
+    b->kind = kind;
+    b->line_no = c->line_no;
+    b->head = -1;
+    b->cond_jump = -1;
+    b->input = -1;
+    return b;
+}
+
+static int add_exit(Block *b, int32_t at){
+    int32_t *exits = realloc(b->exits, (b->num_exits + 1) * sizeof(int32_t));
+    if (exits == NULL) {
+        perror("script_compile");
+        return -1;
+    }
+    b->exits = exits;
+    b->exits[b->num_exits++] = at;
+    return 0;
+}
+
+static void pop_block(Compiler *c, int32_t end){
+    Block *b = &c->blocks[--c->depth];
+    for (size_t i = 0; i < b->num_exits; i++) {
+        patch(c, b->exits[i], end);
+    }
+    free(b->exits);
+}
+
+static Block *top_block(Compiler *c){
+    return c->depth ? &c->blocks[c->depth - 1] : NULL;
+}
+
+static Block *innermost_loop(Compiler *c){
+    for (size_t i = c->depth; i > 0; i--) {
+        int kind = c->blocks[i - 1].kind;
+        if (kind == BLK_FUNC) return NULL;
+        if (kind != BLK_IF) return &c->blocks[i - 1];
+    }
+    return NULL;
+}
+
+static int in_function(Compiler *c){
+    for (size_t i = 0; i < c->depth; i++) {
+        if (c->blocks[i].kind == BLK_FUNC) return 1;
+    }
+    return 0;
+}
+
+static int syntax_error(Compiler *c, const char *what){
+    ERR_PRINT(ERR_SCRIPT_SYNTAX, c->line_no, what);
+    return -1;
+}
+
+
+// if text starts with keyword kw, returns what follows it, else NULL
+static char *after_keyword(char *text, const char *kw){
+    size_t len = strlen(kw);
+    if (strncmp(text, kw, len) != 0) return NULL;
+    if (text[len] != '\0' && !isspace((unsigned char)text[len])) return NULL;
+    text += len;
+    while (isspace((unsigned char)*text)) text++;
+    return text;
+}
+
+static char *trim(char *text){
+    while (isspace((unsigned char)*text)) text++;
+    size_t len = strlen(text);
+    while (len > 0 && isspace((unsigned char)text[len - 1])) text[--len] = '\0';
+    return text;
+}
+
+// length of the function name at the start of text (letters, '_', digits)
+static size_t name_length(const char *text){
+    size_t len = 0;
+    if (!isValidVarChar(text[0])) return 0;
+    while (isValidVarChar(text[len]) || isdigit((unsigned char)text[len])) len++;
+    return len;
+}
+
+// index of the function called `name`, or -1
+static int32_t find_function(Script *s, const char *name, size_t len){
+    for (size_t i = 0; i < s->num_funcs; i++) {
+        if (strlen(s->funcs[i].name) == len &&
+            strncmp(s->funcs[i].name, name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// finds the next "<<" outside any $(( )), where it is a shift
+static const char *find_heredoc_op(const char *p){
+    for (; *p; p++) {
+        if (strncmp(p, "$((", 3) == 0) {
+            int depth = 0;
+            for (p += 3; *p && !(depth == 0 && p[0] == ')' && p[1] == ')'); p++) {
+                if (*p == '(') depth++;
+                if (*p == ')') depth--;
+            }
+            if (*p == '\0') return NULL;
+            p++;
+        } else if (p[0] == '<' && p[1] == '<') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+** Collects the bodies of the statement's <<DELIM here-docs from the
+** source lines after the current one, in order, as a single string
+** that read_heredocs can consume.
+**
+** Returns the string's index, -1 if the statement has none, -2 on error.
+*/
+static int32_t collect_heredocs(Compiler *c, const char *stmt){
+    size_t cap = 0, len = 0;
+    char *bodies = NULL;
+    const char *p = stmt;
+
+    while ((p = find_heredoc_op(p)) != NULL) {
+        if (p[2] == '<') {
+            p += 3;         // here-string, nothing to collect
+            continue;
+        }
+        p += 2;
+        while (isspace((unsigned char)*p)) p++;
+        const char *start = p;
+        while (*p && !isspace((unsigned char)*p) && *p != '<' &&
+               *p != '>' && *p != '|' && *p != ';') {
+            p++;
+        }
+        size_t delim_len = p - start;
+        if (delim_len >= 2 && (*start == '\'' || *start == '"') &&
+            start[delim_len - 1] == *start) {
+            start++;
+            delim_len -= 2;
+        }
+
+        int found = 0;
+        while (c->next_line < c->num_lines) {
+            const char *line = c->lines[c->next_line++];
+            size_t line_len = strlen(line);
+            if (len + line_len + 2 > cap) {
+                cap = (len + line_len + 2) * 2;
+                char *grown = realloc(bodies, cap);
+                if (grown == NULL) {
+                    perror("script_compile");
+                    free(bodies);
+                    return -2;
+                }
+                bodies = grown;
+            }
+            memcpy(bodies + len, line, line_len);
+            len += line_len;
+            bodies[len++] = '\n';
+            if (line_len == delim_len && strncmp(line, start, delim_len) == 0) {
+                found = 1;
+                break;
+            }
+        }
+        if (!found) {
+            c->incomplete = 1;
+            free(bodies);
+            return -2;
+        }
+    }
+
+    if (bodies == NULL) return -1;
+    int32_t idx = add_str(c, bodies, len);
+    free(bodies);
+    return idx < 0 ? -2 : idx;
+}
+
+
+static int compile_statement(Compiler *c, char *stmt);
+
+// compiles the text following a keyword, if there is any
+static int compile_rest(Compiler *c, char *rest){
+    rest = trim(rest);
+    return *rest ? compile_statement(c, rest) : 0;
+}
+
+static int compile_function(Compiler *c, const char *name, size_t len,
+                            char *rest){
+    Script *s = c->script;
+    Function *funcs = realloc(s->funcs, (s->num_funcs + 1) * sizeof(Function));
+    if (funcs == NULL) {
+        perror("script_compile");
+        return -1;
+    }
+    s->funcs = funcs;
+
+    // jump over the body when the definition itself is executed
+    int32_t define = emit(c, OP_DEFINE, s->num_funcs, 0);
+    int32_t skip = emit(c, OP_JMP, -1, 0);
+    Block *b = push_block(c, BLK_FUNC);
+    if (define < 0 || skip < 0 || b == NULL) return -1;
+    b->cond_jump = skip;
+
+    funcs[s->num_funcs].name = strndup(name, len);
+    funcs[s->num_funcs].entry = s->len;
+    if (funcs[s->num_funcs].name == NULL) {
+        perror("script_compile");
+        return -1;
+    }
+    s->num_funcs++;
+
+    rest = trim(rest);
+    if (*rest == '{') {
+        b->seen_body = 1;
+        return compile_rest(c, rest + 1);
+    }
+    return *rest ? syntax_error(c, "expected '{'") : 0;
+}
+
+static int compile_statement(Compiler *c, char *stmt){
+    Block *b = top_block(c);
+    char *rest;
+
+    if (b && b->kind == BLK_FUNC && !b->seen_body) {
+        if (*stmt != '{') return syntax_error(c, "expected '{'");
+        b->seen_body = 1;
+        return compile_rest(c, stmt + 1);
+    }
+
+    if ((rest = after_keyword(stmt, "if"))) {
+        if (push_block(c, BLK_IF) == NULL) return -1;
+        return compile_rest(c, rest);
+    }
+    if ((rest = after_keyword(stmt, "then"))) {
+        if (!b || b->kind != BLK_IF || b->seen_body) {
+            return syntax_error(c, "unexpected 'then'");
+        }
+        b->cond_jump = emit(c, OP_JMP_FAIL, -1, 0);
+        b->seen_body = 1;
+        return compile_rest(c, rest);
+    }
+    if ((rest = after_keyword(stmt, "elif"))) {
+        if (!b || b->kind != BLK_IF || !b->seen_body || b->cond_jump < 0) {
+            return syntax_error(c, "unexpected 'elif'");
+        }
+        if (add_exit(b, emit(c, OP_JMP, -1, 0)) < 0) return -1;
+        patch(c, b->cond_jump, c->script->len);
+        b->cond_jump = -1;
+        b->seen_body = 0;
+        return compile_rest(c, rest);
+    }
+    if ((rest = after_keyword(stmt, "else"))) {
+        if (!b || b->kind != BLK_IF || !b->seen_body || b->cond_jump < 0) {
+            return syntax_error(c, "unexpected 'else'");
+        }
+        if (add_exit(b, emit(c, OP_JMP, -1, 0)) < 0) return -1;
+        patch(c, b->cond_jump, c->script->len);
+        b->cond_jump = -1;
+        return compile_rest(c, rest);
+    }
+    if ((rest = after_keyword(stmt, "fi"))) {
+        if (!b || b->kind != BLK_IF || !b->seen_body || *rest) {
+            return syntax_error(c, "unexpected 'fi'");
+        }
+        // no branch ran: the failed condition is not the status of the if
+        if (b->cond_jump >= 0) {
+            if (add_exit(b, emit(c, OP_JMP, -1, 0)) < 0) return -1;
+            patch(c, b->cond_jump, c->script->len);
+            if (emit(c, OP_STATUS, 0, -1) < 0) return -1;
+        }
+        pop_block(c, c->script->len);
+        return 0;
+    }
+
+    int until = 0;
+    if ((rest = after_keyword(stmt, "while")) ||
+        (until = 1, rest = after_keyword(stmt, "until"))) {
+        int32_t input = emit(c, OP_INPUT, -1, 0);
+        Block *loop = push_block(c, until ? BLK_UNTIL : BLK_WHILE);
+        if (input < 0 || loop == NULL) return -1;
+        loop->input = input;
+        loop->head = c->script->len;
+        return compile_rest(c, rest);
+    }
+    if ((rest = after_keyword(stmt, "for"))) {
+        // for NAME in WORDS...
+        char *name = rest;
+        size_t name_len = 0;
+        while (isValidVarChar(name[name_len])) name_len++;
+        char *words = after_keyword(trim(name + name_len), "in");
+        if (name_len == 0 || words == NULL) {
+            return syntax_error(c, "expected 'for NAME in WORDS'");
+        }
+        int32_t var = add_str(c, name, name_len);
+        int32_t list = add_str(c, words, strlen(words));
+        int32_t input = emit(c, OP_INPUT, -1, 0);
+        if (var < 0 || list < 0 || input < 0 ||
+            emit(c, OP_FOR_INIT, list, var) < 0) {
+            return -1;
+        }
+        Block *loop = push_block(c, BLK_FOR);
+        if (loop == NULL) return -1;
+        loop->input = input;
+        loop->head = loop->cond_jump = emit(c, OP_FOR_NEXT, -1, 0);
+        return 0;
+    }
+    if ((rest = after_keyword(stmt, "do"))) {
+        if (!b || (b->kind != BLK_WHILE && b->kind != BLK_UNTIL &&
+                   b->kind != BLK_FOR) || b->seen_body) {
+            return syntax_error(c, "unexpected 'do'");
+        }
+        if (b->kind != BLK_FOR) {
+            b->cond_jump = emit(c, b->kind == BLK_WHILE ? OP_JMP_FAIL : OP_JMP_OK,
+                                -1, 0);
+        }
+        b->seen_body = 1;
+        return compile_rest(c, rest);
+    }
+    if ((rest = after_keyword(stmt, "done")) ||
+        (strncmp(stmt, "done<", 5) == 0 && (rest = stmt + 4))) {
+        if (!b || b->kind == BLK_IF || b->kind == BLK_FUNC ||
+            !b->seen_body || (*rest && *rest != '<')) {
+            return syntax_error(c, "unexpected 'done'");
+        }
+        // done < file: the whole loop reads from file
+        int32_t file = -1;
+        if (*rest == '<') {
+            char *path = trim(rest + 1);
+            if (*path == '\0' || path[strcspn(path, " \t<>|")] != '\0') {
+                return syntax_error(c, "expected 'done < FILE'");
+            }
+            file = add_str(c, path, strlen(path));
+            if (file < 0) return -1;
+        }
+        emit(c, OP_JMP, b->head, 0);
+        // a loop that ends normally or by `break` succeeds; a for loop
+        // keeps the status of its body's last command
+        int32_t end = emit(c, b->kind == BLK_FOR ? OP_FOR_POP : OP_STATUS, 0, -1);
+        if (end < 0) return -1;
+        if (file >= 0) {
+            int32_t pop = emit(c, OP_INPUT_POP, 0, 0);
+            c->script->code[b->input].a = file;
+            c->script->code[b->input].b = pop;
+        }
+        patch(c, b->cond_jump, end);
+        pop_block(c, end);
+        return 0;
+    }
+    if ((rest = after_keyword(stmt, "break")) ||
+        (rest = after_keyword(stmt, "continue"))) {
+        Block *loop = innermost_loop(c);
+        if (loop == NULL) return syntax_error(c, "'break' or 'continue' outside a loop");
+        if (emit(c, OP_STATUS, 0, -1) < 0) return -1;
+        if (*stmt == 'c') {
+            return emit(c, OP_JMP, loop->head, 0) < 0 ? -1 : 0;
+        }
+        // leaving a for loop still has to pop its iterator
+        return add_exit(loop, emit(c, OP_JMP, -1, 0));
+    }
+    if ((rest = after_keyword(stmt, "return")) ||
+        (rest = after_keyword(stmt, "exit"))) {
+        int is_return = (*stmt == 'r');
+        if (is_return && !in_function(c)) {
+            return syntax_error(c, "'return' outside a function");
+        }
+        int32_t code = *rest ? add_str(c, rest, strlen(rest)) : -1;
+        return emit(c, is_return ? OP_RETURN : OP_EXIT, code, 0) < 0 ? -1 : 0;
+    }
+    if (strcmp(stmt, "}") == 0) {
+        if (!b || b->kind != BLK_FUNC) return syntax_error(c, "unexpected '}'");
+        emit(c, OP_RETURN, -1, 0);
+        patch(c, b->cond_jump, c->script->len);
+        pop_block(c, c->script->len);
+        return 0;
+    }
+    if ((rest = after_keyword(stmt, "function"))) {
+        size_t len = name_length(rest);
+        if (len == 0) return syntax_error(c, "expected a function name");
+        char *after = rest + len;
+        if (strncmp(after, "()", 2) == 0) after += 2;
+        return compile_function(c, rest, len, after);
+    }
+    if ((rest = after_keyword(stmt, "!"))) {
+        if (compile_rest(c, rest) < 0) return -1;
+        return emit(c, OP_NOT, 0, 0) < 0 ? -1 : 0;
+    }
+    // statements that run in the shell keep their text for events_line
+    size_t stmt_len = strlen(stmt);
+    if (strncmp(stmt, "((", 2) == 0) {
+        if (stmt_len < 4 || strcmp(stmt + stmt_len - 2, "))") != 0) {
+            return syntax_error(c, "expected '))'");
+        }
+        int32_t expr = add_str(c, stmt + 2, stmt_len - 4);
+        int32_t text = add_str(c, stmt, stmt_len);
+        return expr < 0 || text < 0 || emit(c, OP_ARITH, expr, text) < 0 ? -1 : 0;
+    }
+    if ((rest = after_keyword(stmt, ":")) && *rest) {
+        int32_t args = add_str(c, rest, strlen(rest));
+        int32_t text = add_str(c, stmt, stmt_len);
+        return args < 0 || text < 0 || emit(c, OP_EXPAND, args, text) < 0 ? -1 : 0;
+    }
+    if (strcmp(stmt, "true") == 0 || strcmp(stmt, "false") == 0 || rest) {
+        int32_t text = add_str(c, stmt, stmt_len);
+        return text < 0 || emit(c, OP_STATUS, *stmt == 'f', text) < 0 ? -1 : 0;
+    }
+
+    // NAME() { ... or NAME () {
+    size_t len = name_length(stmt);
+    char *after = stmt + len;
+    while (*after == ' ' || *after == '\t') after++;
+    if (len > 0 && strncmp(after, "()", 2) == 0) {
+        return compile_function(c, stmt, len, after + 2);
+    }
+
+    // a call to a function defined earlier in the script
+    size_t word_len = strcspn(stmt, " \t");
+    int32_t func = find_function(c->script, stmt, word_len);
+    if (func >= 0) {
+        int32_t text = add_str(c, stmt, stmt_len);
+        return text < 0 || emit(c, OP_CALL, func, text) < 0 ? -1 : 0;
+    }
+
+    int32_t text = add_str(c, stmt, strlen(stmt));
+    int32_t bodies = collect_heredocs(c, stmt);
+    if (text < 0 || bodies == -2) return -1;
+    return emit(c, OP_EXEC, text, bodies) < 0 ? -1 : 0;
+}
+
+/*
+** Splits one source line at top-level ';' (outside quotes and outside
+** ( list ) and { list; } groups), drops a trailing comment and compiles
+** each statement.
+*/
+static int compile_line(Compiler *c, char *line){
+    char *start = line;
+    char quote = 0;
+    int parens = 0, braces = 0;
+    int stage_start = 1;        // a '{' here opens a group
+
+    for (char *p = line; ; p++) {
+        int at_stage_start = stage_start;
+        if (!isspace((unsigned char)*p)) stage_start = 0;
+
+        if (quote) {
+            if (*p == '\0') return syntax_error(c, "unterminated quote");
+            if (*p == quote) quote = 0;
+            continue;
+        }
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+            continue;
+        }
+        if (*p == '\'' || *p == '"') {
+            quote = *p;
+            continue;
+        }
+        if (*p == '(') {
+            parens++;
+            stage_start = 1;
+        } else if (*p == ')' && parens > 0) {
+            parens--;
+        } else if (*p == '|') {
+            stage_start = 1;
+        } else if (*p == '{' && at_stage_start && isspace((unsigned char)p[1])) {
+            // but not the '{' opening a body after a `f()` line
+            Block *b = top_block(c);
+            if (braces > 0 || parens > 0 || !b || b->kind != BLK_FUNC || b->seen_body) {
+                braces++;
+            }
+        } else if (*p == '}' && braces > 0 &&
+                   (isspace((unsigned char)p[-1]) || p[-1] == ';') &&
+                   (p[1] == '\0' || strchr(" \t;|<>)", p[1]))) {
+            braces--;
+        }
+        int is_comment = (*p == '#' && (p == line || isspace((unsigned char)p[-1])));
+        if (*p == ';' && (parens > 0 || braces > 0)) {
+            stage_start = 1;
+        } else if (*p == ';' || *p == '\0' || is_comment) {
+            char end = *p;
+            *p = '\0';
+            char *stmt = trim(start);
+            if (*stmt && compile_statement(c, stmt) < 0) return -1;
+            if (end == '\0' || is_comment) return 0;
+            start = p + 1;
+            stage_start = 1;
+        }
+    }
+}
+
+
+void script_free(Script *script){
+    if (script == NULL || --script->refs > 0) return;
+    for (size_t i = 0; script->cache && i < script->len; i++) {
+        free_command_list(script->cache[i]);
+    }
+    for (size_t i = 0; i < script->num_strs; i++) {
+        free(script->strs[i]);
+    }
+    for (size_t i = 0; i < script->num_funcs; i++) {
+        free(script->funcs[i].name);
+    }
+    free(script->cache);
+    free(script->code);
+    free(script->strs);
+    free(script->funcs);
+    free(script->cache_path);
+    free(script);
+}
+
+Script *script_compile(char **lines, size_t num_lines, int *incomplete){
+    Compiler c;
+    memset(&c, 0, sizeof(c));
+    c.lines = lines;
+    c.num_lines = num_lines;
+    *incomplete = 0;
+
+    c.script = calloc(1, sizeof(Script));
+    if (c.script == NULL) {
+        perror("script_compile");
+        return NULL;
+    }
+    c.script->refs = 1;
+
+    int failed = 0;
+    while (!failed && c.next_line < num_lines) {
+        c.line_no = c.next_line + 1;
+        char *line = strdup(lines[c.next_line++]);
+        if (line == NULL) {
+            perror("script_compile");
+            failed = 1;
+            break;
+        }
+        failed = compile_line(&c, line) < 0;
+        free(line);
+    }
+
+    if (!failed && c.depth > 0) {
+        c.incomplete = 1;
+        failed = 1;
+    }
+    if (c.incomplete) {
+        *incomplete = 1;
+    }
+
+    while (c.depth > 0) {
+        pop_block(&c, 0);
+    }
+    free(c.blocks);
+
+    if (!failed) {
+        c.script->cache = calloc(c.script->len ? c.script->len : 1,
+                                 sizeof(Command *));
+        if (c.script->cache == NULL) {
+            perror("script_compile");
+            failed = 1;
+        }
+    }
+    if (failed) {
+        script_free(c.script);
+        return NULL;
+    }
+    return c.script;
+}
+
+
+// drops every cached command when PATH has changed since they were parsed
+static void check_cache_path(Script *s, Variable *path){
+    const char *value = path ? path->value : "";
+    if (s->cache_path != NULL && strcmp(s->cache_path, value) == 0) return;
+    for (size_t i = 0; i < s->len; i++) {
+        free_command_list(s->cache[i]);
+        s->cache[i] = NULL;
+    }
+    free(s->cache_path);
+    s->cache_path = strdup(value);
+}
+
+void script_allow_tail_exec(Script *script){
+    script->tail_exec = 1;
+}
+
+void script_enable_profile(Script *script){
+    script->profiled = 1;
+}
+
+// true when nothing but forward jumps follows instruction ip
+static int is_tail(Script *s, size_t ip){
+    size_t next = ip + 1;
+    while (next < s->len && s->code[next].op == OP_JMP &&
+           (size_t) s->code[next].a > next) {
+        next = s->code[next].a;
+    }
+    return next >= s->len;
+}
+
+// enters function func of s in the session table, replacing any namesake
+static int define_function(Script *s, int32_t func){
+    const char *name = s->funcs[func].name;
+    Defined *d = NULL;
+    for (size_t i = 0; i < num_defined; i++) {
+        if (strcmp(defined[i].script->funcs[defined[i].func].name, name) == 0) {
+            d = &defined[i];
+            break;
+        }
+    }
+    if (d == NULL) {
+        Defined *grown = realloc(defined, (num_defined + 1) * sizeof(Defined));
+        if (grown == NULL) {
+            perror("script_run");
+            return -1;
+        }
+        defined = grown;
+        d = &defined[num_defined++];
+    } else if (d->script == s && d->func == func) {
+        return 0;
+    } else {
+        script_free(d->script);
+    }
+    s->refs++;
+    d->script = s;
+    d->func = func;
+    return 0;
+}
+
+// the session function named by the first word of text, or NULL
+static Defined *find_defined(const char *text){
+    size_t len = strcspn(text, " \t");
+    for (size_t i = 0; i < num_defined; i++) {
+        const char *name = defined[i].script->funcs[defined[i].func].name;
+        if (strncmp(name, text, len) == 0 && name[len] == '\0') return &defined[i];
+    }
+    return NULL;
+}
+
+static int run_code(Script *script, size_t ip, Variable **root, int *status);
+static int push_positional(Frame *frame, const char *args, Variable **root);
+static void pop_positional(Frame *frame, Variable **root);
+
+/*
+** Calls a session function from a statement of another script.
+**
+** Returns the function's exit status, or -1 on error.
+*/
+static int call_defined(Script *s, Defined *d, const char *args, int line_no,
+                        Variable **root, int *exiting){
+    const char *name = d->script->funcs[d->func].name;
+    if (call_depth == MAX_CALL_DEPTH) {
+        ERR_PRINT(ERR_CALL_DEPTH, name);
+        return -1;
+    }
+    Frame frame;
+    if (push_positional(&frame, args, root) < 0) return -1;
+    if (s->profiled) profile_call(name, line_no);
+
+    // the table entry may be replaced while the body runs
+    Script *callee = d->script;
+    callee->refs++;
+    call_depth++;
+    int status = 0;
+    int ret = run_code(callee, callee->funcs[d->func].entry, root, &status);
+    call_depth--;
+    script_free(callee);
+
+    if (s->profiled) profile_return();
+    pop_positional(&frame, root);
+    if (ret == SCRIPT_EXIT) *exiting = 1;
+    return ret == SCRIPT_ERROR ? -1 : status;
+}
+
+/*
+** Runs one OP_EXEC statement through parse_line and execute_line.
+**
+** Returns the exit status, or -1 if the line could not be parsed
+** or executed.
+*/
+// a lone { list; } with nothing to redirect needs no process at all
+static int runs_inline(Command *commands){
+    return commands->group != NULL && commands->group_is_brace &&
+        commands->next == NULL && commands->redir_in_path == NULL &&
+        commands->redir_out_path == NULL && commands->heredoc_delim == NULL &&
+        commands->heredoc_body == NULL;
+}
+
+static int run_statement(Script *s, size_t ip, Variable **root,
+                         char **scratch, size_t *scratch_cap, int *exiting){
+    Instr *in = &s->code[ip];
+    const char *text = s->strs[in->a];
+    const char *bodies = in->b >= 0 ? s->strs[in->b] : NULL;
+    Command *commands = s->cache[ip];
+
+    if (num_defined > 0) {
+        Defined *d = find_defined(text);
+        if (d != NULL) {
+            events_line(in->line_no, text);
+            return call_defined(s, d, text + strcspn(text, " \t"), in->line_no, root,
+                                exiting);
+        }
+    }
+
+    if (commands != NULL) {
+        shell_metrics.cache_hits++;
+    } else {
+        shell_metrics.cache_misses++;
+        // parse_line writes into the line, so give it a copy
+        size_t len = strlen(text) + 1;
+        if (len > *scratch_cap) {
+            char *grown = realloc(*scratch, len);
+            if (grown == NULL) {
+                perror("exec_statement");
+                return -1;
+            }
+            *scratch = grown;
+            *scratch_cap = len;
+        }
+        memcpy(*scratch, text, len);
+
+        long long start = profile_clock();
+        commands = parse_line(*scratch, root);
+        profile_add(PROFILE_PARSE, start);
+        if (commands == (Command *) -1) {
+            ERR_PRINT(ERR_PARSING_LINE);
+            return -1;
+        }
+        if (commands == NULL) {
+            return 0;   // assignment, export, comment...
+        }
+
+        if (bodies != NULL) {
+            FILE *src = fmemopen((void *) bodies, strlen(bodies), "r");
+            if (src == NULL || read_heredocs(commands, src, root) < 0) {
+                if (src) fclose(src);
+                free_command_list(commands);
+                return -1;
+            }
+            fclose(src);
+        }
+    }
+
+    int *result = NULL;
+    int inline_status = 0;
+    if (runs_inline(commands)) {
+        int ret = script_run(commands->group, root, &inline_status);
+        if (ret == SCRIPT_EXIT) *exiting = 1;
+        if (ret != SCRIPT_ERROR) result = &inline_status;
+    } else {
+        if (s->tail_exec && is_tail(s, ip)) {
+            exec_tail(commands);
+        }
+        events_line(in->line_no, text);
+        result = execute_line(commands);
+    }
+
+    // keep the parsed line if nothing in it can change between runs
+    if (s->cache[ip] == NULL && !strchr(text, VARIABLE_PARSE_MARKER) &&
+        !(bodies && strchr(bodies, VARIABLE_PARSE_MARKER))) {
+        s->cache[ip] = commands;
+    } else if (s->cache[ip] != commands) {
+        free_command_list(commands);
+    }
+
+    if (result == (int *) -1 || result == NULL) {
+        ERR_PRINT(ERR_EXECUTE_LINE);
+        return -1;
+    }
+    int status = *result;
+    if (result != &inline_status) free(result);
+    return status;
+}
+
+static int exec_statement(Script *s, size_t ip, Variable **root,
+                          char **scratch, size_t *scratch_cap, int *exiting){
+    if (!s->profiled) {
+        return run_statement(s, ip, root, scratch, scratch_cap, exiting);
+    }
+    ProfileMark mark;
+    profile_enter(&mark, s->code[ip].line_no);
+    int code = run_statement(s, ip, root, scratch, scratch_cap, exiting);
+    profile_leave(&mark);
+    return code;
+}
+
+// expands a status operand of return/exit, -1 keeps the current status
+static int eval_status(Script *s, int32_t a, Variable **root, int status){
+    if (a < 0) return status;
+    char *text = replace_variables_mk_line(s->strs[a], root);
+    if (text == NULL || text == (char *) -1) return status;
+    int value = atoi(text);
+    free(text);
+    return value;
+}
+
+// sets $1..$N for a call, saving the caller's values in the frame
+static int push_positional(Frame *frame, const char *args, Variable **root){
+    char *buf = NULL;
+    size_t num = 0;
+    char **words = split_words(args, root, &buf, &num);
+    if (words == NULL) return -1;
+
+    for (size_t i = 0; i < MAX_POSITIONAL; i++) {
+        char name[4];
+        snprintf(name, sizeof(name), "%zu", i + 1);
+        Variable *var = *root;
+        while (var && strcmp(var->name, name) != 0) var = var->next;
+        frame->saved[i] = var ? strdup(var->value) : NULL;
+        addOrUpdateVariable(root, name, i < num ? words[i] : "");
+    }
+    free(words);
+    free(buf);
+    return 0;
+}
+
+static void pop_positional(Frame *frame, Variable **root){
+    for (int i = 0; i < MAX_POSITIONAL; i++) {
+        char name[4];
+        snprintf(name, sizeof(name), "%d", i + 1);
+        if (frame->saved[i] != NULL) {
+            addOrUpdateVariable(root, name, frame->saved[i]);
+            free(frame->saved[i]);
+        } else {
+            unset_variable(root, name);
+        }
+    }
+}
+
+static void free_iter(ForIter *it){
+    free(it->words);
+    free(it->buf);
+}
+
+// runs the script from instruction ip; a function's body ends at its OP_RETURN
+static int run_code(Script *script, size_t ip, Variable **root, int *status){
+    int ret = SCRIPT_OK;
+    char *scratch = NULL;
+    size_t scratch_cap = 0;
+
+    ForIter *iters = NULL;
+    size_t num_iters = 0, iters_cap = 0;
+    Frame *frames = NULL;
+    size_t num_frames = 0, frames_cap = 0;
+    size_t num_inputs = 0;
+
+    *status = 0;
+
+    while (ip < script->len) {
+        Instr *in = &script->code[ip++];
+
+        switch (in->op) {
+        case OP_EXEC: {
+            check_cache_path(script, *root);
+            int exiting = 0;
+            int code = exec_statement(script, ip - 1, root, &scratch, &scratch_cap,
+                                      &exiting);
+            if (code < 0) {
+                ret = SCRIPT_ERROR;
+                goto done;
+            }
+            *status = code;
+            if (exiting) {
+                ret = SCRIPT_EXIT;
+                goto done;
+            }
+            break;
+        }
+        case OP_CALL: {
+            if (num_frames == MAX_CALL_DEPTH) {
+                ERR_PRINT(ERR_CALL_DEPTH, script->funcs[in->a].name);
+                ret = SCRIPT_ERROR;
+                goto done;
+            }
+            if (num_frames == frames_cap) {
+                frames_cap = frames_cap ? frames_cap * 2 : 8;
+                Frame *grown = realloc(frames, frames_cap * sizeof(Frame));
+                if (grown == NULL) {
+                    perror("script_run");
+                    ret = SCRIPT_ERROR;
+                    goto done;
+                }
+                frames = grown;
+            }
+            Frame *frame = &frames[num_frames];
+            const char *text = script->strs[in->b];
+            events_line(in->line_no, text);
+            if (push_positional(frame, text + strlen(script->funcs[in->a].name), root) < 0) {
+                ret = SCRIPT_ERROR;
+                goto done;
+            }
+            frame->ret = ip;
+            frame->for_depth = num_iters;
+            frame->input_depth = num_inputs;
+            num_frames++;
+            if (script->profiled) profile_call(script->funcs[in->a].name, in->line_no);
+            ip = script->funcs[in->a].entry;
+            break;
+        }
+        case OP_RETURN: {
+            *status = eval_status(script, in->a, root, *status);
+            if (num_frames == 0) {
+                // the end of a function that call_defined entered
+                goto done;
+            }
+            Frame *frame = &frames[--num_frames];
+            while (num_iters > frame->for_depth) {
+                    free_iter(&iters[--num_iters]);
+            }
+            for (; num_inputs > frame->input_depth; num_inputs--) {
+                shell_input_pop();
+            }
+            pop_positional(frame, root);
+            if (script->profiled) profile_return();
+            ip = frame->ret;
+            break;
+        }
+        case OP_DEFINE:
+            if (define_function(script, in->a) < 0) {
+                ret = SCRIPT_ERROR;
+                goto done;
+            }
+            break;
+        case OP_EXIT:
+            *status = eval_status(script, in->a, root, *status);
+            ret = SCRIPT_EXIT;
+            goto done;
+        case OP_STATUS:
+            if (in->b >= 0) events_line(in->line_no, script->strs[in->b]);
+            *status = in->a;
+            break;
+        case OP_ARITH: {
+            long long value;
+            events_line(in->line_no, script->strs[in->b]);
+            int bad = arith_eval(script->strs[in->a], root, &value) < 0;
+            // (( )) does its work in the shell, but it is a line of its own
+            if (script->profiled) profile_tick(in->line_no);
+            if (bad) {
+                ret = SCRIPT_ERROR;
+                goto done;
+            }
+            *status = value == 0;
+            break;
+        }
+        case OP_EXPAND: {
+            events_line(in->line_no, script->strs[in->b]);
+            char *text = replace_variables_mk_line(script->strs[in->a], root);
+            if (text == NULL || text == (char *) -1) {
+                ERR_PRINT(ERR_PARSING_LINE);
+                ret = SCRIPT_ERROR;
+                goto done;
+            }
+            free(text);
+            *status = 0;
+            break;
+        }
+        case OP_NOT:
+            *status = !*status;
+            break;
+        case OP_JMP:
+            ip = in->a;
+            break;
+        case OP_JMP_FAIL:
+            if (*status != 0) ip = in->a;
+            break;
+        case OP_JMP_OK:
+            if (*status == 0) ip = in->a;
+            break;
+        case OP_FOR_INIT: {
+            if (num_iters == iters_cap) {
+                iters_cap = iters_cap ? iters_cap * 2 : 8;
+                ForIter *grown = realloc(iters, iters_cap * sizeof(ForIter));
+                if (grown == NULL) {
+                    perror("script_run");
+                    ret = SCRIPT_ERROR;
+                    goto done;
+                }
+                iters = grown;
+            }
+            ForIter *it = &iters[num_iters];
+            size_t num = 0;
+            it->words = split_words(script->strs[in->a], root, &it->buf, &num);
+            if (it->words == NULL) {
+                ret = SCRIPT_ERROR;
+                goto done;
+            }
+            it->next = 0;
+            it->var = in->b;
+            num_iters++;
+            *status = 0;    // what an empty word list leaves
+            break;
+        }
+        case OP_FOR_NEXT: {
+            ForIter *it = &iters[num_iters - 1];
+            char *word = it->words[it->next];
+            if (word == NULL) {
+                ip = in->a;
+                break;
+            }
+            it->next++;
+            if (addOrUpdateVariable(root, script->strs[it->var], word) < 0) {
+                ret = SCRIPT_ERROR;
+                goto done;
+            }
+            break;
+        }
+        case OP_FOR_POP:
+            free_iter(&iters[--num_iters]);
+            break;
+        case OP_INPUT: {
+            if (in->a < 0) break;
+            char *path = replace_variables_mk_line(script->strs[in->a], root);
+            if (path == NULL || path == (char *) -1) {
+                ERR_PRINT(ERR_PARSING_LINE);
+                ret = SCRIPT_ERROR;
+                goto done;
+            }
+            int bad = shell_input_push(path);
+            free(path);
+            if (bad) {
+                // like a failed redirection: the loop does not run
+                *status = 1;
+                ip = in->b + 1;
+            } else {
+                num_inputs++;
+            }
+            break;
+        }
+        case OP_INPUT_POP:
+            shell_input_pop();
+            num_inputs--;
+            break;
+        }
+
+        if (shell_pending_exit_signal()) {
+            ret = SCRIPT_ERROR;
+            break;
+        }
+    }
+
+done:
+    while (num_iters > 0) {
+        free_iter(&iters[--num_iters]);
+    }
+    for (; num_inputs > 0; num_inputs--) {
+        shell_input_pop();
+    }
+    while (num_frames > 0) {
+        pop_positional(&frames[--num_frames], root);
+    }
+    free(iters);
+    free(frames);
+    free(scratch);
+    return ret;
+}
+
+int script_run(Script *script, Variable **root, int *status){
+    return run_code(script, 0, root, status);
+}
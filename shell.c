@@ -7,6 +7,12 @@ void print_help(){
     printf("Options:\n");
     printf("  -h, --help\t\t\tDisplay this help message\n");
     printf("  -i, --init-file=FILE\t\tUse a specific init file. Default is ~/.cscshell_init\n");
+    printf("  -c COMMANDS\t\t\tRun COMMANDS instead of a script file\n");
+    printf("      --dag\t\t\tRun SCRIPT-FILE as a graph of @name nodes\n");
+    printf("  -j N\t\t\t\tRun up to N nodes at once (implies --dag)\n");
+    printf("      --profile[=FILE]\t\tReport the time spent on each line at exit,\n");
+    printf("\t\t\t\twith folded stacks in FILE (default %s)\n", PROFILE_DEFAULT_FILE);
+    printf("      --events-fd=N\t\tWrite line, spawn and exit events to fd N as JSON lines\n");
     printf("If no script file is given, cscshell will run in interactive mode\n");
 }
 
@@ -20,8 +26,13 @@ char *prompt(char *line, size_t line_length){
 
     char user_buff[MAX_USER_BUF];
     if (getlogin_r(user_buff, MAX_USER_BUF)){
-        perror("prompt:");
-        return (char *) -1;
+        // no controlling terminal, e.g. stdin is a pipe
+        struct passwd *pw_data = getpwuid(getuid());
+        if (pw_data == NULL){
+            perror("prompt:");
+            return (char *) -1;
+        }
+        snprintf(user_buff, MAX_USER_BUF, "%s", pw_data->pw_name);
     }
 
     printf("%s@<%s> %s", user_buff, cwd_buff, PROMPT_STR);
@@ -33,29 +44,71 @@ int run_interactive(Variable **root){
     long error;
     char line[MAX_SINGLE_LINE];
 
+    // lines of a statement that is still open (if/while/for, here-doc...)
+    char **pending = NULL;
+    size_t num_pending = 0, pending_cap = 0;
+
     #ifdef DEBUG
     printf("Interactive CSCSHELL starting...\n");
     #endif
 
-    while ((error = (long) prompt(line, MAX_SINGLE_LINE)) > 0) {
-        // kill the newline
-        line[strlen(line) - 1] = '\0';
-
-        Command *commands = parse_line(line, root);
-        if (commands == (Command *) -1){
-            ERR_PRINT(ERR_PARSING_LINE);
+    while (1) {
+        errno = 0;
+        if (num_pending == 0){
+            error = (long) prompt(line, MAX_SINGLE_LINE);
+        }
+        else {
+            printf(CONTINUATION_PROMPT_STR);
+            error = (long) fgets(line, MAX_SINGLE_LINE, stdin);
+        }
+        if (error == 0 && errno == EINTR){
+            // interrupted at the prompt: start a fresh line
+            clearerr(stdin);
+            free_lines(pending, num_pending);
+            pending = NULL;
+            num_pending = pending_cap = 0;
+            if (shell_pending_exit_signal()) break;
+            printf("\n");
             continue;
         }
-        if (commands == NULL) continue;
+        if (error <= 0) break;
+
+        // kill the newline
+        line[strcspn(line, "\n")] = '\0';
 
-        int *last_ret_code_pt = execute_line(commands);
-        if (last_ret_code_pt == (int *) -1){
-            ERR_PRINT(ERR_EXECUTE_LINE);
-            free(last_ret_code_pt);
-            return -1;
+        if (num_pending == pending_cap){
+            pending_cap = pending_cap ? pending_cap * 2 : 8;
+            char **grown = realloc(pending, pending_cap * sizeof(char *));
+            if (grown == NULL){
+                perror("run_interactive");
+                error = -1;
+                break;
+            }
+            pending = grown;
         }
-        free(last_ret_code_pt);
+        if ((pending[num_pending] = strdup(line)) == NULL){
+            perror("run_interactive");
+            error = -1;
+            break;
+        }
+        num_pending++;
+
+        int incomplete;
+        Script *script = script_compile(pending, num_pending, &incomplete);
+        if (script == NULL && incomplete) continue;
+
+        free_lines(pending, num_pending);
+        pending = NULL;
+        num_pending = pending_cap = 0;
+        if (script == NULL) continue;
+
+        int ret = script_run(script, root, &shell_last_status);
+        script_free(script);
+        if (ret == SCRIPT_EXIT) break;
+
+        if (shell_pending_exit_signal()) break;
     }
+    free_lines(pending, num_pending);
     printf("\n");
 
     #ifdef DEBUG
@@ -63,7 +116,7 @@ int run_interactive(Variable **root){
     #endif
 
     // 0 on EOF, -1 on other errors
-    return (int) error;
+    return error < 0 ? -1 : 0;
 }
 
 
@@ -71,6 +124,9 @@ int main(int argc, char *argv[]){
 
     int num_args_parsed = 0;
     char *init_file = DEFAULT_INIT;
+    char *command_string = NULL;
+    int dag = 0;
+    long max_jobs = sysconf(_SC_NPROCESSORS_ONLN);
 
     for (int i=1; i < argc; i++){
         if (strcmp(argv[i], "-h") == 0 ||
@@ -91,10 +147,56 @@ int main(int argc, char *argv[]){
             }
         }
 
-        else if (strncmp(argv[1], LONG_INIT_ARG,
+        else if (strcmp(argv[i], "-c") == 0){
+            if (i + 1 < argc){
+                command_string = argv[i + 1];
+                i++;
+                num_args_parsed += 2;
+            }
+            else{
+                fprintf(stderr, ERR_ARGS_MISSING_C);
+                return -1;
+            }
+        }
+
+        else if (strcmp(argv[i], LONG_DAG_ARG) == 0){
+            dag = 1;
+            num_args_parsed++;
+        }
+
+        else if (strcmp(argv[i], "-j") == 0){
+            char *end = NULL;
+            if (i + 1 < argc){
+                max_jobs = strtol(argv[i + 1], &end, 10);
+            }
+            if (end == NULL || end == argv[i + 1] || *end != '\0' ||
+                max_jobs < 1 || max_jobs > INT32_MAX){
+                fprintf(stderr, ERR_ARGS_JOBS);
+                return -1;
+            }
+            dag = 1;
+            i++;
+            num_args_parsed += 2;
+        }
+
+        else if (strcmp(argv[i], LONG_PROFILE_ARG) == 0 ||
+                 strncmp(argv[i], LONG_PROFILE_ARG "=", strlen(LONG_PROFILE_ARG) + 1) == 0){
+            char *eq = strchr(argv[i], '=');
+            profile_enable(eq != NULL ? eq + 1 : PROFILE_DEFAULT_FILE);
+            num_args_parsed++;
+        }
+
+        else if (strncmp(argv[i], LONG_EVENTS_ARG, strlen(LONG_EVENTS_ARG)) == 0){
+            if (events_enable(argv[i] + strlen(LONG_EVENTS_ARG)) < 0){
+                return -1;
+            }
+            num_args_parsed++;
+        }
+
+        else if (strncmp(argv[i], LONG_INIT_ARG,
                          strlen(LONG_INIT_ARG)) == 0){
             num_args_parsed++;
-            init_file = strchr(argv[1], '=') + 1;
+            init_file = strchr(argv[i], '=') + 1;
         }
     }
 
@@ -102,6 +204,23 @@ int main(int argc, char *argv[]){
     printf("Using init file at: %s\n", init_file);
     #endif
 
+    int interactive = command_string == NULL && !(num_args_parsed < argc-1);
+    if (dag && (command_string != NULL || interactive)){
+        fprintf(stderr, ERR_DAG_NO_SCRIPT);
+        return -1;
+    }
+    if (profile_enabled() && (dag || interactive)){
+        fprintf(stderr, ERR_PROFILE_NO_SCRIPT);
+        return -1;
+    }
+    if (max_jobs < 1){
+        max_jobs = 1;
+    }
+    init_shell_signals(interactive);
+    if (init_shell_env() < 0){
+        return -1;
+    }
+
     Variable *start_of_vars = NULL;
     if (run_script(init_file, &start_of_vars) < 0){
         ERR_PRINT(ERR_INIT_SCRIPT, init_file);
@@ -113,14 +232,33 @@ int main(int argc, char *argv[]){
         ERR_PRINT(ERR_PATH_INIT, init_file);
     }
 
+    // the last command of a script or -c string may exec in our place
     int ret_code;
-    if (num_args_parsed < argc-1){
-        ret_code = run_script(argv[argc-1], &start_of_vars);
+    if (command_string != NULL){
+        ret_code = run_string(command_string, &start_of_vars);
+    }
+    else if (dag){
+        ret_code = run_dag(argv[argc-1], &start_of_vars, (int) max_jobs);
+    }
+    else if (num_args_parsed < argc-1){
+        ret_code = run_script_last(argv[argc-1], &start_of_vars);
     }
     else{
         ret_code = run_interactive(&start_of_vars);
     }
 
     free_variable(start_of_vars, NON_ZERO_BYTE);
+    metrics_write_file();
+    events_finish();
+    if (ret_code == 0){
+        ret_code = shell_last_status;
+    }
+
+    int sig = shell_pending_exit_signal();
+    if (sig){
+        // die the same way the pipeline did, so our parent sees the signal
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
     return ret_code;
 }
@@ -2,6 +2,10 @@
 #ifndef CSCSHELL_H
 #define CSCSHELL_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,7 +15,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <fcntl.h>
+#include <signal.h>
 
 #include <dirent.h>
 #include <pwd.h>
@@ -20,6 +26,10 @@
 // Arg help
 #define LONG_HELP_ARG "--help"
 #define LONG_INIT_ARG "--init-file="
+#define LONG_DAG_ARG "--dag"
+#define LONG_PROFILE_ARG "--profile"
+#define PROFILE_DEFAULT_FILE "cscshell.folded"
+#define LONG_EVENTS_ARG "--events-fd="
 #define DEFAULT_INIT "~/.cscshell_init"
 
 // Buffer sizes
@@ -29,17 +39,101 @@
 
 // Prompt config
 #define PROMPT_STR "<:"
+#define CONTINUATION_PROMPT_STR "> "
 
 // other strings and values
 #define PATH_VAR_NAME "PATH"
 #define CD "cd"
+#define EXPORT_BUILTIN "export"
+#define UNSET_BUILTIN "unset"
 #define VARIABLE_PARSE_MARKER '$'
 #define PARSING_START_MARKER '<'
 #define PARSING_END_MARKER '>'
 #define NON_ZERO_BYTE 0x42
 
+// Shell options, set like variables (e.g. timeout=30)
+#define OPT_TIMEOUT "timeout"
+#define OPT_PIPESIZE "pipesize"
+#define OPT_AFFINITY "affinity"
+#define OPT_MEMODIR "memodir"
+#define OPT_MEMOSIZE "memosize"
+#define OPT_METRICSFILE "metricsfile"
+#define OPT_METRICSINTERVAL "metricsinterval"
+#define OPT_PATHINDEXDIR "pathindexdir"
+#define OPT_STDERRBUF "stderrbuf"
+#define PIPE_MAX_SIZE_FILE "/proc/sys/fs/pipe-max-size"
+#define TIMEOUT_KILL_GRACE 2
+#define TIMEOUT_EXIT_CODE 124
+
+#define MAX_EPOLL_EVENTS 32
+
+// Metrics
+#define STATS_BUILTIN "stats"
+#define METRICS_DEFAULT_INTERVAL 15     // seconds between textfile writes
+#define METRICS_FORK_BUCKETS 9
+#define METRICS_MAX_CODE 255            // exit codes above share the last slot
+
+// Builtins
+#define SHELL_READ_BUF (1 << 16)
+#define MAX_INPUT_DEPTH 64
+
+// Scripting
+#define MAX_POSITIONAL 9
+#define MAX_CALL_DEPTH 1000
+#define SCRIPT_OK 0
+#define SCRIPT_EXIT 1
+#define SCRIPT_ERROR -1
+
+// DAG mode: `@name after: a,b consumes: x produces: y` node headers
+#define DAG_NODE_MARKER '@'
+#define DAG_AFTER "after:"
+#define DAG_CONSUMES "consumes:"
+#define DAG_PRODUCES "produces:"
+
+// limit [mem=SIZE] [cpu=SEC] [cpus=N] [nofile=N] [nproc=N] [fsize=SIZE]
+//       [cgroup] -- cmd args...
+#define LIMIT_BUILTIN "limit"
+#define LIMIT_CGROUP_FLAG "cgroup"
+#define CGROUP_CPU_PERIOD_US 100000
+// a stage stopped by a limit (signal N) reports LIMIT_EXIT_BASE + N
+#define LIMIT_EXIT_BASE 192
+
+// memo [--inputs F,G] [--vars A,B] [--mtime] -- cmd args...
+#define MEMO_BUILTIN "memo"
+#define MEMO_INPUTS_FLAG "--inputs"
+#define MEMO_VARS_FLAG "--vars"
+#define MEMO_MTIME_FLAG "--mtime"
+#define MEMO_DEFAULT_DIR ".cache/cscshell/memo"     // under $HOME
+#define MEMO_DEFAULT_MAX (1LL << 30)
+#define MEMO_OUTPUT_EXT ".out"
+#define MEMO_STATUS_EXT ".st"
+
+// the shared executable index of each PATH value (see pathindex.c)
+#define PATH_INDEX_DEFAULT_DIR ".cache/cscshell/pathindex"  // under $HOME
+#define PATH_INDEX_MAGIC "CSCPIX1"
+#define PATH_INDEX_RECHECK_MS 1000
+
+// --events-fd: events held while the reader is slow, and the wait for it at exit
+#define EVENTS_MAX_BUFFER (1 << 20)
+#define EVENTS_EXIT_TIMEOUT_MS 2000
+
+// stderrbuf=: how the captured stderr of a failed stage is printed
+#define STDERR_DUMP_PREFIX "[%d:%s] "
+#define STDERR_DUMP_DROPPED "[%d:%s] ... %lld earlier bytes dropped\n"
+
+// chunked [-j N] [--fixed N] -- cmd args...
+#define CHUNK_BUILTIN "chunked"
+#define CHUNK_JOBS_FLAG "-j"
+#define CHUNK_FIXED_FLAG "--fixed"
+#define CHUNK_HEADROOM 2048     // bytes of ARG_MAX kept spare, as xargs does
+
 // Error Strings
 #define ERR_ARGS_MISSING "Missing init file path after argument: '-i'\n"
+#define ERR_ARGS_MISSING_C "Missing commands after argument: '-c'\n"
+#define ERR_ARGS_JOBS "Missing or invalid job count after argument: '-j'\n"
+#define ERR_DAG_NO_SCRIPT "--dag needs a script file\n"
+#define ERR_PROFILE_NO_SCRIPT "--profile needs a script file or -c, and no --dag\n"
+#define ERR_ARGS_EVENTS "Invalid file descriptor after argument: '--events-fd': %s\n"
 #define ERR_PATH_INIT "PATH not defined in init file %s, or not at the head \
 of the variable list."
 #define ERR_PARSING_LINE "Could not parse line into commands.\n"
@@ -53,6 +147,25 @@ of the variable list."
 #define ERR_NO_EXECU "Could not resolve executable [%s]\n"
 #define ERR_VAR_USAGE "Variable could not be parsed from %s\n"
 #define ERR_VAR_NOT_FOUND "Could not find variable: <%s>\n"
+#define ERR_BAD_OPTION "Invalid value for option %s: %s\n"
+#define ERR_TIMEOUT "Line timed out after %ld seconds\n"
+#define ERR_LIMIT_SPEC "Invalid limit: %s\n"
+#define ERR_LIMIT_USAGE "Usage: limit [KEY=VALUE|cgroup]... -- command [args]\n"
+#define ERR_MEMO_USAGE "Usage: memo [--inputs F,G] [--vars A,B] [--mtime] \
+-- command [args]\n"
+#define ERR_CHUNK_USAGE "Usage: chunked [-j N] [--fixed N] -- command [args]\n"
+#define ERR_STATS_USAGE "Usage: stats\n"
+#define ERR_LIMIT_HIT "%s stopped by its %s limit\n"
+#define ERR_NO_CGROUP "No writable cgroup v2 hierarchy, cpus= limit ignored\n"
+#define ERR_UNSET_PATH "PATH cannot be unset.\n"
+#define ERR_SCRIPT_SYNTAX "Syntax error on line %d: %s\n"
+#define ERR_CALL_DEPTH "Function %s nested too deeply\n"
+#define ERR_HEREDOC_EOF "Here-document ended by end of file (wanted `%s')\n"
+#define ERR_ARITH "Arithmetic: %s at '%s'\n"
+#define ERR_DAG_DUPLICATE "Node %s is defined twice\n"
+#define ERR_DAG_UNKNOWN "Node %s is after unknown node %s\n"
+#define ERR_DAG_CYCLE "Dependency cycle through node %s\n"
+#define ERR_INPUT_DEPTH "Loop input redirections nested too deeply\n"
 
 #define ERR_PRINT(...) fprintf(stderr, "ERROR: ");\
     fprintf(stderr, __VA_ARGS__);
@@ -72,19 +185,181 @@ typedef struct Variable{
     char *name;
     char *value;
     struct Variable *next;
+    long env_index;         // slot in shell_envp if exported, else -1
 } Variable;
 
+/*
+** NULL-terminated "NAME=VALUE" array handed to execve. Exported
+** variables update their own slot in place when they change.
+*/
+extern char **shell_envp;
+
+/*
+** Resource limits attached to a command by the `limit` prefix.
+** Zero fields are left alone.
+*/
+typedef struct ResourceLimits {
+    long long mem_bytes;
+    long long cpu_sec;
+    long long cpu_quota_us;     // cpu.max quota per CGROUP_CPU_PERIOD_US
+    long long nofile;
+    long long nproc;
+    long long fsize;
+    uint8_t use_cgroup;
+    char *cgroup_path;          // leaf created for the running child
+} ResourceLimits;
+
+/*
+** What the `memo` prefix keys a command's cached output on, besides
+** its working directory, executable and arguments.
+*/
+typedef struct MemoSpec {
+    char *inputs;               // comma-separated files, NULL for none
+    char *vars;                 // comma-separated variable names
+    uint8_t by_mtime;           // key inputs on size+mtime, not content
+} MemoSpec;
+
+/*
+** How the `chunked` prefix splits a command's arguments into batches.
+*/
+typedef struct ChunkSpec {
+    int max_jobs;               // batches running at once
+    int fixed;                  // arguments repeated in each batch, -1 for
+                                // the command's leading options
+} ChunkSpec;
+
+struct Command;
+
+/*
+** A <(cmd) or >(cmd) argument: the inner pipeline runs alongside the
+** command, which gets /dev/fd/N for its end of the connecting pipe.
+*/
+typedef struct ProcSubst {
+    struct Command *commands;
+    int arg_index;              // the args slot holding /dev/fd/N
+    uint8_t is_output;          // >(cmd): the command writes into it
+    int fd;                     // the command's end while it starts
+    char fd_path[32];           // "/dev/fd/N", the command's argument
+    struct ProcSubst *next;
+} ProcSubst;
+
+/*
+** An in-process builtin, reading in_fd and writing out_fd.
+** Returns its exit status.
+*/
+typedef int (*BuiltinFunc)(struct Command *cmd, int in_fd, int out_fd);
+
 typedef struct Command {
     char *exec_path;
-    char **args;
+    char **args;                // slices of the head command's arg_buf
+    char *arg_buf;              // the parsed line, owned by the head only
     struct Command *next;
     uint32_t stdin_fd;
     uint32_t stdout_fd;
+    pid_t pgid;
     char *redir_in_path;
     char *redir_out_path;
     uint8_t redir_append;
+    char *heredoc_delim;
+    char *heredoc_body;
+    size_t heredoc_len;
+    uint8_t heredoc_expand;
+    ResourceLimits *limits;
+    MemoSpec *memo;             // NULL unless run through `memo`
+    ChunkSpec *chunk;           // NULL unless run through `chunked`
+    struct Script *group;       // the list of a ( list ) or { list; } stage
+    uint8_t group_is_brace;     // { list; }: runs in the shell when alone
+    pid_t pid;
+    int stage;                  // position in the pipeline, from 0
+    long long started_ns;       // when it was forked, CLOCK_MONOTONIC
+    struct StderrRing *stderr_ring; // its captured stderr, while it runs
+    ProcSubst *substs;
+    BuiltinFunc builtin;        // NULL for external commands
+    Variable **variables;       // the list the line was parsed against
 } Command;
 
+/*
+** Options that tune how lines are executed. Each field is set by
+** assigning the matching lowercase shell variable (see OPT_* above).
+*/
+typedef struct ShellOptions {
+    long timeout_sec;       // per-line timeout, 0 to wait forever
+    long pipe_size;         // F_SETPIPE_SZ for pipeline pipes, 0 for default
+    char *memo_dir;         // memo store, NULL for ~/MEMO_DEFAULT_DIR
+    long long memo_max;     // memo store size before eviction, 0 for default
+    char *metrics_file;     // Prometheus textfile to keep current, or NULL
+    long metrics_interval;  // seconds between its writes, 0 for default
+    char *path_index_dir;   // executable indexes, NULL for ~/PATH_INDEX_DEFAULT_DIR
+    long long stderr_buf;   // stderr kept per stage for failures, 0 for none
+} ShellOptions;
+
+/*
+** The shell's counters, bumped in place on the hot paths and exported
+** by metrics.c.
+*/
+typedef struct ShellMetrics {
+    unsigned long long lines_parsed;
+    unsigned long long lines_executed;
+    unsigned long long commands_spawned;
+    unsigned long long cache_hits;      // script statements parsed earlier
+    unsigned long long cache_misses;
+    unsigned long long path_index_hits; // executables found in the index
+    unsigned long long path_index_misses;
+    unsigned long long fork_buckets[METRICS_FORK_BUCKETS + 1];
+    unsigned long long fork_ns_sum;
+    unsigned long long exit_codes[METRICS_MAX_CODE + 1];
+    long long peak_rss;                 // bytes, largest reaped stage
+} ShellMetrics;
+
+extern ShellOptions shell_options;
+extern ShellMetrics shell_metrics;
+
+/*
+** Updates shell_options if name is one of the option variables,
+** otherwise does nothing.
+*/
+void set_shell_option(const char *name, const char *value);
+
+/*
+** Installs the shell's signal handlers. SIGINT, SIGTERM, SIGHUP and
+** SIGQUIT are forwarded to the process group of the running pipeline.
+*/
+void init_shell_signals(int interactive);
+
+/*
+** Returns the signal the shell should exit with once it has cleaned
+** up (a forwarded SIGTERM, or SIGINT when not interactive), else 0.
+*/
+int shell_pending_exit_signal(void);
+
+
+/*
+** True for characters allowed in variable names (letters and '_').
+*/
+int isValidVarChar(char c);
+
+/*
+** Sets a variable, adding it to the list if needed. PATH is kept at
+** the head of the list.
+**
+** Returns 0 on success, -1 on error.
+*/
+int addOrUpdateVariable(Variable **variables, char *name, char *value);
+
+/*
+** Copies the shell's environ into shell_envp.
+**
+** Returns 0 on success, -1 on error.
+*/
+int init_shell_env(void);
+
+/*
+** Removes a variable from the list and the environment; a name that is
+** only in the inherited environment is dropped from shell_envp.
+**
+** Returns 0 on success (also when name is not set), -1 on error.
+*/
+int unset_variable(Variable **variables, const char *name);
 
 /*
 ** Parses a single line of text and returns a linked list of commands.
@@ -118,7 +393,29 @@ Command *parse_line(char *line, Variable **variables);
 ** system calls fail and the shell needs to exit.
 */
 char *replace_variables_mk_line(const char *line,
-                                Variable *variables);
+                                Variable **variables);
+
+/*
+** Splits line into words the way a command's arguments are split:
+** quotes group blanks into one word, variables are expanded and an
+** unquoted word that expands to nothing is dropped. The words point
+** into *arg_buf.
+**
+** Returns a NULL-terminated heap array of *num_words words, or NULL on
+** an error (printed), such as a | or redirection in line. The caller
+** frees the array and *arg_buf.
+*/
+char **split_words(const char *line, Variable **variables, char **arg_buf,
+                   size_t *num_words);
+
+/*
+** Evaluates an arithmetic expression, as found in $(( expr )) and
+** (( expr )), over 64-bit integers. Assignments such as `i += 1` or
+** `i++` update the variables.
+**
+** Returns 0 with the value in *result, or -1 on an error (printed).
+*/
+int arith_eval(const char *expr, Variable **variables, long long *result);
 
 /*
 ** This function is provided for you and should not be modified.
@@ -146,6 +443,122 @@ int cd_cscshell(const char *target_dir);
 */
 char *resolve_executable(const char *command_name, Variable *path);
 
+/*
+** A running line: every stage of one pipeline, sharing a process group.
+** Jobs are driven by the executor's event loop in run_shell.c.
+*/
+typedef struct Job {
+    Command *head;
+    Command *tail;          // last stage, whose status is the job's
+    pid_t pgid;
+    int num_running;        // stages not reaped yet
+    int num_io;             // shell-side pipes still open for the job
+    int last_code;          // exit code of the last stage
+    long timeout_sec;
+    long long deadline_ms;  // CLOCK_MONOTONIC ms, 0 for none
+    uint8_t timed_out;
+    uint8_t failed;         // a stage could not be started
+    uint8_t foreground;     // owns the terminal while running
+    uint8_t done;
+    struct Job *next;
+} Job;
+
+/*
+** Starts every stage of a line without waiting for them. A foreground
+** job gets the terminal in interactive mode.
+**
+** Returns the new job, or NULL if the executor could not be set up.
+*/
+Job *job_start(Command *head, int foreground);
+
+/*
+** Runs the event loop until the job has finished.
+**
+** Returns the exit code of the last stage, TIMEOUT_EXIT_CODE when the
+** line timed out, or -1 if a stage could not be started.
+*/
+int job_wait(Job *job);
+
+/*
+** Forks a copy of the shell, in its own process group, that runs
+** body(arg) and exits with what it returns. stage is a zeroed Command
+** owned by the caller which stands for the child in the job.
+**
+** Returns the new job (already done and failed if the fork failed),
+** or NULL if the executor could not be set up.
+*/
+Job *job_start_subshell(Command *stage, int (*body)(void *arg), void *arg);
+
+void job_free(Job *job);
+
+/*
+** Waits up to timeout_ms (-1 forever) for one batch of events: child
+** exits, timeouts, forwarded signals and shell-side pipe I/O.
+**
+** Returns 0, or -1 on an unrecoverable error.
+*/
+int executor_run_once(int timeout_ms);
+
+/*
+** Hands a copy of buf to the event loop, which writes it into the
+** pipe fd as the reader drains it and then closes fd.
+**
+** Returns 0 on success, -1 on error.
+*/
+int executor_write_pipe(int fd, const char *buf, size_t len);
+
+/*
+** Writes all of buf to fd, retrying short writes.
+**
+** Returns 0 on success, -1 on error (errno set).
+*/
+int write_all(int fd, const char *buf, size_t len);
+
+/*
+** Looks up an in-process builtin (echo, read, true, false).
+**
+** Returns its function, or NULL if name is not a builtin.
+*/
+BuiltinFunc find_builtin(const char *name);
+
+/*
+** The shell's own stdin: the file of the innermost `done < file` loop,
+** or STDIN_FILENO.
+*/
+int shell_input_fd(void);
+
+/*
+** Opens path as the shell's input for a redirected loop, until the
+** matching shell_input_pop.
+**
+** Returns 0 on success, -1 on error (printed).
+*/
+int shell_input_push(const char *path);
+
+void shell_input_pop(void);
+
+/*
+** Gives the unread part of the shared read buffer back to fd (by
+** seeking back) if the buffer holds fd's data. Called before a child
+** inherits fd, so it reads from where `read` stopped.
+*/
+void shell_input_sync(int fd);
+
+/*
+** Drops the shared read buffer without touching any fd, for a child
+** that no longer shares the parent's view of it.
+*/
+void shell_input_forget(void);
+
+/*
+** Reads one line from fd, without its newline, into a buffer owned by
+** the reader that stays valid until the next call.
+**
+** Returns 1 for a whole line, 0 at end of input (*line may still hold
+** a last unterminated line), -1 on error.
+*/
+int shell_read_line(int fd, char **line, size_t *len);
+
 /*
 ** Executes a single "line" of commands (through pipes)
 ** If a command fails, the rest of the line should not be executed.
@@ -162,26 +575,353 @@ int *execute_line(Command *head);
 /*
 ** Forks a new process and execs the command
 ** making sure all file descriptors are set up correctly.
+** The child joins process group command->pgid, or leads a
+** new one when it is 0.
 **
-** Parent process returns -1 on error.
-** Any child processes should not return.
+** Parent process returns the child's pid without waiting for it, or
+** -1 on error; the executor's pidfd watch (or its SIGCHLD fallback)
+** reaps it later. Any child processes should not return.
 */
 int run_command(Command *command);
 
 /*
 ** Executes an entire script line-by-line.
 ** Stops and indicates an error as soon as any line fails.
+** The script's last exit status is left in shell_last_status.
 **
 ** Returns 0 on success, -1 on error
 */
 int run_script(char *file_path, Variable **root);
 
+/*
+** Runs the script the shell was started for, as run_script does, but
+** its last simple command may replace the shell (see exec_tail).
+** Never used for the init file, which has more to run after it.
+*/
+int run_script_last(char *file_path, Variable **root);
+
+/*
+** Runs a script as a dependency graph of `@name` nodes, up to max_jobs
+** of them at once (see dag.c), and prints per-node timings and the
+** critical path to stderr. shell_last_status is the exit code of a
+** failed node, or 0.
+**
+** Returns 0 on success, -1 if the script could not be read or its
+** graph is invalid.
+*/
+int run_dag(char *file_path, Variable **root, int max_jobs);
+
+/*
+** Runs the commands of a -c string, like run_script_last.
+**
+** Returns 0 on success, -1 on error
+*/
+int run_string(const char *source, Variable **root);
+
+/*
+** Execs a line's command in place of the shell, for the last command
+** of a non-interactive run. Does nothing (and returns) unless the line
+** is a single external command that needs nothing from the shell once
+** it has started; otherwise it does not return.
+*/
+void exec_tail(Command *command);
+
+extern int shell_last_status;
+
+/*
+** Reads every line of file into a heap array of heap strings, without
+** their newlines.
+**
+** Returns 0 on success, -1 on error.
+*/
+int read_lines(FILE *file, char ***lines_out, size_t *num_out);
+
+void free_lines(char **lines, size_t num_lines);
+
+/*
+** A script compiled to bytecode (see script.c).
+*/
+typedef struct Script Script;
+
+/*
+** Compiles source lines into a script. Sets *incomplete when the
+** lines end inside an open block or here-doc, so an interactive
+** caller can read more and try again.
+**
+** Returns the script, or NULL on a syntax error (printed) or when
+** incomplete.
+*/
+Script *script_compile(char **lines, size_t num_lines, int *incomplete);
+
+/*
+** Runs a compiled script, leaving the last exit status in *status.
+**
+** Returns SCRIPT_OK, SCRIPT_EXIT after `exit`, or SCRIPT_ERROR when a
+** line could not be parsed or executed.
+*/
+int script_run(Script *script, Variable **root, int *status);
+
+/*
+** Lets the script exec its final command instead of forking it,
+** when it is the last thing the shell will ever run.
+*/
+void script_allow_tail_exec(Script *script);
+
+/*
+** Has the script report its statements to the profiler, which must
+** have been started with profile_begin on the same source lines.
+*/
+void script_enable_profile(Script *script);
+
+/*
+** Drops the caller's hold on a script. Its code lives on while a
+** function it defined is still in the session table.
+*/
+void script_free(Script *script);
+
+/*
+** Per-line profiler for --profile (see profile.c). Hooks cost one test
+** while it is off.
+*/
+typedef enum ProfilePhase {
+    PROFILE_PARSE,
+    PROFILE_EXPAND,
+    PROFILE_RESOLVE,
+    PROFILE_FORK,
+    PROFILE_WAIT,
+    NUM_PROFILE_PHASES
+} ProfilePhase;
+
+// what profile_enter saved, for the matching profile_leave
+typedef struct ProfileMark {
+    void *prev;
+    long long start;
+} ProfileMark;
+
+// turns profiling on, with the folded stacks to be written to path
+void profile_enable(const char *path);
+int profile_enabled(void);
+
+/*
+** Starts profiling a script named name, made of the given lines (which
+** are copied). Does nothing unless profile_enable was called.
+**
+** Returns 0 on success, -1 on error.
+*/
+int profile_begin(const char *name, char **lines, size_t num_lines);
+
+/*
+** Brackets one execution of the statement on line line_no.
+*/
+void profile_enter(ProfileMark *mark, int line_no);
+void profile_leave(ProfileMark *mark);
+
+/*
+** Charges one execution to line line_no as it ends, on a coarse clock,
+** for statements that only ever take microseconds and never fork.
+*/
+void profile_tick(int line_no);
+
+/*
+** Returns a start time for profile_add, or 0 when no profiled line is
+** running. profile_add charges the time since start to phase.
+*/
+long long profile_clock(void);
+void profile_add(int phase, long long start);
+
+// a call of function func from line line_no, and its return
+void profile_call(const char *func, int line_no);
+void profile_return(void);
+
+// prints the report to stderr and writes the folded stacks
+void profile_finish(void);
+
+/*
+** Reads the bodies of any `<<DELIM` here-documents in a parsed line
+** from src, one line at a time up to the delimiter line. Bodies of
+** unquoted delimiters have their variables replaced.
+**
+** Returns 0 on success, -1 on error.
+*/
+int read_heredocs(Command *head, FILE *src, Variable **variables);
+
+/*
+** Drops any here-doc or here-string attached to a command.
+*/
+void clear_heredoc(Command *cmd);
+
+/*
+** Sets the placement used for pipeline stages from the value of the
+** affinity option: "none", "auto", "node:N" or CPU lists split by '/'
+** (see affinity.c).
+**
+** Returns 0 on success, -1 if value is not a valid placement.
+*/
+int affinity_set(const char *value);
+
+/*
+** Child side: pins stage number `stage` of its pipeline to its CPUs
+** (and memory node), as chosen by affinity_set. Failures are printed
+** but do not stop the command.
+*/
+void affinity_apply_child(int stage);
+
+/*
+** Parses a byte count such as "512", "64K" or "2G".
+**
+** Returns 0 on success, -1 if value is not a size.
+*/
+int parse_size(const char *value, long long *out);
+
+/*
+** Parses one `limit` argument (KEY=VALUE or the cgroup flag) into limits.
+**
+** Returns 0 on success, -1 (after printing why) on a bad spec.
+*/
+int parse_limit_spec(ResourceLimits *limits, const char *spec);
+
+/*
+** Parent side, before the fork: creates the cgroup leaf for a command
+** whose limits ask for one. Falls back to plain rlimits when no
+** writable cgroup v2 hierarchy exists.
+**
+** Returns 0 on success, -1 on error.
+*/
+int limits_prepare(Command *command);
+
+/*
+** Child side, right before exec: joins the cgroup leaf and applies the
+** rlimits. Exits the child if a limit cannot be set.
+*/
+void limits_apply_child(ResourceLimits *limits);
+
+/*
+** Parent side, after the child is reaped: reports a limit that stopped
+** the command and removes its cgroup leaf.
+**
+** Returns the exit code to use for the command.
+*/
+int limits_finish(Command *command, int code);
+
+void free_limits(ResourceLimits *limits);
+
+/*
+** Adds the value of a memo --inputs or --vars flag to memo.
+**
+** Returns 0 on success, -1 (after printing why) on a bad flag.
+*/
+int memo_add_option(MemoSpec *memo, const char *option, const char *value);
+
+/*
+** Child side, after the fds are set up: serves a memoized command from
+** the cache and exits on a hit. On a miss it returns in a new child
+** whose stdout feeds the cache, and which goes on to run the command.
+** Returns straight away for commands without memo, or without a store.
+*/
+void memo_run_child(Command *command);
+
+void free_memo(MemoSpec *memo);
+
+/*
+** Sets the value of a chunked -j or --fixed flag in chunk.
+**
+** Returns 0 on success, -1 (after printing why) on a bad flag.
+*/
+int chunk_add_option(ChunkSpec *chunk, const char *option, const char *value);
+
+/*
+** Child side, right before exec: splits the arguments of a `chunked`
+** command into batches that fit ARG_MAX and forks one child per batch,
+** which returns with command->args set to its batch. The stage itself
+** exits with the highest exit code of its batches. Returns straight
+** away for other commands.
+*/
+void chunk_run_child(Command *command);
+
+// records the time one fork() took, and the exit of a reaped stage
+void metrics_observe_fork(long long ns);
+void metrics_observe_exit(int code, const struct rusage *ru);
+
+/*
+** Prints every metric to out in the Prometheus text format.
+**
+** Returns 0 on success, -1 on a write error.
+*/
+int metrics_print(FILE *out);
+
+/*
+** Replaces the metricsfile with the current metrics, if one is set.
+**
+** Returns 0 on success, -1 (after printing why) on error.
+*/
+int metrics_write_file(void);
+
+// writes the metricsfile when metricsinterval has passed since the last time
+void metrics_tick(void);
+
+/*
+** Looks command_name up in the shared index of path's directories,
+** building or refreshing the index first if it is missing or stale.
+**
+** Returns:
+** -- A heap string with the full path of the executable, as
+**    resolve_executable would have found it.
+** -- NULL if the name is not in the index, or the index cannot be used
+**    (names with a '/', cd, a PATH with a missing directory, no index
+**    directory). Callers then fall back to resolve_executable.
+*/
+char *path_index_lookup(const char *command_name, Variable *path);
+
+// forgets the mapped index, so the next lookup opens it afresh
+void path_index_close(void);
+
+/*
+** Sends events to fd N (the argument of --events-fd=), which the
+** shell's children do not inherit.
+**
+** Returns 0 on success, -1 (after printing why) if N is no open fd.
+*/
+int events_enable(const char *arg);
+
+// the fd events are written to, or -1 when they are off
+int events_fd(void);
+
+// queue one event: a script line starting, a stage forked or reaped
+void events_line(int line_no, const char *text);
+void events_spawn(const Command *cmd);
+void events_exit(const Command *cmd, int status, int code, const struct rusage *ru);
+
+/*
+** Writes as much of the queue as the fd takes without blocking.
+**
+** Returns 1 if events are still queued, 0 if none are (or events are
+** off, e.g. after the reader went away).
+*/
+int events_flush(void);
+
+// at exit: waits up to EVENTS_EXIT_TIMEOUT_MS for the reader to take the rest
+void events_finish(void);
+
+// child side: the parent's queue is not ours to send
+void events_forget(void);
+
+/*
+** Child side, for a stage that does not go straight to an exec: closes
+** what an exec would have, so the stage does not hold other pipes open.
+*/
+void close_cloexec_fds(void);
+
 /*
 ** Implement the following function that frees all the
 ** heap memory associated with a particular command.
  */
 void free_command(Command *command);
 
+/*
+** Frees every command in a list built by parse_line.
+*/
+void free_command_list(Command *head);
+
 /*
 ** Implement the following function that frees variable(s).
 **
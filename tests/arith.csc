@@ -0,0 +1,7 @@
+# 64-bit arithmetic wraps instead of trapping
+echo $(( (-9223372036854775807 - 1) / -1 ))
+echo $(( (-9223372036854775807 - 1) % -1 ))
+echo $(( 7 / -1 ))
+x=$(( -9223372036854775807 - 1 ))
+echo $(( x / -1 ))
+echo $(( y = 5 )) $y
@@ -0,0 +1,17 @@
+# assigning an inherited variable changes what children see, no export needed
+echo home=$HOME
+PATH=/opt/x:$PATH
+env | grep ^PATH=
+HOME=/tmp
+env | grep ^HOME=
+FOO=bar
+env | grep -c ^FOO=
+export FOO
+env | grep ^FOO=
+unset HOME
+env | grep -c ^HOME=
+X=expanded
+export Z=$X Y="a b" # a comment
+env | grep -e ^Z= -e ^Y=
+unset "Z"
+env | grep -c ^Z=
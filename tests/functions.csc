@@ -0,0 +1,8 @@
+# functions belong to the session, so other scripts and later definitions see them
+first() { echo first $1; second $1; }
+second() { echo second $1; }
+first a
+( first b )
+{ second c; }
+second() { echo redefined $1; }
+first d
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Regression tests: runs every tests/NAME.csc through the shell and
+# compares its stdout, followed by "exit N", with tests/NAME.expected.
+#
+#   tests/run.sh [NAME]...
+#
+# The shell runs with a fixed environment (HOME=/home/cscshell and the
+# system PATH), so scripts may rely on both.
+
+SHELL_BIN=${SHELL_BIN:-./shell}
+shell_bin=$(cd "$(dirname "$SHELL_BIN")" && pwd)/$(basename "$SHELL_BIN")
+dir=$(cd "$(dirname "$0")" && pwd)
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+echo "PATH=/usr/bin:/bin" > "$tmp/init"
+
+if [ $# -eq 0 ]; then
+    set -- $(cd "$dir" && ls *.csc | sed 's/\.csc$//')
+fi
+
+failed=0
+for name in "$@"; do
+    ( cd "$tmp" && env -i HOME=/home/cscshell PATH=/usr/bin:/bin \
+        "$shell_bin" -i "$tmp/init" "$dir/$name.csc" ) > "$tmp/out" 2> "$tmp/err"
+    echo "exit $?" >> "$tmp/out"
+    if cmp -s "$tmp/out" "$dir/$name.expected"; then
+        echo "PASS $name"
+    else
+        echo "FAIL $name"
+        diff "$dir/$name.expected" "$tmp/out" | sed 's/^/    /'
+        sed 's/^/    stderr: /' "$tmp/err"
+        failed=$((failed + 1))
+    fi
+done
+
+[ $failed -eq 0 ] || { echo "$failed failed"; exit 1; }
@@ -0,0 +1,28 @@
+# the status of a loop or if is not the status of its failed condition
+loop() {
+    i=0
+    while (( i < 3 )); do (( i++ )); done
+}
+until_loop() {
+    until true; do echo never; done
+}
+no_branch() {
+    if false; then echo never; fi
+}
+empty_for() {
+    false
+    for x in; do echo never; done
+}
+broken() {
+    while true; do false; break; done
+}
+last_body() {
+    for x in a b; do false; done
+}
+if loop; then echo while ok; else echo while failed; fi
+if until_loop; then echo until ok; else echo until failed; fi
+if no_branch; then echo if ok; else echo if failed; fi
+if empty_for; then echo for ok; else echo for failed; fi
+if broken; then echo break ok; else echo break failed; fi
+if last_body; then echo for body ok; else echo for body failed; fi
+while false; do echo never; done
@@ -0,0 +1,12 @@
+# for lists and function arguments split like command arguments
+pair="c d"
+for x in "a b" 'e  f' $pair ""; do echo "[$x]"; done
+show() { echo "1=[$1] 2=[$2] 3=[$3]"; }
+show "a b" c
+show "$pair" 'x y'
+# unquoted expansions split into fields, quoted ones and assignments do not
+files="a b"
+printf "<%s>\n" $files "$files" x$files"y"
+copy=$files
+echo "[$copy]"
+show $pair